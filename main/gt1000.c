@@ -4,15 +4,21 @@
  * File: [gt1000.c] - GT1000 MIDI SysEx driver
  */
 
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/timers.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "gt1000.h"
 #include "gt1000_param.h"
 #include "sysex.h"
+#include "midi_tx.h"
+#include "patch_codec.h"
 
 #define MAX_SYSEX_LENGTH                          64
 
@@ -30,20 +36,331 @@
 #define DT1_COMMAND                               0x12
 
 
-#define MESSAGE_HANDLER_TASK_STACK_SIZE           2048
+// Restoring a cached patch decodes a whole effect block on the stack
+#define MESSAGE_HANDLER_TASK_STACK_SIZE           4096
 #define MESSAGE_HANDLER_TASK_PRIORITY             5
+#define MESSAGE_QUEUE_LENGTH                      8
+#define CHANNEL_QUEUE_LENGTH                      8
+#define COALESCE_BATCH_SIZE                       MESSAGE_QUEUE_LENGTH
+
+#define DT1_ENVELOPE_LENGTH                       (sizeof(dt1_header) + 4 + 2)
+#define RQ1_LENGTH                                (sizeof(rq1_header) + 4 + 4 + 2)
+
+// A separate request costs its RQ1 and another DT1 envelope on the wire
+#define SYNC_REQUEST_OVERHEAD                     (RQ1_LENGTH + DT1_ENVELOPE_LENGTH)
+// Start, 8 data and stop bits at 31250 baud
+#define MIDI_BYTE_TIME_US                         320
+
+#define RQ1_TIMEOUT_MS                            1000
+
+// Repairs go out this long after the last loss, so bursts are merged
+#define REPAIR_DELAY_MS                           50
+// Repair RQ1s in flight at once
+#define REPAIR_WINDOW                             4
+#define MAX_REPAIR_RANGES                         16
+// One per request the sysex layer can hold
+#define MAX_TRACKED_READS                         SYSEX_MAX_PENDING_REQUESTS
+#define BLOCK_BITMAP_WORDS                        ((GT1000_EFFECT_BLOCK_COUNT + 31) / 32)
+
+#define PREFETCH_TASK_STACK_SIZE                  2048
+// Below every other task, prefetching only uses idle time
+#define PREFETCH_TASK_PRIORITY                    1
+// Prefetch RQ1s in flight, the line stays free for reads the UI waits for
+#define PREFETCH_WINDOW                           2
+// Wait before retrying when the request table or TX queue was full
+#define PREFETCH_RETRY_MS                         100
+// Prefetch ranks: priority blocks, chain blocks, active FX sub-blocks, others
+#define PREFETCH_RANK_COUNT                       4
+
+#define POLL_TASK_STACK_SIZE                      2048
+#define POLL_TASK_PRIORITY                        PREFETCH_TASK_PRIORITY
+#define POLL_DEFAULT_BANDWIDTH_PERCENT            20
+#define POLL_DEFAULT_MIN_INTERVAL_MS              100
+#define POLL_DEFAULT_MAX_INTERVAL_MS              10000
+#define POLL_DEFAULT_PRIORITY_INTERVAL_MS         250
+#define POLL_DEFAULT_VERIFY_INTERVAL_MS           2000
+#define POLL_DEFAULT_PROBE_INTERVAL_MS            5000
+// Probes in a row without an answer before each further one doubles the interval
+#define POLL_PROBE_MAX_UNANSWERED                 3
+#define POLL_PROBE_MAX_BACKOFF_MS                 300000
+// One drift check a second costs about 5% of the line
+#define POLL_DEFAULT_DRIFT_INTERVAL_MS            1000
+// Budget bytes saved up while nothing is due
+#define POLL_BURST_BYTES                          256
+// Longest sleep of the poll task, config changes wake it anyway
+#define POLL_IDLE_WAIT_MS                         1000
+#define MIDI_LINE_RATE_BYTES                      (1000000 / MIDI_BYTE_TIME_US)
+// Set by the notification enable sequence, reads back 0 after a power cycle
+#define NOTIFICATION_FLAG_OFFSET                  0x7F000001
+// Odd, so a weight times a byte difference is never 0 mod 2^32
+#define BLOCK_HASH_MULTIPLIER                     0x9E3779B1u
+
+#define FX_UNIT_COUNT                             3
+// Each FX block is followed by one sub-block per effect, FX_SUB_BLOCK()
+// gives the index of one after the FX block
+#define FX_SUB_BLOCK(field)                       ((offsetof(gt1000_effect_t, fx1_##field) - \
+                                                    offsetof(gt1000_effect_t, fx1_agsim)) / EFFECT_BLOCK_SIZE)
+#define FX_SUB_BLOCK_COUNT                        (FX_SUB_BLOCK(vibrato) + 1)
+// FX TYPE runs 0-33
+#define FX_TYPE_COUNT                             34
+// An FX TYPE with no known sub-block, every sub-block of its unit counts
+#define FX_TYPE_UNKNOWN                           -2
 
 #define TAG "GT1000"
 
 static gt1000_t device = {0};
+// device.patch_number holds a number the device sent
+static bool patch_number_known;
 
 static QueueHandle_t message_queue;
+static QueueHandle_t channel_queue;
+static QueueSetHandle_t message_set;
 static TaskHandle_t handler_task;
 
 static uint8_t device_id = 0x7F;
 
 static gt1000_callback_t callback = NULL;
 
+typedef struct {
+    uint32_t dev_addr;
+    uint32_t size;
+    bool requested;
+} repair_range_t;
+
+typedef struct {
+    repair_range_t ranges[MAX_REPAIR_RANGES];
+    int range_count;
+    // Per effect block: data received since boot, waiting for repair, repair in flight
+    uint32_t synced_blocks[BLOCK_BITMAP_WORDS];
+    uint32_t stale_blocks[BLOCK_BITMAP_WORDS];
+    uint32_t inflight_blocks[BLOCK_BITMAP_WORDS];
+    bool patch_number_stale;
+    bool patch_number_inflight;
+    bool patch_name_synced;
+    bool patch_name_stale;
+    bool patch_name_inflight;
+    int inflight_requests;
+    gt1000_repair_stats_t stats;
+} repair_state_t;
+
+static repair_state_t repair;
+static portMUX_TYPE repair_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t repair_timer;
+
+// A read of the mirror, its replies are applied as one range
+typedef struct {
+    bool active;
+    bool replied;               // The sysex layer completed the request
+    uint32_t id;
+    uint32_t dev_addr;
+    uint32_t next;              // Linear address of the next expected byte
+    uint32_t end;               // Linear address past the last byte
+    uint32_t epoch;             // Patch the read was sent for
+    bool verify;                // A drift check, its replies are hashed instead of applied
+    uint32_t hash;              // Of the replies so far
+    uint32_t expected;          // Block hash when the check was sent
+    sysex_request_callback_t cbk;
+    void *arg;
+} tracked_read_t;
+
+// A drift check that got its last reply
+typedef struct {
+    bool validation;            // Of a block restored from the patch cache
+    uint32_t hash;              // Of the whole reply
+    uint32_t expected;          // Block hash when the check was sent
+} drift_check_t;
+
+static tracked_read_t tracked_reads[MAX_TRACKED_READS];
+static uint32_t tracked_read_count;
+static portMUX_TYPE read_lock = portMUX_INITIALIZER_UNLOCKED;
+// Advances on every preset change, written by the handler only. Guarded by
+// read_lock together with epoch_stats.
+static uint32_t patch_epoch;
+static gt1000_epoch_stats_t epoch_stats;
+
+static gt1000_latency_stats_t latency;
+static uint64_t latency_total_us;
+static portMUX_TYPE latency_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static gt1000_coalesce_stats_t coalesce_stats;
+static portMUX_TYPE coalesce_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Replies outstanding for the last plan sent
+typedef struct {
+    uint32_t generation;
+    int outstanding;
+    int64_t started_at;
+    gt1000_sync_stats_t stats;
+} sync_state_t;
+
+static sync_state_t sync;
+static portMUX_TYPE sync_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+    int next_block;             // Next block index to request
+    int inflight;
+    uint32_t generation;
+    int64_t started_at;
+    // Requested by the snapshot and not landed yet
+    uint32_t requested_blocks[BLOCK_BITMAP_WORDS];
+    // Active FX sub-blocks to send ahead of next_block
+    uint32_t fx_pending[BLOCK_BITMAP_WORDS];
+    gt1000_snapshot_stats_t stats;
+} snapshot_state_t;
+
+static snapshot_state_t snapshot;
+// Blocks fetched whole since the last preset change
+static uint32_t valid_blocks[BLOCK_BITMAP_WORDS];
+// Patch epoch each block was last made valid in
+static uint32_t block_epochs[GT1000_EFFECT_BLOCK_COUNT];
+// Hash of each block of the mirror, kept up to date by apply_range()
+static uint32_t block_hashes[GT1000_EFFECT_BLOCK_COUNT];
+static int snapshot_window;
+static portMUX_TYPE snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+    bool enabled;
+    bool priority_done;         // Since the last preset change
+    bool converged;
+    bool ready;                 // Every priority block valid, validated or not
+    bool cache_hit;             // The patch was restored from the cache
+    int inflight;               // Prefetch RQ1s
+    int64_t preset_changed_at;
+    int priority_blocks[GT1000_MAX_PRIORITY_BLOCKS];
+    int priority_block_count;
+    gt1000_hydration_stats_t stats;
+} hydration_state_t;
+
+// Guarded by snapshot_lock, like the other block bitmaps
+static hydration_state_t hydration;
+// Hydration RQ1 in flight
+static uint32_t fetching_blocks[BLOCK_BITMAP_WORDS];
+// Timed out since the last preset change, the prefetch task leaves them
+static uint32_t failed_blocks[BLOCK_BITMAP_WORDS];
+// Restored from the patch cache and not checked against the device yet
+static uint32_t unverified_blocks[BLOCK_BITMAP_WORDS];
+static TaskHandle_t prefetch_task;
+
+typedef struct {
+    uint32_t interval_ms;
+    int64_t due_at;
+    bool inflight;
+    bool reply_pending;         // The next tracked DT1 for the block answers the poll
+    bool polled;                // The interval has a poll to adapt to
+    bool changed;               // The last poll changed the block
+} poll_entry_t;
+
+typedef struct {
+    gt1000_poll_config_t config;
+    bool notifications_enabled; // By gt1000_enable_notifications()
+    uint32_t tokens;            // Budget bytes
+    int64_t tokens_updated_at;
+    int64_t probe_due_at;
+    bool probe_inflight;        // Sent, and no flag DT1 arrived since
+    uint32_t unanswered_probes; // In a row
+    int64_t verify_due_at;
+    int verify_cursor;          // Next priority block to verify
+    int64_t drift_due_at;
+    int drift_cursor;           // Next block to check for drift
+    bool drift_inflight;
+    int64_t sweep_started_at;
+    poll_entry_t entries[GT1000_EFFECT_BLOCK_COUNT];
+    gt1000_poll_stats_t stats;
+    gt1000_drift_stats_t drift_stats;
+} poll_state_t;
+
+static poll_state_t poll = {
+    .config = {
+        .bandwidth_percent = POLL_DEFAULT_BANDWIDTH_PERCENT,
+        .min_interval_ms = POLL_DEFAULT_MIN_INTERVAL_MS,
+        .max_interval_ms = POLL_DEFAULT_MAX_INTERVAL_MS,
+        .priority_interval_ms = POLL_DEFAULT_PRIORITY_INTERVAL_MS,
+        .verify_interval_ms = POLL_DEFAULT_VERIFY_INTERVAL_MS,
+        .probe_interval_ms = POLL_DEFAULT_PROBE_INTERVAL_MS,
+        .drift_interval_ms = POLL_DEFAULT_DRIFT_INTERVAL_MS,
+    },
+    .stats = {
+        .bytes_per_sec = MIDI_LINE_RATE_BYTES * POLL_DEFAULT_BANDWIDTH_PERCENT / 100,
+    },
+};
+static portMUX_TYPE poll_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t poll_task;
+
+typedef struct {
+    bool used;
+    uint32_t patch_number;
+    uint32_t last_used;         // Cache clock at the last save or hit
+    char patch_name[sizeof(device.patch_name)];
+    uint32_t blocks[BLOCK_BITMAP_WORDS];
+    uint8_t *data;              // The cached blocks, encoded against the cache's reference
+    size_t size;
+    size_t raw_size;            // Extents of the cached blocks
+} patch_cache_entry_t;
+
+// Entries belong to the handler, budget and stats are guarded by cache_lock
+typedef struct {
+    patch_cache_entry_t entries[GT1000_PATCH_CACHE_MAX_ENTRIES];
+    // The first patch saved while the cache was empty, kept until it is empty again
+    patch_codec_reference_t *reference;
+    size_t budget;
+    uint32_t clock;
+    uint64_t hit_ready_total_us;
+    uint64_t miss_ready_total_us;
+    uint32_t hits_ready;
+    uint32_t misses_ready;
+    gt1000_patch_cache_stats_t stats;
+} patch_cache_t;
+
+static patch_cache_t patch_cache;
+static portMUX_TYPE cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const size_t fx_unit_offsets[FX_UNIT_COUNT] = {
+    offsetof(gt1000_effect_t, fx1),
+    offsetof(gt1000_effect_t, fx2),
+    offsetof(gt1000_effect_t, fx3),
+};
+
+// Sub-block of each FX TYPE, in the order of the FX parameter tables. The
+// bass variants have their parameters in the sub-block of the guitar effect.
+static const int8_t fx_type_sub_blocks[] = {
+    FX_SUB_BLOCK(agsim),
+    FX_SUB_BLOCK(acreso),
+    FX_SUB_BLOCK(awah),
+    FX_SUB_BLOCK(chorus),
+    FX_SUB_BLOCK(cvibe),
+    FX_SUB_BLOCK(comp),
+    FX_SUB_BLOCK(defretter),
+    FX_SUB_BLOCK(defretter),        // DEFRETTER BASS
+    FX_SUB_BLOCK(feedbacker),
+    FX_SUB_BLOCK(flanger),
+    FX_SUB_BLOCK(harmonist),
+    FX_SUB_BLOCK(humanizer),
+    FX_SUB_BLOCK(octave),
+    FX_SUB_BLOCK(octave),           // OCTAVE BASS
+    FX_SUB_BLOCK(overtone),
+    FX_SUB_BLOCK(pan),
+    FX_SUB_BLOCK(phaser),
+    FX_SUB_BLOCK(pitchshift),
+    FX_SUB_BLOCK(ringmod),
+    FX_SUB_BLOCK(rotary),
+    FX_SUB_BLOCK(sitarsim),
+    FX_SUB_BLOCK(slicer),
+    FX_SUB_BLOCK(slowgear),
+    FX_SUB_BLOCK(slowgear),         // SLOW GEAR BASS
+    FX_SUB_BLOCK(soundhold),
+    FX_SUB_BLOCK(sbend),
+    FX_SUB_BLOCK(twah),
+    FX_SUB_BLOCK(twah),             // T.WAH BASS
+    FX_SUB_BLOCK(tremolo),
+    FX_SUB_BLOCK(vibrato),
+    // Types past the FX parameter tables
+    FX_TYPE_UNKNOWN,
+    FX_TYPE_UNKNOWN,
+    FX_TYPE_UNKNOWN,
+    FX_TYPE_UNKNOWN,
+};
+_Static_assert(sizeof(fx_type_sub_blocks) == FX_TYPE_COUNT, "One FX sub-block entry per FX TYPE");
+
 static const uint8_t dt1_header[] = {
     0xF0,
     MANUFACTURER_ID,
@@ -102,107 +419,1888 @@ static const uint8_t notification_disable_sequence[] = {
     0xF7
 };
 
-static inline bool is_valid_param_addr(const gt1000_param_addr_t parameter) {
-    const uint8_t *param_addr = (uint8_t *)parameter;
-    const uint8_t *base_addr = (uint8_t *)&device.effect;
-    const uint8_t *end_addr = base_addr + sizeof(gt1000_effect_t);
-    return (param_addr >= base_addr) && (param_addr < end_addr);
+static inline bool is_valid_param_addr(const gt1000_param_addr_t parameter) {
+    const uint8_t *param_addr = (uint8_t *)parameter;
+    const uint8_t *base_addr = (uint8_t *)&device.effect;
+    const uint8_t *end_addr = base_addr + sizeof(gt1000_effect_t);
+    return (param_addr >= base_addr) && (param_addr < end_addr);
+}
+
+static inline bool is_valid_dev_addr(const uint32_t address) {
+    const uint32_t start_addr = PATCH_EFFECT_OFFSET;
+    const uint32_t end_addr = start_addr + sizeof(gt1000_effect_t);
+    return (address >= start_addr) && (address < end_addr);
+}
+
+static inline uint32_t param_addr_to_dev_addr(const gt1000_param_addr_t parameter) {
+    uint32_t param_offset = (uint32_t)parameter - (uint32_t)&device.effect;
+    return PATCH_EFFECT_OFFSET + param_offset;
+}
+
+static inline gt1000_param_addr_t dev_addr_to_param_addr(uint32_t addr) {
+    uint32_t param_offset = addr - PATCH_EFFECT_OFFSET;
+    return (uint8_t *)((uint32_t)&device.effect + param_offset);
+}
+
+static inline uint8_t calculate_checksum(uint8_t *buffer, int length) {
+    uint8_t sum = 0;
+    for (int i = 0; i < length; ++i) {
+        sum += buffer[i];
+    }
+    return -sum & 0x7F;
+}
+
+static int build_rq1(uint8_t *message, uint32_t dev_addr, size_t size);
+static int gt1000_send_rq1(uint32_t dev_addr, size_t size, sysex_request_callback_t cbk, void *arg);
+static void handle_drift_result(const sysex_request_result_t *result, void *arg);
+static void handle_validation_result(const sysex_request_result_t *result, void *arg);
+
+// A block hash is the sum of its bytes times a weight per offset, so a write
+// updates it by the weighted difference alone, and split replies add up
+static inline uint32_t hash_weight(uint32_t dev_addr) {
+    return (2 * (dev_addr & (EFFECT_BLOCK_SIZE - 1)) + 1) * BLOCK_HASH_MULTIPLIER;
+}
+
+// Hash of the data as part of the block it falls in
+static uint32_t hash_range(uint32_t dev_addr, const uint8_t *data, int length) {
+    uint32_t linear = sysex_address_to_linear(dev_addr);
+    uint32_t hash = 0;
+    for (int i = 0; i < length; ++i) {
+        hash += data[i] * hash_weight(sysex_linear_to_address(linear + i));
+    }
+    return hash;
+}
+
+// Copies DT1 data into the mirror. Addresses carry 7 bits per byte, so data
+// that runs past xx7Fh continues at the start of the next block.
+static void apply_range(uint32_t dev_addr, const uint8_t *data, int length) {
+    uint32_t linear = sysex_address_to_linear(dev_addr);
+    while (length > 0) {
+        uint32_t addr = sysex_linear_to_address(linear);
+        int run = 0x80 - (addr & 0x7F);
+        if (run > length) {
+            run = length;
+        }
+        // Blocks are whole, a run that starts in the mirror ends in it
+        if (is_valid_dev_addr(addr)) {
+            uint8_t *mirror = dev_addr_to_param_addr(addr);
+            uint32_t delta = 0;
+            for (int i = 0; i < run; ++i) {
+                delta += (uint32_t)(data[i] - mirror[i]) * hash_weight(addr + i);
+            }
+            memcpy(mirror, data, run);
+            portENTER_CRITICAL(&snapshot_lock);
+            block_hashes[(addr - PATCH_EFFECT_OFFSET) / EFFECT_BLOCK_SIZE] += delta;
+            portEXIT_CRITICAL(&snapshot_lock);
+        }
+        data += run;
+        linear += run;
+        length -= run;
+    }
+}
+
+// True if applying the DT1 data would change the mirror
+static bool range_differs(uint32_t dev_addr, const uint8_t *data, int length) {
+    uint32_t linear = sysex_address_to_linear(dev_addr);
+    while (length > 0) {
+        uint32_t addr = sysex_linear_to_address(linear);
+        int run = 0x80 - (addr & 0x7F);
+        if (run > length) {
+            run = length;
+        }
+        if (is_valid_dev_addr(addr) && memcmp(dev_addr_to_param_addr(addr), data, run) != 0) {
+            return true;
+        }
+        data += run;
+        linear += run;
+        length -= run;
+    }
+    return false;
+}
+
+// Returns the id of the claimed entry, or 0 if none is free
+static uint32_t track_read(uint32_t dev_addr, uint32_t size, sysex_request_callback_t cbk, void *arg) {
+    bool verify = cbk == handle_drift_result || cbk == handle_validation_result;
+    uint32_t expected = 0;
+    if (verify) {
+        portENTER_CRITICAL(&snapshot_lock);
+        expected = block_hashes[(dev_addr - PATCH_EFFECT_OFFSET) / EFFECT_BLOCK_SIZE];
+        portEXIT_CRITICAL(&snapshot_lock);
+    }
+
+    int index = -1;
+    portENTER_CRITICAL(&read_lock);
+    for (int i = 0; i < MAX_TRACKED_READS; ++i) {
+        if (!tracked_reads[i].active) {
+            index = i;
+            break;
+        }
+        // Completed, but its last reply never reached the handler
+        if (tracked_reads[i].replied && index < 0) {
+            index = i;
+        }
+    }
+    uint32_t id = 0;
+    if (index >= 0) {
+        // The index is in the low bits, a late result never matches a reused entry
+        id = ++tracked_read_count * MAX_TRACKED_READS + index;
+        uint32_t start = sysex_address_to_linear(dev_addr);
+        tracked_reads[index] = (tracked_read_t) {
+            .active = true,
+            .id = id,
+            .dev_addr = dev_addr,
+            .next = start,
+            .end = start + sysex_address_to_linear(size),
+            .epoch = patch_epoch,
+            .verify = verify,
+            .expected = expected,
+            .cbk = cbk,
+            .arg = arg,
+        };
+    }
+    portEXIT_CRITICAL(&read_lock);
+    return id;
+}
+
+static void untrack_read(uint32_t id) {
+    tracked_read_t *read = &tracked_reads[id % MAX_TRACKED_READS];
+    portENTER_CRITICAL(&read_lock);
+    if (read->active && read->id == id) {
+        read->active = false;
+    }
+    portEXIT_CRITICAL(&read_lock);
+}
+
+// Runs before the handler applies the last reply. The entry stays until then.
+static void handle_read_result(const sysex_request_result_t *result, void *arg) {
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    tracked_read_t *read = &tracked_reads[id % MAX_TRACKED_READS];
+    sysex_request_callback_t cbk = NULL;
+    void *cbk_arg = NULL;
+
+    portENTER_CRITICAL(&read_lock);
+    if (read->active && read->id == id) {
+        cbk = read->cbk;
+        cbk_arg = read->arg;
+        read->replied = true;
+        // Timed out or cancelled, or every reply was applied already
+        if (result->status != SYSEX_REQUEST_COMPLETED || read->next >= read->end) {
+            read->active = false;
+        }
+    }
+    portEXIT_CRITICAL(&read_lock);
+
+    if (cbk) {
+        cbk(result, cbk_arg);
+    }
+}
+
+// Returns true if the data continues a tracked read, and sets epoch to the
+// patch it was sent for. synced is filled in once the read is complete. verify
+// is set for a drift check, check once its last reply arrived.
+static bool advance_read(uint32_t dev_addr, const uint8_t *data, int length, gt1000_range_t *synced,
+                         uint32_t *epoch, bool *verify, drift_check_t *check) {
+    uint32_t linear = sysex_address_to_linear(dev_addr);
+    bool tracked = false;
+
+    portENTER_CRITICAL(&read_lock);
+    for (int i = 0; i < MAX_TRACKED_READS; ++i) {
+        tracked_read_t *read = &tracked_reads[i];
+        // A notification at the same address is not part of the reply
+        if (!read->active || read->next >= read->end || read->next != linear ||
+            !sysex_is_reply_part(length, read->end - read->next)) {
+            continue;
+        }
+        tracked = true;
+        *epoch = read->epoch;
+        *verify = read->verify;
+        if (read->verify) {
+            read->hash += hash_range(dev_addr, data, length);
+        }
+        read->next += length;
+        if (read->next >= read->end) {
+            *synced = (gt1000_range_t) {
+                .address = read->dev_addr,
+                .size = read->end - sysex_address_to_linear(read->dev_addr),
+            };
+            *check = (drift_check_t) {
+                .validation = read->cbk == handle_validation_result,
+                .hash = read->hash,
+                .expected = read->expected,
+            };
+            if (read->replied) {
+                read->active = false;
+            }
+        }
+        break;
+    }
+    portEXIT_CRITICAL(&read_lock);
+
+    return tracked;
+}
+
+static inline int dev_addr_to_block_index(uint32_t dev_addr) {
+    return (dev_addr - PATCH_EFFECT_OFFSET) / EFFECT_BLOCK_SIZE;
+}
+
+static inline bool bitmap_test(const uint32_t *bitmap, int index) {
+    return bitmap[index / 32] & (1u << (index % 32));
+}
+
+static inline void bitmap_set(uint32_t *bitmap, int index) {
+    bitmap[index / 32] |= (1u << (index % 32));
+}
+
+static inline void bitmap_clear(uint32_t *bitmap, int index) {
+    bitmap[index / 32] &= ~(1u << (index % 32));
+}
+
+static void schedule_repair(TickType_t delay) {
+    if (repair_timer) {
+        xTimerChangePeriod(repair_timer, delay, 0);
+    }
+}
+
+// Must be called with repair_lock held
+static void mark_block_stale(int block) {
+    if (!bitmap_test(repair.inflight_blocks, block)) {
+        bitmap_set(repair.stale_blocks, block);
+    }
+}
+
+// Must be called with repair_lock held
+static void add_repair_range(uint32_t dev_addr, uint32_t size) {
+    int block = dev_addr_to_block_index(dev_addr);
+    if (bitmap_test(repair.stale_blocks, block)) {
+        // Whole block is refetched anyway
+        return;
+    }
+
+    for (int i = 0; i < repair.range_count; ++i) {
+        repair_range_t *range = &repair.ranges[i];
+        if (range->requested || dev_addr_to_block_index(range->dev_addr) != block) {
+            continue;
+        }
+        // Same block, not sent yet: widen the pending request instead
+        uint32_t start = range->dev_addr < dev_addr ? range->dev_addr : dev_addr;
+        uint32_t end = range->dev_addr + range->size > dev_addr + size ?
+            range->dev_addr + range->size : dev_addr + size;
+        range->dev_addr = start;
+        range->size = end - start;
+        return;
+    }
+
+    if (repair.range_count == MAX_REPAIR_RANGES) {
+        mark_block_stale(block);
+        return;
+    }
+
+    repair.ranges[repair.range_count++] = (repair_range_t) {
+        .dev_addr = dev_addr,
+        .size = size,
+    };
+}
+
+// Must be called with repair_lock held
+static void record_unknown_loss(void) {
+    ++repair.stats.unknown_losses;
+
+    // Anything the mirror holds may be behind now. The patch number goes
+    // first: if a preset change was lost, its reply raises PRESET_CHANGE.
+    repair.patch_number_stale = !repair.patch_number_inflight;
+    repair.patch_name_stale = repair.patch_name_synced && !repair.patch_name_inflight;
+    for (int i = 0; i < GT1000_EFFECT_BLOCK_COUNT; ++i) {
+        if (bitmap_test(repair.synced_blocks, i)) {
+            mark_block_stale(i);
+        }
+    }
+}
+
+// Must be called with repair_lock held
+static void record_address_loss(uint32_t dev_addr, int data_length) {
+    switch (dev_addr) {
+        case PATCH_NUMBER_OFFSET:
+            repair.patch_number_stale = !repair.patch_number_inflight;
+            return;
+        case PATCH_NAME_OFFSET:
+            repair.patch_name_stale = !repair.patch_name_inflight;
+            return;
+        default:
+            break;
+    }
+
+    if (!is_valid_dev_addr(dev_addr)) {
+        // Not mirrored, nothing to repair
+        return;
+    }
+
+    uint32_t block_start = dev_addr & ~(EFFECT_BLOCK_SIZE - 1);
+    uint32_t block_end = block_start + gt1000_get_block_extent(dev_addr_to_param_addr(dev_addr));
+    uint32_t end = data_length > 0 ? dev_addr + data_length : block_end;
+    if (end > block_end || dev_addr >= block_end) {
+        end = block_end;
+        dev_addr = dev_addr < block_end ? dev_addr : block_start;
+    }
+
+    add_repair_range(dev_addr, end - dev_addr);
+}
+
+static bool parse_dt1_address(const uint8_t *message, int length, uint32_t *dev_addr) {
+    if (length < sizeof(dt1_header) + 4) {
+        return false;
+    }
+
+    for (int i = 0; i < sizeof(dt1_header); ++i) {
+        if (dt1_header[i] == 0xFF ? message[i] != device_id : message[i] != dt1_header[i]) {
+            return false;
+        }
+    }
+
+    *dev_addr = 0;
+    for (int i = 0; i < 4; ++i) {
+        *dev_addr = (*dev_addr << 8) | message[sizeof(dt1_header) + i];
+    }
+    return true;
+}
+
+static void handle_sysex_loss(const uint8_t *message, int length) {
+    uint32_t dev_addr;
+
+    portENTER_CRITICAL(&repair_lock);
+    ++repair.stats.loss_events;
+    if (message && parse_dt1_address(message, length, &dev_addr)) {
+        // A complete message tells how much data was lost, a truncated one
+        // only where it started.
+        bool complete = message[length - 1] == 0xF7 && length > DT1_ENVELOPE_LENGTH;
+        record_address_loss(dev_addr, complete ? length - DT1_ENVELOPE_LENGTH : 0);
+    } else {
+        record_unknown_loss();
+    }
+    portEXIT_CRITICAL(&repair_lock);
+
+    schedule_repair(pdMS_TO_TICKS(REPAIR_DELAY_MS));
+}
+
+// Returns true if the data completes a repair in flight
+static bool repair_mark_received(uint32_t dev_addr, int length) {
+    bool repaired = false;
+
+    portENTER_CRITICAL(&repair_lock);
+    switch (dev_addr) {
+        case PATCH_NUMBER_OFFSET:
+            repaired = repair.patch_number_inflight;
+            repair.patch_number_inflight = false;
+            break;
+        case PATCH_NAME_OFFSET:
+            repaired = repair.patch_name_inflight;
+            repair.patch_name_inflight = false;
+            repair.patch_name_synced = true;
+            break;
+        default:
+            if (!is_valid_dev_addr(dev_addr)) {
+                break;
+            }
+
+            int block = dev_addr_to_block_index(dev_addr);
+            bitmap_set(repair.synced_blocks, block);
+
+            uint32_t block_start = dev_addr & ~(EFFECT_BLOCK_SIZE - 1);
+            if (bitmap_test(repair.inflight_blocks, block) && dev_addr == block_start &&
+                length >= gt1000_get_block_extent(dev_addr_to_param_addr(dev_addr))) {
+                bitmap_clear(repair.inflight_blocks, block);
+                repaired = true;
+            }
+
+            for (int i = 0; i < repair.range_count; ++i) {
+                repair_range_t *range = &repair.ranges[i];
+                if (range->requested && range->dev_addr >= dev_addr &&
+                    range->dev_addr + range->size <= dev_addr + length) {
+                    repair.ranges[i--] = repair.ranges[--repair.range_count];
+                    repaired = true;
+                }
+            }
+            break;
+    }
+    if (repaired) {
+        ++repair.stats.repairs_completed;
+    }
+    portEXIT_CRITICAL(&repair_lock);
+
+    return repaired;
+}
+
+// Must be called with repair_lock held. Drops the in-flight state of a repair
+// request, a later loss re-adds it.
+static void forget_repair(uint32_t dev_addr) {
+    switch (dev_addr) {
+        case PATCH_NUMBER_OFFSET:
+            repair.patch_number_inflight = false;
+            return;
+        case PATCH_NAME_OFFSET:
+            repair.patch_name_inflight = false;
+            return;
+        default:
+            break;
+    }
+
+    int block = dev_addr_to_block_index(dev_addr);
+    if ((dev_addr & (EFFECT_BLOCK_SIZE - 1)) == 0) {
+        bitmap_clear(repair.inflight_blocks, block);
+    }
+    for (int i = 0; i < repair.range_count; ++i) {
+        if (repair.ranges[i].requested && repair.ranges[i].dev_addr == dev_addr) {
+            repair.ranges[i--] = repair.ranges[--repair.range_count];
+        }
+    }
+}
+
+// Must be called with repair_lock held. Picks the next pending repair and
+// marks it in flight.
+static bool next_repair_request(repair_range_t *request) {
+    if (repair.patch_number_stale) {
+        *request = (repair_range_t) { PATCH_NUMBER_OFFSET, sizeof(device.patch_number) };
+        repair.patch_number_stale = false;
+        repair.patch_number_inflight = true;
+        return true;
+    }
+
+    if (repair.patch_name_stale) {
+        *request = (repair_range_t) { PATCH_NAME_OFFSET, sizeof(device.patch_name) };
+        repair.patch_name_stale = false;
+        repair.patch_name_inflight = true;
+        return true;
+    }
+
+    for (int i = 0; i < GT1000_EFFECT_BLOCK_COUNT; ++i) {
+        if (bitmap_test(repair.stale_blocks, i)) {
+            uint32_t block_addr = PATCH_EFFECT_OFFSET + i * EFFECT_BLOCK_SIZE;
+            *request = (repair_range_t) {
+                block_addr, gt1000_get_block_extent(dev_addr_to_param_addr(block_addr))
+            };
+            bitmap_clear(repair.stale_blocks, i);
+            bitmap_set(repair.inflight_blocks, i);
+            return true;
+        }
+    }
+
+    for (int i = 0; i < repair.range_count; ++i) {
+        repair_range_t *range = &repair.ranges[i];
+        if (bitmap_test(repair.inflight_blocks, dev_addr_to_block_index(range->dev_addr))) {
+            // Covered by a whole block request
+            repair.ranges[i--] = repair.ranges[--repair.range_count];
+            continue;
+        }
+        if (!range->requested) {
+            range->requested = true;
+            *request = *range;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void handle_repair_result(const sysex_request_result_t *result, void *arg) {
+    portENTER_CRITICAL(&repair_lock);
+    --repair.inflight_requests;
+    if (result->status == SYSEX_REQUEST_TIMED_OUT) {
+        ++repair.stats.repairs_failed;
+    }
+    if (result->status != SYSEX_REQUEST_COMPLETED) {
+        forget_repair(result->address);
+    }
+    portEXIT_CRITICAL(&repair_lock);
+
+    // A window slot is free again
+    schedule_repair(1);
+}
+
+static void run_repair(TimerHandle_t timer) {
+    repair_range_t request;
+
+    for (;;) {
+        portENTER_CRITICAL(&repair_lock);
+        bool found = repair.inflight_requests < REPAIR_WINDOW && next_repair_request(&request);
+        if (found) {
+            ++repair.inflight_requests;
+            ++repair.stats.repairs_requested;
+        }
+        portEXIT_CRITICAL(&repair_lock);
+
+        if (!found) {
+            // Completions reschedule while the window is full
+            break;
+        }
+
+        ESP_LOGD(TAG, "Repair request 0x%08lx (%lu bytes)",
+                 (unsigned long)request.dev_addr, (unsigned long)request.size);
+        if (gt1000_send_rq1(request.dev_addr, request.size, handle_repair_result, NULL) < 0) {
+            // Request table or TX queue full, put it back for later
+            portENTER_CRITICAL(&repair_lock);
+            --repair.inflight_requests;
+            --repair.stats.repairs_requested;
+            forget_repair(request.dev_addr);
+            record_address_loss(request.dev_addr, request.size);
+            portEXIT_CRITICAL(&repair_lock);
+            schedule_repair(pdMS_TO_TICKS(REPAIR_DELAY_MS));
+            break;
+        }
+    }
+}
+
+static void handle_snapshot_result(const sysex_request_result_t *result, void *arg);
+
+static inline uint32_t block_extent(int block) {
+    return gt1000_get_block_extent(dev_addr_to_param_addr(PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE));
+}
+
+static inline int fx_unit_block(int unit) {
+    return fx_unit_offsets[unit] / EFFECT_BLOCK_SIZE;
+}
+
+static inline uint8_t fx_type(int unit) {
+    return ((const gt1000_fx_t *)dev_addr_to_param_addr(PATCH_EFFECT_OFFSET + fx_unit_offsets[unit]))->fx_type;
+}
+
+// Returns the FX unit that owns the FX block or sub-block, or -1
+static int fx_unit_of_block(int block) {
+    for (int unit = 0; unit < FX_UNIT_COUNT; ++unit) {
+        int first = fx_unit_block(unit);
+        if (block >= first && block <= first + (int)FX_SUB_BLOCK_COUNT) {
+            return unit;
+        }
+    }
+    return -1;
+}
+
+static inline bool is_fx_sub_block(int block) {
+    int unit = fx_unit_of_block(block);
+    return unit >= 0 && block != fx_unit_block(unit);
+}
+
+// Returns the sub-block of the current FX TYPE, -1 if it has none, or
+// FX_TYPE_UNKNOWN
+static int active_fx_block(int unit) {
+    uint8_t type = fx_type(unit);
+    if (type >= FX_TYPE_COUNT || fx_type_sub_blocks[type] == FX_TYPE_UNKNOWN) {
+        return FX_TYPE_UNKNOWN;
+    }
+    return fx_type_sub_blocks[type] >= 0 ? fx_unit_block(unit) + 1 + fx_type_sub_blocks[type] : -1;
+}
+
+// True for the FX sub-block of the current FX TYPE, and for every FX
+// sub-block of a type the table does not cover
+static bool is_active_fx_block(int unit, int block) {
+    int active = active_fx_block(unit);
+    return block == active || (active == FX_TYPE_UNKNOWN && block != fx_unit_block(unit));
+}
+
+// Adds the active sub-blocks of an FX block that just landed to the snapshot.
+// Called with snapshot_lock held.
+static void queue_active_fx_block(int unit) {
+    for (int i = 1; i <= (int)FX_SUB_BLOCK_COUNT; ++i) {
+        int block = fx_unit_block(unit) + i;
+        if (!is_active_fx_block(unit, block) || block_extent(block) == 0 ||
+            bitmap_test(valid_blocks, block) || bitmap_test(snapshot.requested_blocks, block)) {
+            continue;
+        }
+        bitmap_set(snapshot.requested_blocks, block);
+        bitmap_set(snapshot.fx_pending, block);
+        ++snapshot.stats.blocks;
+        --snapshot.stats.blocks_skipped;
+    }
+}
+
+// Raises SNAPSHOT_COMPLETE once every block landed or failed
+static void complete_snapshot_if_done(void) {
+    portENTER_CRITICAL(&snapshot_lock);
+    gt1000_snapshot_stats_t *stats = &snapshot.stats;
+    bool done = stats->running && snapshot.next_block >= GT1000_EFFECT_BLOCK_COUNT &&
+                stats->blocks_landed + stats->blocks_failed >= stats->blocks;
+    gt1000_snapshot_stats_t result;
+    if (done) {
+        stats->running = false;
+        ++stats->snapshots;
+        stats->sync_time_us = esp_timer_get_time() - snapshot.started_at;
+        result = *stats;
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (done) {
+        ESP_LOGI(TAG, "Snapshot: %lu blocks in %lu ms, %lu failed, %lu inactive FX skipped",
+                 (unsigned long)result.blocks_landed,
+                 (unsigned long)(result.sync_time_us / 1000),
+                 (unsigned long)result.blocks_failed,
+                 (unsigned long)result.blocks_skipped);
+        if (callback) {
+            callback(SNAPSHOT_COMPLETE, NULL);
+        }
+    }
+}
+
+// Sends snapshot requests until the window is full
+static void fill_snapshot_window(void) {
+    for (;;) {
+        portENTER_CRITICAL(&snapshot_lock);
+        int block = -1;
+        uint32_t generation = snapshot.generation;
+        // Active FX sub-blocks go first, their FX block has landed already
+        for (int i = 0; i < BLOCK_BITMAP_WORDS && snapshot.stats.running &&
+                        snapshot.inflight < snapshot.stats.window; ++i) {
+            if (snapshot.fx_pending[i]) {
+                block = i * 32 + __builtin_ctz(snapshot.fx_pending[i]);
+                bitmap_clear(snapshot.fx_pending, block);
+                ++snapshot.inflight;
+                break;
+            }
+        }
+        while (block < 0 && snapshot.stats.running && snapshot.inflight < snapshot.stats.window &&
+               snapshot.next_block < GT1000_EFFECT_BLOCK_COUNT) {
+            int candidate = snapshot.next_block++;
+            // A set FX sub-block bit means it was queued and may be in flight
+            if (bitmap_test(snapshot.requested_blocks, candidate) && !is_fx_sub_block(candidate)) {
+                block = candidate;
+                ++snapshot.inflight;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&snapshot_lock);
+
+        if (block < 0) {
+            break;
+        }
+
+        uint32_t block_addr = PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE;
+        if (gt1000_send_rq1(block_addr, sysex_linear_to_address(block_extent(block)),
+                            handle_snapshot_result, (void *)(uintptr_t)generation) >= 0) {
+            continue;
+        }
+
+        // Request table or TX queue full. Completions refill the window, the
+        // block is retried then, unless nothing is left in flight.
+        portENTER_CRITICAL(&snapshot_lock);
+        bool stalled = false;
+        if (generation == snapshot.generation) {
+            --snapshot.inflight;
+            if (snapshot.inflight > 0) {
+                if (is_fx_sub_block(block)) {
+                    bitmap_set(snapshot.fx_pending, block);
+                } else {
+                    --snapshot.next_block;
+                }
+            } else {
+                bitmap_clear(snapshot.requested_blocks, block);
+                ++snapshot.stats.blocks_failed;
+                stalled = true;
+            }
+        }
+        portEXIT_CRITICAL(&snapshot_lock);
+        if (!stalled) {
+            break;
+        }
+        complete_snapshot_if_done();
+    }
+}
+
+static void handle_snapshot_result(const sysex_request_result_t *result, void *arg) {
+    uint32_t generation = (uint32_t)(uintptr_t)arg;
+
+    portENTER_CRITICAL(&snapshot_lock);
+    bool current = generation == snapshot.generation && snapshot.stats.running;
+    if (current) {
+        --snapshot.inflight;
+        int block = dev_addr_to_block_index(result->address);
+        if (result->status == SYSEX_REQUEST_TIMED_OUT &&
+            bitmap_test(snapshot.requested_blocks, block)) {
+            bitmap_clear(snapshot.requested_blocks, block);
+            ++snapshot.stats.blocks_failed;
+        }
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (current) {
+        complete_snapshot_if_done();
+        fill_snapshot_window();
+    }
+}
+
+static void wake_prefetch(void) {
+    if (prefetch_task && hydration.enabled) {
+        xTaskNotifyGive(prefetch_task);
+    }
+}
+
+typedef enum {
+    HYDRATE_FAULT,              // A read found the block invalid
+    HYDRATE_PREFETCH,
+    HYDRATE_FX_TYPE,            // An FX TYPE change made the sub-block active
+} hydrate_reason_t;
+
+// A hydration request carries its reason in the low 2 bits and the epoch it
+// was sent in above them
+#define HYDRATE_REASON_BITS                       2
+#define HYDRATE_REASON_MASK                       ((1u << HYDRATE_REASON_BITS) - 1)
+
+// Must be called with snapshot_lock held, so a preset change that resets the
+// hydration state sits either before or after the request
+static inline void *hydration_arg(hydrate_reason_t reason) {
+    return (void *)(uintptr_t)(patch_epoch << HYDRATE_REASON_BITS | reason);
+}
+
+static inline bool is_current_hydration(uint32_t arg) {
+    return (uint32_t)(patch_epoch << HYDRATE_REASON_BITS) == (arg & ~HYDRATE_REASON_MASK);
+}
+
+static void handle_hydration_result(const sysex_request_result_t *result, void *arg) {
+    uint32_t tag = (uintptr_t)arg;
+    bool prefetch = (tag & HYDRATE_REASON_MASK) == HYDRATE_PREFETCH;
+    int block = dev_addr_to_block_index(result->address);
+
+    portENTER_CRITICAL(&snapshot_lock);
+    if (prefetch) {
+        --hydration.inflight;
+    }
+    // The bits of an earlier patch were reset with it
+    if (is_current_hydration(tag) && result->status == SYSEX_REQUEST_TIMED_OUT &&
+        bitmap_test(fetching_blocks, block)) {
+        bitmap_clear(fetching_blocks, block);
+        bitmap_set(failed_blocks, block);
+        ++hydration.stats.failed;
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    wake_prefetch();
+}
+
+// Requests the whole block unless it is valid or already on its way. Returns
+// false if the request could not be sent.
+static bool hydrate_block(int block, hydrate_reason_t reason) {
+    bool prefetch = reason == HYDRATE_PREFETCH;
+    portENTER_CRITICAL(&snapshot_lock);
+    bool fetch = !bitmap_test(valid_blocks, block) && !bitmap_test(fetching_blocks, block) &&
+                 !bitmap_test(snapshot.requested_blocks, block);
+    void *arg = hydration_arg(reason);
+    if (fetch) {
+        bitmap_set(fetching_blocks, block);
+        if (prefetch) {
+            ++hydration.inflight;
+            ++hydration.stats.prefetched;
+        } else if (reason == HYDRATE_FAULT) {
+            ++hydration.stats.faults;
+        } else {
+            ++snapshot.stats.fx_type_fetches;
+        }
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (!fetch) {
+        return true;
+    }
+
+    uint32_t block_addr = PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE;
+    if (gt1000_send_rq1(block_addr, sysex_linear_to_address(block_extent(block)),
+                        handle_hydration_result, arg) >= 0) {
+        return true;
+    }
+
+    portENTER_CRITICAL(&snapshot_lock);
+    bitmap_clear(fetching_blocks, block);
+    if (prefetch) {
+        --hydration.inflight;
+        --hydration.stats.prefetched;
+    } else if (reason == HYDRATE_FX_TYPE) {
+        --snapshot.stats.fx_type_fetches;
+    }
+    ++hydration.stats.failed;
+    portEXIT_CRITICAL(&snapshot_lock);
+    return false;
+}
+
+static void handle_validation_result(const sysex_request_result_t *result, void *arg) {
+    int block = dev_addr_to_block_index(result->address);
+
+    portENTER_CRITICAL(&snapshot_lock);
+    --hydration.inflight;
+    // A completed check is finished by the handler, with its last reply
+    if (is_current_hydration((uintptr_t)arg) && result->status != SYSEX_REQUEST_COMPLETED &&
+        bitmap_test(fetching_blocks, block)) {
+        bitmap_clear(fetching_blocks, block);
+        if (result->status == SYSEX_REQUEST_TIMED_OUT) {
+            // The cached copy stays, the drift checks look at it later
+            bitmap_set(failed_blocks, block);
+            ++hydration.stats.failed;
+        }
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    wake_prefetch();
+}
+
+// Reads a block restored from the patch cache back for its hash. Returns
+// false if the request could not be sent.
+static bool validate_block(int block) {
+    portENTER_CRITICAL(&snapshot_lock);
+    bool check = bitmap_test(unverified_blocks, block) && !bitmap_test(fetching_blocks, block);
+    void *arg = hydration_arg(HYDRATE_PREFETCH);
+    if (check) {
+        bitmap_set(fetching_blocks, block);
+        ++hydration.inflight;
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (!check) {
+        return true;
+    }
+
+    uint32_t block_addr = PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE;
+    if (gt1000_send_rq1(block_addr, sysex_linear_to_address(block_extent(block)),
+                        handle_validation_result, arg) >= 0) {
+        return true;
+    }
+
+    portENTER_CRITICAL(&snapshot_lock);
+    bitmap_clear(fetching_blocks, block);
+    --hydration.inflight;
+    portEXIT_CRITICAL(&snapshot_lock);
+    return false;
+}
+
+static int prefetch_rank(int block, const int *priority_blocks, int priority_block_count) {
+    for (int i = 0; i < priority_block_count; ++i) {
+        if (priority_blocks[i] == block) {
+            return 0;
+        }
+    }
+    int unit = fx_unit_of_block(block);
+    if (unit < 0 || block == fx_unit_block(unit)) {
+        return 1;
+    }
+    return is_active_fx_block(unit, block) ? 2 : 3;
+}
+
+// Returns the first block to prefetch or validate, or -1 if none is left.
+// open_rank is set to the lowest rank that still has a block which is not
+// valid or not validated, counting the ones in flight, or PREFETCH_RANK_COUNT
+// if there is none.
+static int next_prefetch_block(int *open_rank) {
+    uint32_t done[BLOCK_BITMAP_WORDS];
+    uint32_t busy[BLOCK_BITMAP_WORDS];
+    int priority_blocks[GT1000_MAX_PRIORITY_BLOCKS];
+
+    portENTER_CRITICAL(&snapshot_lock);
+    for (int i = 0; i < BLOCK_BITMAP_WORDS; ++i) {
+        done[i] = (valid_blocks[i] & ~unverified_blocks[i]) | failed_blocks[i];
+        busy[i] = fetching_blocks[i] | snapshot.requested_blocks[i];
+    }
+    int priority_block_count = hydration.priority_block_count;
+    memcpy(priority_blocks, hydration.priority_blocks, sizeof(priority_blocks));
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    int best = -1;
+    int best_rank = PREFETCH_RANK_COUNT;
+    *open_rank = PREFETCH_RANK_COUNT;
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        if (bitmap_test(done, block) || block_extent(block) == 0) {
+            continue;
+        }
+        int rank = prefetch_rank(block, priority_blocks, priority_block_count);
+        if (rank < *open_rank) {
+            *open_rank = rank;
+        }
+        if (rank < best_rank && !bitmap_test(busy, block)) {
+            best = block;
+            best_rank = rank;
+        }
+    }
+    return best;
+}
+
+// Records the time to ready of the current patch once every priority block
+// is valid, cached or fetched
+static void update_ready_time(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&snapshot_lock);
+    bool ready = !hydration.ready;
+    for (int i = 0; i < hydration.priority_block_count && ready; ++i) {
+        int block = hydration.priority_blocks[i];
+        ready = bitmap_test(valid_blocks, block) || bitmap_test(failed_blocks, block);
+    }
+    hydration.ready |= ready;
+    bool hit = hydration.cache_hit;
+    uint32_t elapsed = now - hydration.preset_changed_at;
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (!ready) {
+        return;
+    }
+    portENTER_CRITICAL(&cache_lock);
+    if (hit) {
+        patch_cache.hit_ready_total_us += elapsed;
+        ++patch_cache.hits_ready;
+    } else {
+        patch_cache.miss_ready_total_us += elapsed;
+        ++patch_cache.misses_ready;
+    }
+    portEXIT_CRITICAL(&cache_lock);
+}
+
+// Records when the priority blocks and then the whole mirror became valid
+// and validated
+static void update_hydration_progress(int open_rank) {
+    int64_t now = esp_timer_get_time();
+    bool converged = false;
+    uint32_t elapsed = 0;
+
+    update_ready_time();
+    portENTER_CRITICAL(&snapshot_lock);
+    elapsed = now - hydration.preset_changed_at;
+    if (!hydration.priority_done && open_rank > 0) {
+        hydration.priority_done = true;
+        hydration.stats.priority_time_us = elapsed;
+    }
+    if (!hydration.converged && open_rank >= PREFETCH_RANK_COUNT && hydration.inflight == 0) {
+        hydration.converged = true;
+        hydration.stats.converge_time_us = elapsed;
+        converged = true;
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (converged) {
+        ESP_LOGI(TAG, "Mirror hydrated in %lu ms", (unsigned long)(elapsed / 1000));
+    }
+}
+
+static void prefetch_task_fn(void *pvParameter)
+{
+    TickType_t wait = portMAX_DELAY;
+    for (;;)
+    {
+        // Preset changes, landed blocks and completed requests wake the task
+        ulTaskNotifyTake(pdTRUE, wait);
+        wait = portMAX_DELAY;
+        if (!hydration.enabled) {
+            continue;
+        }
+
+        for (;;) {
+            int open_rank;
+            int block = next_prefetch_block(&open_rank);
+            update_hydration_progress(open_rank);
+
+            portENTER_CRITICAL(&snapshot_lock);
+            bool room = hydration.inflight < PREFETCH_WINDOW;
+            portEXIT_CRITICAL(&snapshot_lock);
+            if (block < 0 || !room) {
+                break;
+            }
+            portENTER_CRITICAL(&snapshot_lock);
+            bool cached = bitmap_test(valid_blocks, block);
+            portEXIT_CRITICAL(&snapshot_lock);
+            if (!(cached ? validate_block(block) : hydrate_block(block, HYDRATE_PREFETCH))) {
+                wait = pdMS_TO_TICKS(PREFETCH_RETRY_MS);
+                break;
+            }
+        }
+    }
+}
+
+// Clears the hydration state of the previous preset. Called with
+// snapshot_lock held.
+static void reset_hydration(void) {
+    memset(fetching_blocks, 0, sizeof(fetching_blocks));
+    memset(failed_blocks, 0, sizeof(failed_blocks));
+    memset(unverified_blocks, 0, sizeof(unverified_blocks));
+    hydration.priority_done = false;
+    hydration.converged = false;
+    hydration.ready = false;
+    hydration.cache_hit = false;
+    hydration.preset_changed_at = esp_timer_get_time();
+}
+
+static void free_cache_entry(patch_cache_entry_t *entry) {
+    free(entry->data);
+    portENTER_CRITICAL(&cache_lock);
+    patch_cache.stats.bytes_used -= entry->size;
+    patch_cache.stats.raw_bytes -= entry->raw_size;
+    --patch_cache.stats.entries;
+    portEXIT_CRITICAL(&cache_lock);
+    *entry = (patch_cache_entry_t) {0};
+}
+
+// Keeps the valid blocks of the patch being left. Runs in the handler before
+// the preset change clears them.
+static void save_patch_to_cache(uint32_t patch_number) {
+    uint32_t blocks[BLOCK_BITMAP_WORDS];
+    portENTER_CRITICAL(&snapshot_lock);
+    memcpy(blocks, valid_blocks, sizeof(blocks));
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    size_t size = 0;
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        if (bitmap_test(blocks, block)) {
+            size += block_extent(block);
+        }
+    }
+    portENTER_CRITICAL(&cache_lock);
+    size_t budget = patch_cache.budget;
+    portEXIT_CRITICAL(&cache_lock);
+
+    // Patches mostly differ from each other in a few parameters, so each one
+    // is kept as its difference to the first
+    uint8_t *data = NULL;
+    int length = -1;
+    if (size > 0 && budget > 0) {
+        if (!patch_cache.reference) {
+            patch_cache.reference = malloc(sizeof(*patch_cache.reference));
+            if (patch_cache.reference) {
+                patch_codec_pack(patch_cache.reference, &device.effect);
+                portENTER_CRITICAL(&cache_lock);
+                patch_cache.stats.bytes_used += patch_codec_packed_size();
+                portEXIT_CRITICAL(&cache_lock);
+            }
+        }
+        data = patch_cache.reference ? malloc(2 * size) : NULL;
+        if (data) {
+            length = patch_codec_encode(&device.effect, blocks, patch_cache.reference, data, 2 * size);
+        } else {
+            ESP_LOGW(TAG, "No memory to cache patch %lu", (unsigned long)patch_number);
+        }
+        if (length > 0) {
+            uint8_t *shrunk = realloc(data, length);
+            data = shrunk ? shrunk : data;
+        } else {
+            // A patch equal to the reference takes no bytes at all
+            free(data);
+            data = NULL;
+        }
+    }
+    // A patch that does not fit only makes room, for a smaller budget
+    bool keep = length >= 0 && length <= budget;
+    size_t needed = keep ? length : 0;
+
+    patch_cache_entry_t *entry = NULL;
+    for (int i = 0; i < GT1000_PATCH_CACHE_MAX_ENTRIES; ++i) {
+        if (patch_cache.entries[i].used && patch_cache.entries[i].patch_number == patch_number && keep) {
+            // The older copy is replaced
+            free_cache_entry(&patch_cache.entries[i]);
+        }
+    }
+
+    // Evict the least recently used patches until the new one fits
+    bool fits = false;
+    for (;;) {
+        patch_cache_entry_t *oldest = NULL;
+        entry = NULL;
+        for (int i = 0; i < GT1000_PATCH_CACHE_MAX_ENTRIES; ++i) {
+            patch_cache_entry_t *candidate = &patch_cache.entries[i];
+            if (!candidate->used) {
+                entry = entry ? entry : candidate;
+            } else if (!oldest || candidate->last_used < oldest->last_used) {
+                oldest = candidate;
+            }
+        }
+        portENTER_CRITICAL(&cache_lock);
+        fits = patch_cache.stats.bytes_used + needed <= budget && (entry || !keep);
+        portEXIT_CRITICAL(&cache_lock);
+        if (fits || !oldest) {
+            break;
+        }
+        free_cache_entry(oldest);
+        portENTER_CRITICAL(&cache_lock);
+        ++patch_cache.stats.evictions;
+        portEXIT_CRITICAL(&cache_lock);
+    }
+
+    // With nothing left to evict the patch may still not fit, next to the reference
+    if (keep && fits) {
+        portENTER_CRITICAL(&cache_lock);
+        *entry = (patch_cache_entry_t) {
+            .used = true,
+            .patch_number = patch_number,
+            .last_used = ++patch_cache.clock,
+            .data = data,
+            .size = needed,
+            .raw_size = size,
+        };
+        patch_cache.stats.bytes_used += needed;
+        patch_cache.stats.raw_bytes += size;
+        ++patch_cache.stats.entries;
+        portEXIT_CRITICAL(&cache_lock);
+        memcpy(entry->patch_name, device.patch_name, sizeof(entry->patch_name));
+        memcpy(entry->blocks, blocks, sizeof(blocks));
+    } else {
+        free(data);
+    }
+
+    portENTER_CRITICAL(&cache_lock);
+    bool empty = patch_cache.stats.entries == 0;
+    if (empty && patch_cache.reference) {
+        patch_cache.stats.bytes_used -= patch_codec_packed_size();
+    }
+    portEXIT_CRITICAL(&cache_lock);
+    if (empty) {
+        free(patch_cache.reference);
+        patch_cache.reference = NULL;
+    }
+}
+
+static void restore_cached_block(int block, const uint8_t *data, size_t extent, void *arg) {
+    apply_range(PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE, data, extent);
+}
+
+// Fills the cleared mirror from the cached copy of the new patch. The blocks
+// are valid at once and validated by the prefetch task. Returns false on a miss.
+static bool restore_patch_from_cache(uint32_t patch_number) {
+    patch_cache_entry_t *entry = NULL;
+    for (int i = 0; i < GT1000_PATCH_CACHE_MAX_ENTRIES; ++i) {
+        if (patch_cache.entries[i].used && patch_cache.entries[i].patch_number == patch_number) {
+            entry = &patch_cache.entries[i];
+        }
+    }
+
+    portENTER_CRITICAL(&cache_lock);
+    if (entry) {
+        ++patch_cache.stats.hits;
+        entry->last_used = ++patch_cache.clock;
+    } else if (patch_cache.budget > 0) {
+        ++patch_cache.stats.misses;
+    }
+    portEXIT_CRITICAL(&cache_lock);
+    if (!entry) {
+        return false;
+    }
+
+    if (!patch_codec_decode(entry->data, entry->size, entry->blocks, patch_cache.reference,
+                            restore_cached_block, NULL)) {
+        // Nothing was marked valid, the blocks are fetched as on a miss
+        ESP_LOGE(TAG, "Cached patch %lu is damaged", (unsigned long)patch_number);
+        free_cache_entry(entry);
+        return false;
+    }
+    memcpy(device.patch_name, entry->patch_name, sizeof(device.patch_name));
+
+    portENTER_CRITICAL(&snapshot_lock);
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        if (bitmap_test(entry->blocks, block)) {
+            bitmap_set(valid_blocks, block);
+            bitmap_set(unverified_blocks, block);
+            block_epochs[block] = patch_epoch;
+        }
+    }
+    hydration.cache_hit = true;
+    portEXIT_CRITICAL(&snapshot_lock);
+    return true;
+}
+
+static void wake_poll(void) {
+    if (poll_task) {
+        xTaskNotifyGive(poll_task);
+    }
+}
+
+// Blocks worth polling: everything but the sub-blocks of inactive FX TYPEs
+static bool is_pollable_block(int block) {
+    if (block_extent(block) == 0) {
+        return false;
+    }
+    int unit = fx_unit_of_block(block);
+    return unit < 0 || block == fx_unit_block(unit) || is_active_fx_block(unit, block);
+}
+
+static inline uint32_t poll_cost(int block) {
+    return RQ1_LENGTH + DT1_ENVELOPE_LENGTH + block_extent(block);
+}
+
+static void set_sync_mode(gt1000_sync_mode_t mode, const char *reason) {
+    portENTER_CRITICAL(&poll_lock);
+    bool switched = poll.stats.mode != mode;
+    if (switched) {
+        poll.stats.mode = mode;
+        ++poll.stats.switches;
+        // The first round polls every block, the intervals adapt from there
+        for (int i = 0; i < GT1000_EFFECT_BLOCK_COUNT; ++i) {
+            poll.entries[i].due_at = 0;
+            poll.entries[i].polled = false;
+        }
+    }
+    portEXIT_CRITICAL(&poll_lock);
+
+    if (switched) {
+        ESP_LOGI(TAG, "%s, %s", reason,
+                 mode == GT1000_SYNC_POLLING ? "polling the mirror" : "streaming again");
+        wake_poll();
+    }
+}
+
+// Called for every DT1 on the mirror, before it is applied
+static void note_poll_dt1(int block, bool tracked, bool changed) {
+    if (!tracked) {
+        // Only notifications arrive untracked
+        if (poll.stats.mode == GT1000_SYNC_POLLING && poll.notifications_enabled) {
+            set_sync_mode(GT1000_SYNC_STREAMING, "Notifications arrive");
+        }
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    bool missed = false;
+    portENTER_CRITICAL(&poll_lock);
+    poll_entry_t *entry = &poll.entries[block];
+    if (entry->reply_pending && changed) {
+        ++poll.stats.changes_found;
+        entry->changed = true;
+        // The block is busy, poll it sooner
+        entry->interval_ms /= 2;
+        if (entry->interval_ms < poll.config.min_interval_ms) {
+            entry->interval_ms = poll.config.min_interval_ms;
+        }
+        if (entry->due_at > now + entry->interval_ms * 1000LL) {
+            entry->due_at = now + entry->interval_ms * 1000LL;
+        }
+        if (poll.stats.mode == GT1000_SYNC_STREAMING) {
+            ++poll.stats.missed_changes;
+            missed = true;
+        }
+    }
+    entry->reply_pending = false;
+    portEXIT_CRITICAL(&poll_lock);
+
+    if (missed) {
+        set_sync_mode(GT1000_SYNC_POLLING, "A poll found a change that was not notified");
+    }
+}
+
+static void handle_poll_result(const sysex_request_result_t *result, void *arg) {
+    int block = (int)(uintptr_t)arg;
+    portENTER_CRITICAL(&poll_lock);
+    poll.entries[block].inflight = false;
+    if (result->status != SYSEX_REQUEST_COMPLETED) {
+        poll.entries[block].reply_pending = false;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+    wake_poll();
+}
+
+// Adds the budget earned since the last call. Called with poll_lock held.
+static void refill_poll_tokens(int64_t now) {
+    uint32_t rate = poll.stats.bytes_per_sec;
+    uint64_t earned = rate ? (uint64_t)(now - poll.tokens_updated_at) * rate / 1000000 : 0;
+    if (poll.tokens + earned >= POLL_BURST_BYTES) {
+        poll.tokens = POLL_BURST_BYTES;
+        poll.tokens_updated_at = now;
+    } else if (earned > 0) {
+        poll.tokens += earned;
+        // Keep the fraction of a byte for the next call
+        poll.tokens_updated_at += earned * 1000000 / rate;
+    }
+}
+
+// Spends cost from the budget. If it falls short, returns false and sets
+// next_at to the time it suffices. Called with poll_lock held.
+static bool take_poll_tokens(uint32_t cost, int64_t now, int64_t *next_at) {
+    refill_poll_tokens(now);
+    if (poll.tokens < cost) {
+        uint32_t rate = poll.stats.bytes_per_sec;
+        *next_at = rate ? now + (int64_t)(cost - poll.tokens) * 1000000 / rate + 1
+                        : now + POLL_IDLE_WAIT_MS * 1000LL;
+        return false;
+    }
+    poll.tokens -= cost;
+    return true;
+}
+
+// Returns the block due for a poll, or -1. next_at is moved to the time the
+// next block falls due, if that is earlier.
+static int next_poll_block(int64_t now, int64_t *next_at) {
+    int priority_blocks[GT1000_MAX_PRIORITY_BLOCKS];
+    portENTER_CRITICAL(&snapshot_lock);
+    int priority_block_count = hydration.priority_block_count;
+    memcpy(priority_blocks, hydration.priority_blocks, sizeof(priority_blocks));
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    int best = -1;
+    portENTER_CRITICAL(&poll_lock);
+    if (poll.stats.mode == GT1000_SYNC_STREAMING) {
+        // Spot checks of the priority blocks tell when notifications stopped
+        if (poll.notifications_enabled && poll.config.verify_interval_ms > 0 && priority_block_count > 0) {
+            if (poll.verify_due_at <= now) {
+                int block = priority_blocks[poll.verify_cursor++ % priority_block_count];
+                if (!poll.entries[block].inflight) {
+                    best = block;
+                    poll.verify_due_at = now + poll.config.verify_interval_ms * 1000LL;
+                }
+            } else if (poll.verify_due_at < *next_at) {
+                *next_at = poll.verify_due_at;
+            }
+        }
+        portEXIT_CRITICAL(&poll_lock);
+        return best;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+
+    int64_t best_due = 0;
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        if (!is_pollable_block(block)) {
+            continue;
+        }
+        portENTER_CRITICAL(&poll_lock);
+        const poll_entry_t *entry = &poll.entries[block];
+        bool inflight = entry->inflight;
+        int64_t due_at = entry->due_at;
+        portEXIT_CRITICAL(&poll_lock);
+
+        if (inflight) {
+            continue;
+        }
+        if (due_at > now) {
+            if (due_at < *next_at) {
+                *next_at = due_at;
+            }
+        } else if (best < 0 || due_at < best_due) {
+            best = block;
+            best_due = due_at;
+        }
+    }
+    return best;
+}
+
+// Sends the poll if the budget allows. Returns false if it has to wait,
+// next_at is then the time the budget suffices.
+static bool send_poll(int block, int64_t now, int64_t *next_at) {
+    int priority_blocks[GT1000_MAX_PRIORITY_BLOCKS];
+    portENTER_CRITICAL(&snapshot_lock);
+    int priority_block_count = hydration.priority_block_count;
+    memcpy(priority_blocks, hydration.priority_blocks, sizeof(priority_blocks));
+    portEXIT_CRITICAL(&snapshot_lock);
+    bool priority = false;
+    for (int i = 0; i < priority_block_count; ++i) {
+        priority |= priority_blocks[i] == block;
+    }
+    uint32_t cost = poll_cost(block);
+
+    portENTER_CRITICAL(&poll_lock);
+    bool affordable = take_poll_tokens(cost, now, next_at);
+    if (affordable) {
+        poll_entry_t *entry = &poll.entries[block];
+        uint32_t max_interval = priority ? poll.config.priority_interval_ms : poll.config.max_interval_ms;
+        if (!entry->polled) {
+            entry->interval_ms = max_interval;
+        } else if (!entry->changed) {
+            // Nothing changed since the last poll, back off
+            entry->interval_ms += entry->interval_ms / 2;
+        }
+        if (entry->interval_ms > max_interval) {
+            entry->interval_ms = max_interval;
+        }
+        if (entry->interval_ms < poll.config.min_interval_ms) {
+            entry->interval_ms = poll.config.min_interval_ms;
+        }
+        entry->polled = true;
+        entry->changed = false;
+        entry->inflight = true;
+        entry->reply_pending = true;
+        entry->due_at = now + entry->interval_ms * 1000LL;
+        ++poll.stats.polls;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+
+    if (!affordable) {
+        return false;
+    }
+
+    uint32_t block_addr = PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE;
+    if (gt1000_send_rq1(block_addr, sysex_linear_to_address(block_extent(block)),
+                        handle_poll_result, (void *)(uintptr_t)block) < 0) {
+        portENTER_CRITICAL(&poll_lock);
+        poll.entries[block].inflight = false;
+        poll.entries[block].reply_pending = false;
+        poll.tokens += cost;
+        --poll.stats.polls;
+        portEXIT_CRITICAL(&poll_lock);
+    }
+    return true;
+}
+
+static void handle_drift_result(const sysex_request_result_t *result, void *arg) {
+    portENTER_CRITICAL(&poll_lock);
+    poll.drift_inflight = false;
+    portEXIT_CRITICAL(&poll_lock);
+    wake_poll();
+}
+
+// Returns the next valid block to check for drift, or -1. Only while
+// streaming: polling rereads every block anyway.
+static int next_drift_block(int64_t now, int64_t *next_at) {
+    portENTER_CRITICAL(&poll_lock);
+    bool enabled = poll.stats.mode == GT1000_SYNC_STREAMING && poll.config.drift_interval_ms > 0;
+    bool due = enabled && !poll.drift_inflight && poll.drift_due_at <= now;
+    if (enabled && !due && !poll.drift_inflight && poll.drift_due_at < *next_at) {
+        *next_at = poll.drift_due_at;
+    }
+    int cursor = poll.drift_cursor;
+    portEXIT_CRITICAL(&poll_lock);
+    if (!due) {
+        return -1;
+    }
+
+    int block = -1;
+    bool wrapped = false;
+    for (int i = 0; i < GT1000_EFFECT_BLOCK_COUNT && block < 0; ++i) {
+        int candidate = (cursor + i) % GT1000_EFFECT_BLOCK_COUNT;
+        wrapped |= cursor + i == GT1000_EFFECT_BLOCK_COUNT;
+        if (!is_pollable_block(candidate)) {
+            continue;
+        }
+        portENTER_CRITICAL(&snapshot_lock);
+        bool checkable = bitmap_test(valid_blocks, candidate) && !bitmap_test(fetching_blocks, candidate);
+        portEXIT_CRITICAL(&snapshot_lock);
+        if (checkable) {
+            block = candidate;
+        }
+    }
+
+    portENTER_CRITICAL(&poll_lock);
+    if (poll.sweep_started_at == 0) {
+        poll.sweep_started_at = now;
+    }
+    if (wrapped) {
+        ++poll.drift_stats.sweeps;
+        poll.drift_stats.sweep_time_ms = (now - poll.sweep_started_at) / 1000;
+        poll.sweep_started_at = now;
+    }
+    if (block < 0) {
+        // Nothing valid to check, look again later
+        poll.drift_cursor = 0;
+        poll.drift_due_at = now + poll.config.drift_interval_ms * 1000LL;
+    } else {
+        poll.drift_cursor = block + 1;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+    return block;
+}
+
+// Reads the block back for its hash. Returns false if the budget has to
+// refill first, next_at is then the time it suffices.
+static bool send_drift_check(int block, int64_t now, int64_t *next_at) {
+    portENTER_CRITICAL(&poll_lock);
+    bool affordable = take_poll_tokens(poll_cost(block), now, next_at);
+    if (affordable) {
+        poll.drift_inflight = true;
+        poll.drift_due_at = now + poll.config.drift_interval_ms * 1000LL;
+    } else {
+        // Checked as soon as the budget allows
+        poll.drift_cursor = block;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+    if (!affordable) {
+        return false;
+    }
+
+    uint32_t block_addr = PATCH_EFFECT_OFFSET + block * EFFECT_BLOCK_SIZE;
+    if (gt1000_send_rq1(block_addr, sysex_linear_to_address(block_extent(block)),
+                        handle_drift_result, NULL) < 0) {
+        portENTER_CRITICAL(&poll_lock);
+        poll.drift_inflight = false;
+        poll.tokens += poll_cost(block);
+        portEXIT_CRITICAL(&poll_lock);
+    }
+    return true;
+}
+
+// Compares the hash of a drift check's reply with the mirror. The reply is
+// not applied, a block that differs is refetched by the repair. Either check
+// validates a block restored from the patch cache.
+static void finish_drift_check(const gt1000_range_t *range, const drift_check_t *check) {
+    int block = dev_addr_to_block_index(range->address);
+    portENTER_CRITICAL(&snapshot_lock);
+    uint32_t hash = block_hashes[block];
+    // A DT1 that changed the block meanwhile may or may not be in the reply
+    bool conclusive = hash == check->expected;
+    bool drifted = conclusive && hash != check->hash;
+    if (conclusive) {
+        bitmap_clear(unverified_blocks, block);
+    }
+    if (check->validation) {
+        // An inconclusive validation is sent again
+        bitmap_clear(fetching_blocks, block);
+    }
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (check->validation) {
+        portENTER_CRITICAL(&cache_lock);
+        patch_cache.stats.stale_blocks += drifted;
+        portEXIT_CRITICAL(&cache_lock);
+        wake_prefetch();
+    } else {
+        portENTER_CRITICAL(&poll_lock);
+        gt1000_drift_stats_t *stats = &poll.drift_stats;
+        if (!conclusive) {
+            ++stats->inconclusive;
+        } else {
+            ++stats->verified;
+            stats->drifted += drifted;
+            stats->drift_permille = (uint64_t)stats->drifted * 1000 / stats->verified;
+        }
+        portEXIT_CRITICAL(&poll_lock);
+    }
+
+    if (drifted) {
+        ESP_LOGW(TAG, "Block 0x%08lx %s, repairing", (unsigned long)range->address,
+                 check->validation ? "changed since it was cached" : "drifted from the device");
+        portENTER_CRITICAL(&repair_lock);
+        add_repair_range(range->address, range->size);
+        portEXIT_CRITICAL(&repair_lock);
+        schedule_repair(0);
+    }
 }
 
-static inline bool is_valid_dev_addr(const uint32_t address) {
-    const uint32_t start_addr = PATCH_EFFECT_OFFSET;
-    const uint32_t end_addr = start_addr + sizeof(gt1000_effect_t);
-    return (address >= start_addr) && (address < end_addr);
+// Must be called with poll_lock held
+static uint32_t probe_interval_ms(void) {
+    uint64_t interval = poll.config.probe_interval_ms;
+    for (uint32_t i = POLL_PROBE_MAX_UNANSWERED; i <= poll.unanswered_probes; ++i) {
+        interval *= 2;
+        if (interval >= POLL_PROBE_MAX_BACKOFF_MS) {
+            break;
+        }
+    }
+    return interval < POLL_PROBE_MAX_BACKOFF_MS ? interval : POLL_PROBE_MAX_BACKOFF_MS;
 }
 
-static inline uint32_t param_addr_to_dev_addr(const gt1000_param_addr_t parameter) {
-    uint32_t param_offset = (uint32_t)parameter - (uint32_t)&device.effect;
-    return PATCH_EFFECT_OFFSET + param_offset;
+// Reads the notification flag back, a power cycle of the device clears it.
+// Firmware that ignores the read is probed less and less often. The probe is
+// not a tracked request, so its missing reply never counts against pacing.
+static void probe_notifications(int64_t now, int64_t *next_at) {
+    portENTER_CRITICAL(&poll_lock);
+    bool enabled = poll.notifications_enabled && poll.config.probe_interval_ms > 0;
+    bool due = enabled && poll.probe_due_at <= now;
+    if (due) {
+        if (poll.probe_inflight) {
+            ++poll.unanswered_probes;
+            ++poll.stats.unanswered_probes;
+        }
+        poll.probe_inflight = true;
+        poll.probe_due_at = now + probe_interval_ms() * 1000LL;
+    }
+    if (enabled && poll.probe_due_at < *next_at) {
+        *next_at = poll.probe_due_at;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+
+    if (due) {
+        uint8_t message[sizeof(rq1_header) + 4 + 4 + 2];
+        int msg_length = build_rq1(message, NOTIFICATION_FLAG_OFFSET, 1);
+        if (sysex_send(message, msg_length, MIDI_TX_LANE_BULK) < 0) {
+            portENTER_CRITICAL(&poll_lock);
+            poll.probe_inflight = false;
+            portEXIT_CRITICAL(&poll_lock);
+        }
+    }
 }
 
-static inline gt1000_param_addr_t dev_addr_to_param_addr(uint32_t addr) {
-    uint32_t param_offset = addr - PATCH_EFFECT_OFFSET;
-    return (uint8_t *)((uint32_t)&device.effect + param_offset);
+static void handle_notification_flag(uint8_t value) {
+    portENTER_CRITICAL(&poll_lock);
+    poll.probe_inflight = false;
+    poll.unanswered_probes = 0;
+    bool reset = value == 0 && poll.notifications_enabled;
+    if (reset) {
+        ++poll.stats.flag_resets;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+    if (!reset) {
+        return;
+    }
+    set_sync_mode(GT1000_SYNC_POLLING, "Notifications are off");
+    // Polling goes on until the first notification shows this worked
+    gt1000_enable_notifications();
 }
 
-static inline uint8_t calculate_checksum(uint8_t *buffer, int length) {
-    uint64_t sum = 0;
-    for (int i = 0; i < length; ++i) {
-        sum += buffer[i];
+static void poll_task_fn(void *pvParameter)
+{
+    TickType_t wait = 0;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        int64_t now = esp_timer_get_time();
+        int64_t next_at = now + POLL_IDLE_WAIT_MS * 1000LL;
+        probe_notifications(now, &next_at);
+        int block = next_poll_block(now, &next_at);
+        bool drift_check = false;
+        if (block < 0) {
+            // Drift checks go last, with what the budget leaves
+            block = next_drift_block(now, &next_at);
+            drift_check = true;
+        }
+        if (block >= 0 && (drift_check ? send_drift_check(block, now, &next_at)
+                                       : send_poll(block, now, &next_at))) {
+            // More blocks may be due
+            wait = 0;
+            continue;
+        }
+
+        TickType_t ticks = pdMS_TO_TICKS((next_at - now + 999) / 1000);
+        wait = ticks > 0 ? ticks : 1;
+    }
+}
+
+// Fetches the sub-blocks of an FX TYPE that a DT1 just changed, unless the
+// running snapshot fetches them with their FX block
+static void fetch_changed_fx_blocks(const uint8_t *previous_types) {
+    for (int unit = 0; unit < FX_UNIT_COUNT; ++unit) {
+        if (fx_type(unit) == previous_types[unit]) {
+            continue;
+        }
+
+        portENTER_CRITICAL(&snapshot_lock);
+        bool queued = snapshot.stats.running && bitmap_test(snapshot.requested_blocks, fx_unit_block(unit));
+        portEXIT_CRITICAL(&snapshot_lock);
+        for (int i = 1; !queued && i <= (int)FX_SUB_BLOCK_COUNT; ++i) {
+            int block = fx_unit_block(unit) + i;
+            if (is_active_fx_block(unit, block)) {
+                hydrate_block(block, HYDRATE_FX_TYPE);
+            }
+        }
+    }
+}
+
+// Marks the whole blocks in range valid. Returns true if one of them belongs
+// to the running snapshot.
+static bool mark_range_synced(const gt1000_range_t *range, uint32_t epoch) {
+    uint32_t start = sysex_address_to_linear(range->address);
+    uint32_t end = start + range->size;
+    bool snapshot_block = false;
+
+    for (uint32_t addr = range->address & ~(EFFECT_BLOCK_SIZE - 1);
+         is_valid_dev_addr(addr) && sysex_address_to_linear(addr) < end;
+         addr += EFFECT_BLOCK_SIZE) {
+        uint32_t block_start = sysex_address_to_linear(addr);
+        int block = dev_addr_to_block_index(addr);
+        if (block_start < start || block_start + block_extent(block) > end) {
+            continue;
+        }
+
+        portENTER_CRITICAL(&snapshot_lock);
+        bitmap_set(valid_blocks, block);
+        block_epochs[block] = epoch;
+        bitmap_clear(fetching_blocks, block);
+        if (bitmap_test(snapshot.requested_blocks, block)) {
+            bitmap_clear(snapshot.requested_blocks, block);
+            ++snapshot.stats.blocks_landed;
+            snapshot_block = true;
+            int unit = fx_unit_of_block(block);
+            if (unit >= 0 && block == fx_unit_block(unit)) {
+                queue_active_fx_block(unit);
+            }
+        }
+        portEXIT_CRITICAL(&snapshot_lock);
+        wake_prefetch();
     }
-    return (128 - (sum % 128)) % 128;
+    return snapshot_block;
 }
 
 static void handle_dt1(uint32_t dev_addr, uint8_t *data, int length) {
     gt1000_event_t event = UNHANDLED;
+    gt1000_range_t range = { dev_addr, length };
+    uint8_t fx_types[FX_UNIT_COUNT];
+    bool mirror_updated = false;
+    bool restored = false;
+    bool repaired = repair_mark_received(dev_addr, length);
     switch (dev_addr)
     {
-        case PATCH_NUMBER_OFFSET:
-            memcpy(&device.patch_number, data, length);
-            event = PRESET_CHANGE;
+        case PATCH_NUMBER_OFFSET: {
+            uint32_t previous = device.patch_number;
+            bool known = patch_number_known;
+            memcpy(&device.patch_number, data,
+                   length < sizeof(device.patch_number) ? length : sizeof(device.patch_number));
+            patch_number_known = true;
+            // A repair reply that shows no change means no preset change was
+            // lost. The first one only tells which patch the mirror holds.
+            if (!repaired || (known && previous != device.patch_number)) {
+                event = PRESET_CHANGE;
+                // The patch is filed under its number, a guess would be restored
+                // for the wrong patch
+                if (known) {
+                    save_patch_to_cache(previous);
+                }
+                // Replies to reads sent before now belong to the previous patch
+                portENTER_CRITICAL(&read_lock);
+                epoch_stats.epoch = ++patch_epoch;
+                portEXIT_CRITICAL(&read_lock);
+                portENTER_CRITICAL(&snapshot_lock);
+                memset(valid_blocks, 0, sizeof(valid_blocks));
+                reset_hydration();
+                portEXIT_CRITICAL(&snapshot_lock);
+                restored = restore_patch_from_cache(device.patch_number);
+            }
             break;
+        }
         case PATCH_NAME_OFFSET:
             snprintf(device.patch_name, 16, "%.*s", length, (const char*)data);
             event = PRESET_NAME_UPDATE;
             break;
-        default:
+        case NOTIFICATION_FLAG_OFFSET:
+            if (length > 0) {
+                handle_notification_flag(data[0]);
+            }
+            break;
+        default: {
             if (!is_valid_dev_addr(dev_addr))
             {
                 break;
             }
-            gt1000_param_addr_t addr = dev_addr_to_param_addr(dev_addr);
-            memcpy(addr, data, length);
-            event = PARAMETER_UPDATE;
+            gt1000_range_t synced = {0};
+            uint32_t epoch = patch_epoch;
+            bool verify = false;
+            drift_check_t check;
+            bool tracked = advance_read(dev_addr, data, length, &synced, &epoch, &verify, &check);
+            if (epoch != patch_epoch) {
+                // A reply for the previous patch must not overwrite the new one
+                portENTER_CRITICAL(&read_lock);
+                ++epoch_stats.stale_replies;
+                portEXIT_CRITICAL(&read_lock);
+                break;
+            }
+            // Only the reply to a verify read stays out of the mirror, a
+            // notification at the same address is applied as usual
+            if (tracked && verify) {
+                if (synced.size) {
+                    finish_drift_check(&synced, &check);
+                }
+                break;
+            }
+
+            int block = dev_addr_to_block_index(dev_addr);
+            portENTER_CRITICAL(&snapshot_lock);
+            bool was_valid = bitmap_test(valid_blocks, block);
+            portEXIT_CRITICAL(&snapshot_lock);
+            // Changes to a block that was not valid yet are just hydration
+            note_poll_dt1(block, tracked, was_valid && range_differs(dev_addr, data, length));
+
+            for (int unit = 0; unit < FX_UNIT_COUNT; ++unit) {
+                fx_types[unit] = fx_type(unit);
+            }
+            apply_range(dev_addr, data, length);
+            mirror_updated = true;
+            // The parts of a split reply raise one event, after the last one
+            if (!tracked) {
+                event = PARAMETER_UPDATE;
+            } else if (synced.size) {
+                event = mark_range_synced(&synced, epoch) ? SNAPSHOT_PROGRESS : RANGE_SYNCED;
+                range = synced;
+                update_ready_time();
+            }
             break;
+        }
     }
     if (event != UNHANDLED && callback) {
-        callback(event);
+        bool has_range = event == PARAMETER_UPDATE || event == RANGE_SYNCED ||
+                         event == SNAPSHOT_PROGRESS;
+        callback(event, has_range ? &range : NULL);
+    }
+    if (restored) {
+        update_ready_time();
+        if (callback) {
+            callback(PATCH_RESTORED, NULL);
+        }
+    }
+
+    if (event == PRESET_CHANGE) {
+        portENTER_CRITICAL(&snapshot_lock);
+        int window = snapshot.stats.running ? snapshot.stats.window : snapshot_window;
+        portEXIT_CRITICAL(&snapshot_lock);
+        // A snapshot of the previous patch starts over
+        if (window > 0) {
+            gt1000_start_snapshot(window);
+        }
+        wake_prefetch();
+    } else if (event == SNAPSHOT_PROGRESS) {
+        complete_snapshot_if_done();
+        // A landed FX block may have queued its active sub-block
+        fill_snapshot_window();
+    }
+    if (mirror_updated) {
+        fetch_changed_fx_blocks(fx_types);
+    }
+}
+
+// Asked by midi_tx before a queued RQ1 goes out. Reads sent for an earlier
+// patch are cancelled instead, they would only be discarded.
+static bool keep_request(const uint8_t *message, int length) {
+    if (length != RQ1_LENGTH || message[7] != RQ1_COMMAND) {
+        return true;
+    }
+    uint32_t dev_addr = 0;
+    for (int i = 0; i < 4; ++i) {
+        dev_addr = (dev_addr << 8) | message[8 + i];
+    }
+    if (!is_valid_dev_addr(dev_addr)) {
+        return true;
     }
-    vTaskDelay(1);
+
+    uint32_t start = sysex_address_to_linear(dev_addr);
+    bool stale = false;
+    portENTER_CRITICAL(&read_lock);
+    for (int i = 0; i < MAX_TRACKED_READS; ++i) {
+        const tracked_read_t *read = &tracked_reads[i];
+        if (read->active && !read->replied && read->dev_addr == dev_addr &&
+            read->next == start && read->epoch != patch_epoch) {
+            stale = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&read_lock);
+
+    // The oldest request for the address is the one at the head of the queue
+    if (!stale || !sysex_cancel_request(dev_addr)) {
+        return true;
+    }
+    portENTER_CRITICAL(&read_lock);
+    ++epoch_stats.cancelled_requests;
+    portEXIT_CRITICAL(&read_lock);
+    return false;
+}
+
+static void record_latency(int64_t received_at) {
+    uint32_t elapsed = esp_timer_get_time() - received_at;
+    portENTER_CRITICAL(&latency_lock);
+    ++latency.messages;
+    latency.last_us = elapsed;
+    latency_total_us += elapsed;
+    if (elapsed > latency.max_us) {
+        latency.max_us = elapsed;
+    }
+    portEXIT_CRITICAL(&latency_lock);
 }
 
-static void handle_sysex_message(uint8_t *message, int length) {
+static void handle_sysex_message(const sysex_buffer_t *message) {
+    const sysex_dt1_t *dt1 = &message->dt1;
 
     int err = 0;
-    // Check minimum length
-    if (length < sizeof(dt1_header)) {
+    // Header and minimum length were checked by the parser
+    if (!dt1->valid) {
         err = -1;
         goto handle_invalid_message;
     }
-    
-    // Check dt1 header
-    int idx = 0;
-    for (int i = 0; i < sizeof(dt1_header); ++i) {
-        if (dt1_header[idx] == 0xFF && message[idx] == device_id) {
-            ++idx;
-            continue;
-        }
 
-        if (dt1_header[idx] != message[idx]) {
-            err = -2;
-            goto handle_invalid_message;
-        }
-        ++idx;
+    if (dt1->dev_id != device_id) {
+        err = -2;
+        goto handle_invalid_message;
     }
 
-    // Validate checksum
-    uint8_t checksum = calculate_checksum(message + idx, length - sizeof(dt1_header) - 2);
-    if (message[length - 2] != checksum) {
+    if (!dt1->checksum_ok) {
         err = -3;
+        midi_tx_report_error();
+        // The header was intact, so the lost range is known
+        portENTER_CRITICAL(&repair_lock);
+        ++repair.stats.checksum_failures;
+        record_address_loss(dt1->address, dt1->length);
+        portEXIT_CRITICAL(&repair_lock);
+        schedule_repair(pdMS_TO_TICKS(REPAIR_DELAY_MS));
         goto handle_invalid_message;
     }
 
-    // Assemble device address
-    uint32_t dev_addr = 0;
-    for (int i = 0; i < 4; ++i) {
-        dev_addr = dev_addr << 8;
-        dev_addr |= (message[idx++] & 0xFF);
-    }
-
-    uint8_t *data_start = message + idx;
-    int data_length = length - sizeof(dt1_header) - 6;
-
-    handle_dt1(dev_addr, data_start, data_length);
+    handle_dt1(dt1->address, dt1->data, dt1->length);
+    record_latency(message->received_at);
 
     return;
 
@@ -211,25 +2309,180 @@ handle_invalid_message:
     return;
 }
 
+static void handle_channel_message(const midi_message_t *message) {
+    switch (message->status & 0xF0) {
+        case 0xC0:
+            // The device sends a program change when the patch changes. Fetch
+            // the patch number through the repair path, so a number that the
+            // DT1 notification already delivered raises no second PRESET_CHANGE.
+            ESP_LOGD(TAG, "Program change %d", message->data[0]);
+            portENTER_CRITICAL(&repair_lock);
+            repair.patch_number_stale = !repair.patch_number_inflight;
+            portEXIT_CRITICAL(&repair_lock);
+            schedule_repair(pdMS_TO_TICKS(REPAIR_DELAY_MS));
+            break;
+        default:
+            break;
+    }
+}
+
+// True if a tracked read may still take a DT1 at dev_addr as its reply
+static bool is_read_pending(uint32_t dev_addr) {
+    uint32_t linear = sysex_address_to_linear(dev_addr);
+    bool pending = false;
+    portENTER_CRITICAL(&read_lock);
+    for (int i = 0; i < MAX_TRACKED_READS; ++i) {
+        const tracked_read_t *read = &tracked_reads[i];
+        if (read->active && linear >= read->next && linear < read->end) {
+            pending = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&read_lock);
+    return pending;
+}
+
+// A patch number DT1 may advance the epoch, updates on either side of it
+// belong to different patches
+static inline bool is_epoch_boundary(const sysex_buffer_t *message) {
+    return message->dt1.valid && message->dt1.address == PATCH_NUMBER_OFFSET;
+}
+
+// Same DT1 range, so the later message carries the current value. Only
+// notifications are coalesced, a reply belongs to the read that claims it.
+static inline bool is_same_update(const sysex_buffer_t *older, const sysex_buffer_t *newer) {
+    const sysex_dt1_t *a = &older->dt1;
+    const sysex_dt1_t *b = &newer->dt1;
+    return a->valid && a->checksum_ok && b->valid && b->checksum_ok &&
+           a->dev_id == b->dev_id && a->address == b->address && a->length == b->length &&
+           !is_epoch_boundary(older) && !is_read_pending(a->address);
+}
+
+// Takes whatever else is queued behind first and drops every update that a
+// later one of the same patch overwrites, then handles the rest in arrival order.
+static void handle_message_batch(sysex_buffer_t *first) {
+    sysex_buffer_t *batch[COALESCE_BATCH_SIZE];
+    bool absorbed[COALESCE_BATCH_SIZE] = {0};
+    int count = 0;
+
+    batch[count++] = first;
+    while (count < COALESCE_BATCH_SIZE && xQueueReceive(message_queue, &batch[count], 0)) {
+        ++count;
+    }
+
+    uint32_t coalesced = 0;
+    uint32_t superseded = 0;
+    for (int i = count - 2; i >= 0; --i) {
+        for (int j = i + 1; j < count; ++j) {
+            if (batch[j] && is_epoch_boundary(batch[j])) {
+                break;
+            }
+            if (!batch[j] || !is_same_update(batch[i], batch[j])) {
+                continue;
+            }
+            ++superseded;
+            if (!absorbed[j]) {
+                absorbed[j] = true;
+                ++coalesced;
+            }
+            sysex_free_buffer(batch[i]);
+            batch[i] = NULL;
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (batch[i]) {
+            handle_sysex_message(batch[i]);
+            sysex_free_buffer(batch[i]);
+        }
+    }
+
+    portENTER_CRITICAL(&coalesce_lock);
+    ++coalesce_stats.batches;
+    if (count > coalesce_stats.max_batch) {
+        coalesce_stats.max_batch = count;
+    }
+    coalesce_stats.coalesced += coalesced;
+    coalesce_stats.superseded += superseded;
+    portEXIT_CRITICAL(&coalesce_lock);
+}
+
 static void handle_message_task(void *pvParameter)
 {
     sysex_buffer_t *buffer;
+    midi_message_t message;
     for (;;)
     {
-        if(xQueueReceive(message_queue, &buffer, portMAX_DELAY)) {
-            handle_sysex_message(buffer->data, buffer->length);
-            sysex_free_buffer(buffer);
+        QueueSetMemberHandle_t member = xQueueSelectFromSet(message_set, portMAX_DELAY);
+        // Set members stay selected after a batch drained their queue,
+        // the receive below then finds it empty
+        if (member == message_queue && xQueueReceive(message_queue, &buffer, 0)) {
+            handle_message_batch(buffer);
+        } else if (member == channel_queue && xQueueReceive(channel_queue, &message, 0)) {
+            handle_channel_message(&message);
         }
     }
 }
 
+static bool init_repair(void) {
+    repair_timer = xTimerCreate("gt1000_repair",
+                                pdMS_TO_TICKS(REPAIR_DELAY_MS),
+                                pdFALSE,
+                                NULL,
+                                run_repair);
+    if (!repair_timer) {
+        ESP_LOGE(TAG, "Failed to create repair timer.");
+        return false;
+    }
+    sysex_register_loss_callback(handle_sysex_loss);
+    sysex_register_dt1_header(dt1_header, sizeof(dt1_header));
+    midi_tx_register_request_filter(keep_request);
+    return true;
+}
+
+static bool init_poll(void) {
+    if (xTaskCreate(poll_task_fn,
+                    "gt1000_poll",
+                    POLL_TASK_STACK_SIZE,
+                    NULL,
+                    POLL_TASK_PRIORITY,
+                    &poll_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create poll task.");
+        return false;
+    }
+    return true;
+}
+
+static bool init_prefetch(void) {
+    if (xTaskCreate(prefetch_task_fn,
+                    "gt1000_prefetch",
+                    PREFETCH_TASK_STACK_SIZE,
+                    NULL,
+                    PREFETCH_TASK_PRIORITY,
+                    &prefetch_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create prefetch task.");
+        return false;
+    }
+    return true;
+}
+
 QueueHandle_t gt1000_init() {
-    message_queue = xQueueCreate(8, sizeof(sysex_buffer_t *));
+    message_queue = xQueueCreate(MESSAGE_QUEUE_LENGTH, sizeof(sysex_buffer_t *));
+    channel_queue = xQueueCreate(CHANNEL_QUEUE_LENGTH, sizeof(midi_message_t));
+    message_set = xQueueCreateSet(MESSAGE_QUEUE_LENGTH + CHANNEL_QUEUE_LENGTH);
 
-    if (!message_queue) {
+    if (!message_queue || !channel_queue || !message_set) {
         ESP_LOGE(TAG, "Failed to create message queue.");
         return NULL;
     }
+    xQueueAddToSet(message_queue, message_set);
+    xQueueAddToSet(channel_queue, message_set);
+
+    if (!patch_codec_init() || !init_repair() || !init_prefetch() || !init_poll()) {
+        return NULL;
+    }
+    sysex_register_midi_queue(MIDI_ROUTE_CHANNEL, channel_queue);
 
     xTaskCreate(handle_message_task,
                 "handle_message",
@@ -241,6 +2494,79 @@ QueueHandle_t gt1000_init() {
     return message_queue;
 }
 
+// Messages are applied in the parsing task, without the handler task and queues
+bool gt1000_init_inline(void) {
+    if (!patch_codec_init() || !init_repair() || !init_prefetch() || !init_poll()) {
+        return false;
+    }
+    sysex_register_message_handler(handle_sysex_message);
+    sysex_register_midi_handler(MIDI_ROUTE_CHANNEL, handle_channel_message);
+    return true;
+}
+
+void gt1000_get_repair_stats(gt1000_repair_stats_t *stats) {
+    portENTER_CRITICAL(&repair_lock);
+    *stats = repair.stats;
+    portEXIT_CRITICAL(&repair_lock);
+}
+
+void gt1000_get_latency_stats(gt1000_latency_stats_t *stats) {
+    portENTER_CRITICAL(&latency_lock);
+    *stats = latency;
+    stats->avg_us = latency.messages ? latency_total_us / latency.messages : 0;
+    portEXIT_CRITICAL(&latency_lock);
+}
+
+void gt1000_get_coalesce_stats(gt1000_coalesce_stats_t *stats) {
+    portENTER_CRITICAL(&coalesce_lock);
+    *stats = coalesce_stats;
+    portEXIT_CRITICAL(&coalesce_lock);
+}
+
+void gt1000_get_sync_stats(gt1000_sync_stats_t *stats) {
+    portENTER_CRITICAL(&sync_lock);
+    *stats = sync.stats;
+    portEXIT_CRITICAL(&sync_lock);
+}
+
+void gt1000_get_snapshot_stats(gt1000_snapshot_stats_t *stats) {
+    portENTER_CRITICAL(&snapshot_lock);
+    *stats = snapshot.stats;
+    portEXIT_CRITICAL(&snapshot_lock);
+}
+
+void gt1000_get_hydration_stats(gt1000_hydration_stats_t *stats) {
+    portENTER_CRITICAL(&snapshot_lock);
+    *stats = hydration.stats;
+    portEXIT_CRITICAL(&snapshot_lock);
+}
+
+void gt1000_get_epoch_stats(gt1000_epoch_stats_t *stats) {
+    portENTER_CRITICAL(&read_lock);
+    *stats = epoch_stats;
+    portEXIT_CRITICAL(&read_lock);
+}
+
+void gt1000_get_poll_stats(gt1000_poll_stats_t *stats) {
+    portENTER_CRITICAL(&poll_lock);
+    *stats = poll.stats;
+    portEXIT_CRITICAL(&poll_lock);
+}
+
+void gt1000_get_drift_stats(gt1000_drift_stats_t *stats) {
+    portENTER_CRITICAL(&poll_lock);
+    *stats = poll.drift_stats;
+    portEXIT_CRITICAL(&poll_lock);
+}
+
+void gt1000_get_patch_cache_stats(gt1000_patch_cache_stats_t *stats) {
+    portENTER_CRITICAL(&cache_lock);
+    *stats = patch_cache.stats;
+    stats->hit_ready_us = patch_cache.hits_ready ? patch_cache.hit_ready_total_us / patch_cache.hits_ready : 0;
+    stats->miss_ready_us = patch_cache.misses_ready ? patch_cache.miss_ready_total_us / patch_cache.misses_ready : 0;
+    portEXIT_CRITICAL(&cache_lock);
+}
+
 void gt1000_set_device_id(uint8_t id) {
     device_id = id;
 }
@@ -288,7 +2614,7 @@ static void gt1000_send_dt1(uint32_t dev_addr, uint32_t value, size_t size) {
     // Write EOX
     message[msg_length - 1] = 0xF7;
 
-    sysex_send(message, msg_length);
+    sysex_send(message, msg_length, MIDI_TX_LANE_REALTIME);
     return;
 
 handle_invalid_parameter:
@@ -323,10 +2649,10 @@ handle_invalid_parameter:
     return;
 }
 
-static void gt1000_send_rq1(uint32_t dev_addr, size_t size) {
+// message holds sizeof(rq1_header) + 10 bytes. Returns the length written.
+static int build_rq1(uint8_t *message, uint32_t dev_addr, size_t size) {
     int msg_length = sizeof(rq1_header) + 4 + 4 + 2;
-    uint8_t message[msg_length];
-    
+
     // Write RQ1 header
     memcpy(message, rq1_header, sizeof(rq1_header));
     
@@ -352,9 +2678,26 @@ static void gt1000_send_rq1(uint32_t dev_addr, size_t size) {
     
     // Write EOX
     message[msg_length - 1] = 0xF7;
+    return msg_length;
+}
 
-    sysex_send(message, msg_length);
-    return;
+static int gt1000_send_rq1(uint32_t dev_addr, size_t size, sysex_request_callback_t cbk, void *arg) {
+    uint8_t message[sizeof(rq1_header) + 4 + 4 + 2];
+    int msg_length = build_rq1(message, dev_addr, size);
+
+    // Replies to reads of the mirror are reassembled, the others are not
+    uint32_t id = is_valid_dev_addr(dev_addr) ? track_read(dev_addr, size, cbk, arg) : 0;
+    int res = id ?
+        sysex_request(message, msg_length, dev_addr, size, pdMS_TO_TICKS(RQ1_TIMEOUT_MS),
+                      handle_read_result, (void *)(uintptr_t)id) :
+        sysex_request(message, msg_length, dev_addr, size, pdMS_TO_TICKS(RQ1_TIMEOUT_MS), cbk, arg);
+    if (res < 0) {
+        if (id) {
+            untrack_read(id);
+        }
+        ESP_LOGW(TAG, "Failed to send rq1 0x%08lx", (unsigned long)dev_addr);
+    }
+    return res;
 }
 
 void gt1000_update_block(gt1000_param_addr_t parameter) {
@@ -372,7 +2715,7 @@ void gt1000_update_block(gt1000_param_addr_t parameter) {
         goto handle_invalid_parameter;
     }
 
-    gt1000_send_rq1(dev_addr, EFFECT_BLOCK_SIZE);
+    gt1000_send_rq1(dev_addr, EFFECT_BLOCK_SIZE, NULL, NULL);
     return;
 
 handle_invalid_parameter:
@@ -398,7 +2741,7 @@ void gt1000_update_parameter(gt1000_param_addr_t parameter) {
     
     size_t size = param.size;
 
-    gt1000_send_rq1(dev_addr, size);
+    gt1000_send_rq1(dev_addr, size, NULL, NULL);
     return;
 
 handle_invalid_parameter:
@@ -407,10 +2750,293 @@ handle_invalid_parameter:
 }
 
 void gt1000_update_patch_name() {
-    gt1000_send_rq1(PATCH_NAME_OFFSET, 16);
+    gt1000_send_rq1(PATCH_NAME_OFFSET, 16, NULL, NULL);
     return;
 }
 
+int gt1000_read_range(uint32_t dev_addr, uint32_t size, sysex_request_callback_t cbk, void *arg) {
+    if (is_valid_dev_addr(dev_addr)) {
+        // Mirror reads go through the tracked paths
+        return -1;
+    }
+    return gt1000_send_rq1(dev_addr, sysex_linear_to_address(size), cbk, arg);
+}
+
+int gt1000_write_range(uint32_t dev_addr, const uint8_t *data, int length) {
+    if (length <= 0 || length > GT1000_MAX_WRITE_SIZE) {
+        ESP_LOGE(TAG, "Invalid write size: %d", length);
+        return -1;
+    }
+
+    uint8_t message[MIDI_TX_MAX_MESSAGE_SIZE];
+    int msg_length = DT1_ENVELOPE_LENGTH + length;
+    memcpy(message, dt1_header, sizeof(dt1_header));
+    message[2] = device_id;
+    uint8_t *data_start = message + sizeof(dt1_header);
+    for (int i = 0; i < 4; ++i) {
+        data_start[i] = (dev_addr >> (24 - 8 * i)) & 0x7F;
+    }
+    memcpy(data_start + 4, data, length);
+    message[msg_length - 2] = calculate_checksum(data_start, length + 4);
+    message[msg_length - 1] = 0xF7;
+
+    return sysex_send(message, msg_length, MIDI_TX_LANE_BULK);
+}
+
+bool gt1000_plan_sync(const gt1000_param_addr_t *parameters, int count, uint32_t max_range_size,
+                      gt1000_sync_plan_t *plan) {
+    typedef struct {
+        uint32_t start;         // Linear addresses
+        uint32_t end;
+    } span_t;
+
+    *plan = (gt1000_sync_plan_t) {0};
+    span_t spans[count > 0 ? count : 1];
+    int span_count = 0;
+
+    for (int i = 0; i < count; ++i) {
+        gt1000_param_t param;
+        if (!is_valid_param_addr(parameters[i]) || !gt1000_get_parameter_info(&param, parameters[i])) {
+            ESP_LOGE(TAG, "Invalid sync parameter %d", i);
+            return false;
+        }
+        uint32_t start = sysex_address_to_linear(param_addr_to_dev_addr(parameters[i]));
+        span_t span = { start, start + param.size };
+        plan->parameter_bytes += param.size;
+
+        // Insertion sort by start address
+        int j = span_count++;
+        for (; j > 0 && spans[j - 1].start > span.start; --j) {
+            spans[j] = spans[j - 1];
+        }
+        spans[j] = span;
+    }
+
+    for (int i = 0; i < span_count; ++i) {
+        span_t span = spans[i];
+        gt1000_range_t *last = plan->range_count ? &plan->ranges[plan->range_count - 1] : NULL;
+        if (last) {
+            uint32_t last_start = sysex_address_to_linear(last->address);
+            uint32_t last_end = last_start + last->size;
+            uint32_t end = span.end > last_end ? span.end : last_end;
+            // Ranges stay within one block. A gap is fetched when its bytes
+            // cost less than another request would.
+            bool same_block = dev_addr_to_block_index(last->address) ==
+                              dev_addr_to_block_index(sysex_linear_to_address(span.start));
+            bool cheaper = span.start <= last_end || span.start - last_end < SYNC_REQUEST_OVERHEAD;
+            if (same_block && cheaper && end - last_start <= max_range_size) {
+                last->size = end - last_start;
+                continue;
+            }
+        }
+
+        if (plan->range_count == GT1000_SYNC_MAX_RANGES) {
+            ESP_LOGE(TAG, "Sync plan needs more than %d requests", GT1000_SYNC_MAX_RANGES);
+            return false;
+        }
+        plan->ranges[plan->range_count++] = (gt1000_range_t) {
+            .address = sysex_linear_to_address(span.start),
+            .size = span.end - span.start,
+        };
+    }
+
+    for (int i = 0; i < plan->range_count; ++i) {
+        plan->requested_bytes += plan->ranges[i].size;
+    }
+    plan->wire_bytes = plan->requested_bytes + plan->range_count * SYNC_REQUEST_OVERHEAD;
+    plan->wire_time_us = plan->wire_bytes * MIDI_BYTE_TIME_US;
+    return true;
+}
+
+static void handle_sync_result(const sysex_request_result_t *result, void *arg) {
+    uint32_t generation = (uint32_t)(uintptr_t)arg;
+
+    portENTER_CRITICAL(&sync_lock);
+    if (result->status == SYSEX_REQUEST_TIMED_OUT) {
+        ++sync.stats.failed_requests;
+    }
+    // Results of an earlier plan do not count towards the current one
+    if (generation == sync.generation && --sync.outstanding == 0) {
+        sync.stats.sync_time_us = esp_timer_get_time() - sync.started_at;
+    }
+    portEXIT_CRITICAL(&sync_lock);
+}
+
+int gt1000_sync(const gt1000_sync_plan_t *plan) {
+    portENTER_CRITICAL(&sync_lock);
+    uint32_t generation = ++sync.generation;
+    sync.outstanding = plan->range_count;
+    sync.started_at = esp_timer_get_time();
+    ++sync.stats.plans;
+    sync.stats.wire_bytes = plan->wire_bytes;
+    sync.stats.wire_time_us = plan->wire_time_us;
+    sync.stats.sync_time_us = 0;
+    portEXIT_CRITICAL(&sync_lock);
+
+    int sent = 0;
+    for (int i = 0; i < plan->range_count; ++i) {
+        const gt1000_range_t *range = &plan->ranges[i];
+        if (gt1000_send_rq1(range->address, sysex_linear_to_address(range->size),
+                            handle_sync_result, (void *)(uintptr_t)generation) < 0) {
+            portENTER_CRITICAL(&sync_lock);
+            ++sync.stats.failed_requests;
+            if (generation == sync.generation) {
+                --sync.outstanding;
+            }
+            portEXIT_CRITICAL(&sync_lock);
+            continue;
+        }
+        ++sent;
+    }
+
+    portENTER_CRITICAL(&sync_lock);
+    sync.stats.requests += sent;
+    portEXIT_CRITICAL(&sync_lock);
+
+    ESP_LOGD(TAG, "Sync plan: %d RQ1s for %lu parameter bytes, %lu bytes on wire, ~%lu us",
+             plan->range_count, (unsigned long)plan->parameter_bytes,
+             (unsigned long)plan->wire_bytes, (unsigned long)plan->wire_time_us);
+    return sent;
+}
+
+bool gt1000_start_snapshot(int window) {
+    if (window < 1 || window > GT1000_SNAPSHOT_MAX_WINDOW) {
+        ESP_LOGE(TAG, "Invalid snapshot window: %d", window);
+        return false;
+    }
+
+    uint32_t blocks[BLOCK_BITMAP_WORDS] = {0};
+    uint32_t block_count = 0;
+    uint32_t skipped_count = 0;
+    for (int i = 0; i < GT1000_EFFECT_BLOCK_COUNT; ++i) {
+        if (block_extent(i) == 0) {
+            continue;
+        }
+        // Only the sub-block of the FX TYPE is fetched, once its FX block landed
+        if (is_fx_sub_block(i)) {
+            ++skipped_count;
+            continue;
+        }
+        bitmap_set(blocks, i);
+        ++block_count;
+    }
+
+    portENTER_CRITICAL(&snapshot_lock);
+    // Results of a snapshot still in flight no longer count
+    ++snapshot.generation;
+    snapshot.next_block = 0;
+    snapshot.inflight = 0;
+    snapshot.started_at = esp_timer_get_time();
+    snapshot.stats.running = true;
+    snapshot.stats.window = window;
+    snapshot.stats.blocks = block_count;
+    snapshot.stats.blocks_landed = 0;
+    snapshot.stats.blocks_failed = 0;
+    snapshot.stats.blocks_skipped = skipped_count;
+    memcpy(snapshot.requested_blocks, blocks, sizeof(blocks));
+    memset(snapshot.fx_pending, 0, sizeof(snapshot.fx_pending));
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    fill_snapshot_window();
+    return true;
+}
+
+void gt1000_set_snapshot_window(int window) {
+    snapshot_window = window;
+}
+
+bool gt1000_is_block_valid(gt1000_param_addr_t parameter) {
+    if (!is_valid_param_addr(parameter)) {
+        return false;
+    }
+    portENTER_CRITICAL(&snapshot_lock);
+    int block = dev_addr_to_block_index(param_addr_to_dev_addr(parameter));
+    bool valid = bitmap_test(valid_blocks, block) && block_epochs[block] == patch_epoch;
+    portEXIT_CRITICAL(&snapshot_lock);
+    return valid;
+}
+
+bool gt1000_read_parameter(gt1000_param_t *param, gt1000_param_addr_t parameter) {
+    if (!is_valid_param_addr(parameter) || !gt1000_get_parameter_info(param, parameter)) {
+        return false;
+    }
+    int block = dev_addr_to_block_index(param_addr_to_dev_addr(parameter));
+    portENTER_CRITICAL(&snapshot_lock);
+    bool valid = bitmap_test(valid_blocks, block);
+    portEXIT_CRITICAL(&snapshot_lock);
+
+    if (!valid) {
+        // Fetched at once, ahead of the prefetch order
+        hydrate_block(block, HYDRATE_FAULT);
+    }
+    return valid;
+}
+
+void gt1000_set_prefetch(bool enable) {
+    portENTER_CRITICAL(&snapshot_lock);
+    if (enable && !hydration.enabled) {
+        // Blocks valid already are skipped, the times count from now
+        hydration.priority_done = false;
+        hydration.converged = false;
+        hydration.preset_changed_at = esp_timer_get_time();
+    }
+    hydration.enabled = enable;
+    portEXIT_CRITICAL(&snapshot_lock);
+    wake_prefetch();
+}
+
+void gt1000_set_priority_parameters(const gt1000_param_addr_t *parameters, int count) {
+    int blocks[GT1000_MAX_PRIORITY_BLOCKS];
+    int block_count = 0;
+    for (int i = 0; i < count && block_count < GT1000_MAX_PRIORITY_BLOCKS; ++i) {
+        if (!is_valid_param_addr(parameters[i])) {
+            ESP_LOGW(TAG, "Priority parameter %d ignored", i);
+            continue;
+        }
+        int block = dev_addr_to_block_index(param_addr_to_dev_addr(parameters[i]));
+        bool listed = false;
+        for (int j = 0; j < block_count; ++j) {
+            listed |= blocks[j] == block;
+        }
+        if (!listed) {
+            blocks[block_count++] = block;
+        }
+    }
+
+    portENTER_CRITICAL(&snapshot_lock);
+    memcpy(hydration.priority_blocks, blocks, block_count * sizeof(blocks[0]));
+    hydration.priority_block_count = block_count;
+    portEXIT_CRITICAL(&snapshot_lock);
+    wake_prefetch();
+}
+
+void gt1000_set_patch_cache_budget(size_t bytes) {
+    // Patches over the budget are evicted with the next one saved
+    portENTER_CRITICAL(&cache_lock);
+    patch_cache.budget = bytes;
+    portEXIT_CRITICAL(&cache_lock);
+}
+
+void gt1000_get_poll_config(gt1000_poll_config_t *config) {
+    portENTER_CRITICAL(&poll_lock);
+    *config = poll.config;
+    portEXIT_CRITICAL(&poll_lock);
+}
+
+void gt1000_set_poll_config(const gt1000_poll_config_t *config) {
+    portENTER_CRITICAL(&poll_lock);
+    poll.config = *config;
+    if (poll.config.bandwidth_percent > 100) {
+        poll.config.bandwidth_percent = 100;
+    }
+    if (poll.config.max_interval_ms < poll.config.min_interval_ms) {
+        poll.config.max_interval_ms = poll.config.min_interval_ms;
+    }
+    poll.stats.bytes_per_sec = MIDI_LINE_RATE_BYTES * poll.config.bandwidth_percent / 100;
+    portEXIT_CRITICAL(&poll_lock);
+    wake_poll();
+}
+
 void gt1000_register_callback(gt1000_callback_t cbk) {
     callback = cbk;
     return;
@@ -421,8 +3047,26 @@ void gt1000_enable_notifications() {
     uint8_t message[msg_length];
     memcpy(message, notification_enable_sequence, msg_length);
     message[2] = device_id;
-    sysex_send(message, msg_length);
+    sysex_send(message, msg_length, MIDI_TX_LANE_BULK);
     ESP_LOGI(TAG, "Parameter change notification enabled");
+
+    // The patch cache needs the number of the loaded patch, the device only
+    // sends it on a change
+    portENTER_CRITICAL(&repair_lock);
+    repair.patch_number_stale = !repair.patch_number_inflight;
+    portEXIT_CRITICAL(&repair_lock);
+    schedule_repair(pdMS_TO_TICKS(REPAIR_DELAY_MS));
+
+    portENTER_CRITICAL(&poll_lock);
+    bool first = !poll.notifications_enabled;
+    poll.notifications_enabled = true;
+    if (first) {
+        poll.probe_due_at = esp_timer_get_time() + poll.config.probe_interval_ms * 1000LL;
+        poll.probe_inflight = false;
+        poll.unanswered_probes = 0;
+    }
+    portEXIT_CRITICAL(&poll_lock);
+    wake_poll();
     return;
 }
 
@@ -431,6 +3075,11 @@ void gt1000_disable_notifications() {
     uint8_t message[msg_length];
     memcpy(message, notification_disable_sequence, msg_length);
     message[2] = device_id;
-    sysex_send(message, msg_length);
+    sysex_send(message, msg_length, MIDI_TX_LANE_BULK);
     ESP_LOGI(TAG, "Parameter change notification disabled");
+
+    portENTER_CRITICAL(&poll_lock);
+    poll.notifications_enabled = false;
+    portEXIT_CRITICAL(&poll_lock);
+    set_sync_mode(GT1000_SYNC_POLLING, "Notifications disabled");
 }
\ No newline at end of file
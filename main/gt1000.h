@@ -3,6 +3,7 @@
 
 #include "freertos/FreeRTOS.h"
 #include "gt1000_param.h"
+#include "sysex.h"
 
 typedef enum
 {
@@ -10,11 +11,158 @@ typedef enum
     PRESET_CHANGE,
     PRESET_NAME_UPDATE,
     PARAMETER_UPDATE,
+    RANGE_SYNCED,                   // Every reply to a read request has been applied
+    SNAPSHOT_PROGRESS,              // A block of the running snapshot has been applied
+    SNAPSHOT_COMPLETE,              // Every block of the snapshot landed or failed
+    PATCH_RESTORED,                 // A cached copy of the new patch filled the mirror, it is
+                                    // validated in the background
 } gt1000_event_t;
 
-typedef void (*gt1000_callback_t)(gt1000_event_t);
+typedef struct {
+    uint32_t address;               // Device address of the first byte
+    uint32_t size;                  // Bytes
+} gt1000_range_t;
+
+// range is the span an event updated, for PARAMETER_UPDATE, RANGE_SYNCED and
+// SNAPSHOT_PROGRESS only
+typedef void (*gt1000_callback_t)(gt1000_event_t event, const gt1000_range_t *range);
+
+typedef struct {
+    uint32_t loss_events;           // Lost messages and stream losses reported by the pipeline
+    uint32_t unknown_losses;        // ...whose address could not be recovered
+    uint32_t checksum_failures;
+    uint32_t repairs_requested;     // RQ1s issued to repair the mirror
+    uint32_t repairs_completed;
+    uint32_t repairs_failed;        // Repair requests left unanswered
+} gt1000_repair_stats_t;
+
+// Time from the arrival of a DT1's last chunk to the return of the event callback
+typedef struct {
+    uint32_t messages;
+    uint32_t last_us;
+    uint32_t avg_us;
+    uint32_t max_us;
+} gt1000_latency_stats_t;
+
+typedef struct {
+    uint32_t batches;               // Message queue drains by the handler task
+    uint32_t max_batch;             // Most messages taken in one drain
+    uint32_t coalesced;             // Updates that replaced at least one pending value
+    uint32_t superseded;            // Pending values dropped for a newer one
+} gt1000_coalesce_stats_t;
+
+#define GT1000_SYNC_MAX_RANGES      16
+// Largest RQ1 a plan emits by default, a whole effect block
+#define GT1000_SYNC_MAX_RANGE_SIZE  128
+
+// RQ1 ranges covering a set of parameters, and what fetching them costs
+typedef struct {
+    gt1000_range_t ranges[GT1000_SYNC_MAX_RANGES];
+    int range_count;
+    uint32_t parameter_bytes;       // Bytes the parameters occupy
+    uint32_t requested_bytes;       // Bytes the ranges cover, gaps included
+    uint32_t wire_bytes;            // RQ1s plus their DT1 replies
+    uint32_t wire_time_us;          // wire_bytes at 31250 baud
+} gt1000_sync_plan_t;
+
+typedef struct {
+    uint32_t plans;                 // Plans sent
+    uint32_t requests;
+    uint32_t failed_requests;       // Not sent, or timed out
+    uint32_t wire_bytes;            // Last plan
+    uint32_t wire_time_us;          // Last plan, estimated
+    uint32_t sync_time_us;          // Last plan, from sending to its last reply
+} gt1000_sync_stats_t;
+
+// Snapshot RQ1s in flight at once, the rest of the request table is left to
+// repairs and other reads
+#define GT1000_SNAPSHOT_MAX_WINDOW  12
+
+typedef struct {
+    bool running;
+    uint32_t window;
+    uint32_t blocks;                // Blocks in the current or last snapshot
+    uint32_t blocks_landed;
+    uint32_t blocks_failed;         // Not sent, or timed out
+    uint32_t blocks_skipped;        // Sub-blocks of inactive FX TYPEs
+    uint32_t fx_type_fetches;       // Sub-blocks fetched after an FX TYPE change
+    uint32_t snapshots;             // Completed
+    uint32_t sync_time_us;          // Last completed snapshot
+} gt1000_snapshot_stats_t;
+
+// Data bytes of one DT1 from gt1000_write_range()
+#define GT1000_MAX_WRITE_SIZE       (MIDI_TX_MAX_MESSAGE_SIZE - 14)
+
+// Blocks the prefetch task fetches before all others
+#define GT1000_MAX_PRIORITY_BLOCKS  8
+
+typedef struct {
+    uint32_t faults;                // Blocks fetched because a read found them invalid
+    uint32_t prefetched;            // Blocks requested by the prefetch task
+    uint32_t failed;                // Not sent, or timed out
+    uint32_t priority_time_us;      // Last preset change until every priority block was valid
+    uint32_t converge_time_us;      // Last preset change until the whole mirror was valid
+} gt1000_hydration_stats_t;
+
+typedef struct {
+    uint32_t epoch;                 // Advances on every PRESET_CHANGE
+    uint32_t stale_replies;         // Replies to reads of an earlier patch, discarded
+    uint32_t cancelled_requests;    // Queued RQ1s of an earlier patch that never went out
+} gt1000_epoch_stats_t;
+
+typedef enum {
+    GT1000_SYNC_STREAMING,          // The device sends a DT1 for every change
+    GT1000_SYNC_POLLING,            // Notifications are off, the mirror is polled
+} gt1000_sync_mode_t;
+
+typedef struct {
+    uint32_t bandwidth_percent;     // Share of the 31250 baud line polls may use
+    uint32_t min_interval_ms;       // Fastest poll of a block that keeps changing
+    uint32_t max_interval_ms;       // Slowest poll of a block that never changes
+    uint32_t priority_interval_ms;  // Slowest poll of a priority block
+    uint32_t verify_interval_ms;    // Priority block polls while streaming, 0 disables
+    uint32_t probe_interval_ms;     // Reads of the notification flag, 0 disables
+    uint32_t drift_interval_ms;     // Drift checks of valid blocks while streaming, 0 disables
+} gt1000_poll_config_t;
+
+typedef struct {
+    gt1000_sync_mode_t mode;
+    uint32_t switches;              // Between streaming and polling
+    uint32_t polls;
+    uint32_t changes_found;         // Polls that changed a valid block
+    uint32_t missed_changes;        // ...while streaming, each one switches to polling
+    uint32_t flag_resets;           // Probes that found notifications off
+    uint32_t unanswered_probes;     // Probes the device never answered
+    uint32_t bytes_per_sec;         // Poll budget, RQ1s and replies
+} gt1000_poll_stats_t;
+
+typedef struct {
+    uint32_t verified;              // Blocks whose hash was compared with a reply
+    uint32_t drifted;               // ...that differed and were repaired
+    uint32_t inconclusive;          // Changed while the check was in flight
+    uint32_t sweeps;                // Passes over every valid block
+    uint32_t sweep_time_ms;         // Duration of the last pass
+    uint32_t drift_permille;        // Drifted per 1000 verified
+} gt1000_drift_stats_t;
+
+// Patches the cache holds at most, whatever the budget
+#define GT1000_PATCH_CACHE_MAX_ENTRIES  16
+
+typedef struct {
+    uint32_t hits;                  // Preset changes to a cached patch
+    uint32_t misses;
+    uint32_t evictions;             // Least recently used patches dropped for the budget
+    uint32_t entries;
+    uint32_t bytes_used;            // Encoded patches and the reference they are encoded against
+    uint32_t raw_bytes;             // The cached blocks would take unencoded
+    uint32_t stale_blocks;          // Cached blocks the validation found changed
+    uint32_t hit_ready_us;          // Average time from a hit until the priority blocks were valid
+    uint32_t miss_ready_us;         // ...from a miss
+} gt1000_patch_cache_stats_t;
 
 QueueHandle_t gt1000_init();
+// Event callbacks then run in the parsing task and must not wait for replies
+bool gt1000_init_inline(void);
 void gt1000_set_device_id(uint8_t id);
 gt1000_t *gt1000_get_device(void);
 gt1000_param_addr_t gt1000_update_state_from_sysex(uint8_t *message, int length);
@@ -22,8 +170,52 @@ void gt1000_update_parameter(gt1000_param_addr_t parameter);
 void gt1000_update_block(gt1000_param_addr_t block);
 void gt1000_set_parameter(gt1000_param_addr_t parameter, uint32_t value);
 void gt1000_update_patch_name(void);
+// Reads size bytes at a device address outside the mirror. cbk gets the last
+// reply DT1. Returns a negative value if the RQ1 could not be sent.
+int gt1000_read_range(uint32_t dev_addr, uint32_t size, sysex_request_callback_t cbk, void *arg);
+// Writes data to a device address with one DT1 on the bulk lane, at most
+// GT1000_MAX_WRITE_SIZE bytes
+int gt1000_write_range(uint32_t dev_addr, const uint8_t *data, int length);
+// Merges the parameters into the fewest RQ1 ranges of at most max_range_size
+// bytes, over-fetching a gap only when that is cheaper than another request
+bool gt1000_plan_sync(const gt1000_param_addr_t *parameters, int count, uint32_t max_range_size,
+                      gt1000_sync_plan_t *plan);
+// Returns the number of requests sent
+int gt1000_sync(const gt1000_sync_plan_t *plan);
+// Fetches every effect block with up to window RQ1s in flight. Of the FX
+// sub-blocks only the one of the current FX TYPE is fetched.
+bool gt1000_start_snapshot(int window);
+// Starts a snapshot after every preset change, 0 disables
+void gt1000_set_snapshot_window(int window);
+// True while the block holding parameter matches the current preset
+bool gt1000_is_block_valid(gt1000_param_addr_t parameter);
+// Like gt1000_get_parameter_info(), and fetches the block if it is not valid.
+// Returns false if the value may be stale, RANGE_SYNCED follows once it lands.
+bool gt1000_read_parameter(gt1000_param_t *param, gt1000_param_addr_t parameter);
+// The prefetch task fetches every invalid block in the background: the blocks
+// of the priority parameters, then the other blocks of the chain, then the FX
+// sub-blocks, the active ones first
+void gt1000_set_prefetch(bool enable);
+void gt1000_set_priority_parameters(const gt1000_param_addr_t *parameters, int count);
+// Keeps the mirror of the last patches within bytes of RAM, so switching back
+// to one fills the mirror at once and only validates it. 0 turns it off.
+void gt1000_set_patch_cache_budget(size_t bytes);
+// Polls the blocks of the mirror round-robin once notifications stop: the
+// priority blocks most often, and each block faster the more it changes
+void gt1000_get_poll_config(gt1000_poll_config_t *config);
+void gt1000_set_poll_config(const gt1000_poll_config_t *config);
 void gt1000_register_callback(gt1000_callback_t cbk);
 void gt1000_enable_notifications(void);
 void gt1000_disable_notifications(void);
+void gt1000_get_repair_stats(gt1000_repair_stats_t *stats);
+void gt1000_get_latency_stats(gt1000_latency_stats_t *stats);
+void gt1000_get_coalesce_stats(gt1000_coalesce_stats_t *stats);
+void gt1000_get_sync_stats(gt1000_sync_stats_t *stats);
+void gt1000_get_snapshot_stats(gt1000_snapshot_stats_t *stats);
+void gt1000_get_hydration_stats(gt1000_hydration_stats_t *stats);
+void gt1000_get_epoch_stats(gt1000_epoch_stats_t *stats);
+void gt1000_get_poll_stats(gt1000_poll_stats_t *stats);
+void gt1000_get_drift_stats(gt1000_drift_stats_t *stats);
+void gt1000_get_patch_cache_stats(gt1000_patch_cache_stats_t *stats);
 
 #endif
\ No newline at end of file
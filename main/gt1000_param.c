@@ -784,4 +784,25 @@ bool gt1000_get_parameter_info(gt1000_param_t *param, gt1000_param_addr_t parame
     };
 
     return false;
+}
+
+// Number of bytes from the start of the block containing parameter up to and
+// including its last defined parameter.
+size_t gt1000_get_block_extent(gt1000_param_addr_t parameter) {
+    const gt1000_t *device = gt1000_get_device();
+    const gt1000_effect_t *base = &(device->effect);
+    const uint8_t effect_block_index = gt1000_get_effect_block_index(base, parameter);
+
+    const effect_block_t *block = &effect_block_list[effect_block_index];
+    const effect_block_metadata_t *metadata = &effect_block_metadata_list[block->type];
+
+    size_t extent = 0;
+    for (int i = 0; i < metadata->param_len; ++i) {
+        size_t end = metadata->params[i].offset + metadata->params[i].size;
+        if (end > extent) {
+            extent = end;
+        }
+    }
+
+    return extent;
 }
\ No newline at end of file
@@ -765,6 +765,9 @@ typedef struct {
     uint32_t value;
 } gt1000_param_t;
 
+#define GT1000_EFFECT_BLOCK_COUNT   (sizeof(gt1000_effect_t) / EFFECT_BLOCK_SIZE)
+
 bool gt1000_get_parameter_info(gt1000_param_t *param, gt1000_param_addr_t parameter);
+size_t gt1000_get_block_extent(gt1000_param_addr_t parameter);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,459 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [host_main.c] - Linux target entry point for exercising the MIDI pipeline
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sysex.h"
+#include "midi_transport.h"
+#include "midi_tx.h"
+#include "host_transport.h"
+#include "host_sim.h"
+#include "gt1000.h"
+#include "librarian.h"
+#include "patch_codec.h"
+
+#define HOST_DEVICE_ID_ENV              "GT1000_DEVICE_ID"
+#define HOST_REPORT_INTERVAL_MS         1000
+#define HOST_BENCH_PARSER_ENV           "GT1000_BENCH_PARSER"
+#define HOST_BENCH_CHUNK_SIZE           32
+#define HOST_BENCH_MESSAGE_SIZE         18
+#define HOST_RX_INLINE_ENV              "GT1000_RX_INLINE"
+#define HOST_BENCH_SNAPSHOT_ENV         "GT1000_BENCH_SNAPSHOT"
+#define HOST_BENCH_SNAPSHOT_TIMEOUT_MS  60000
+#define HOST_BENCH_HYDRATE_ENV          "GT1000_BENCH_HYDRATE"
+#define HOST_PATCH_CACHE_BYTES          (8 * 1024)
+#define HOST_BENCH_LIBRARIAN_ENV        "GT1000_BENCH_LIBRARIAN"
+#define HOST_BENCH_LIBRARIAN_TIMEOUT_MS 600000
+// Time for the last restore DT1 to leave midi_tx
+#define HOST_BENCH_LIBRARIAN_SETTLE_MS  100
+#define HOST_BENCH_CODEC_ENV            "GT1000_BENCH_CODEC"
+#define HOST_BENCH_CODEC_EDITS          16
+#define HOST_BENCH_CODEC_ROUNDS         100
+
+#define TAG "MAIN"
+
+static volatile uint32_t handled_events;
+static volatile bool stream_closed;
+
+static void gt1000_event_callback(gt1000_event_t event, const gt1000_range_t *range)
+{
+    ++handled_events;
+}
+
+static void transport_event_callback(midi_transport_event_t event)
+{
+    if (event == MIDI_TRANSPORT_EVENT_CLOSED) {
+        stream_closed = true;
+    }
+}
+
+static void report(int64_t start, bool final)
+{
+    sysex_stats_t stats;
+    sysex_get_stats(&stats);
+
+    double elapsed = (esp_timer_get_time() - start) / 1000000.0;
+    if (elapsed <= 0) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "%s%.2fs: %lu messages (%.0f/s), %lu handled (%.0f/s), %lu parser wakeups",
+             final ? "Done. " : "",
+             elapsed,
+             (unsigned long)stats.messages, stats.messages / elapsed,
+             (unsigned long)handled_events, handled_events / elapsed,
+             (unsigned long)stats.parser_wakeups);
+    if (stats.requests) {
+        ESP_LOGI(TAG, "Requests: %lu completed, %lu timed out, %lu cancelled, %lu pending, "
+                 "rtt avg %luus max %luus",
+                 (unsigned long)stats.requests_completed, (unsigned long)stats.requests_timed_out,
+                 (unsigned long)stats.requests_cancelled, (unsigned long)stats.requests_pending,
+                 (unsigned long)stats.request_rtt_avg_us,
+                 (unsigned long)stats.request_rtt_max_us);
+    }
+
+    gt1000_coalesce_stats_t coalesce;
+    gt1000_get_coalesce_stats(&coalesce);
+    if (coalesce.superseded) {
+        ESP_LOGI(TAG, "Coalescing: %lu updates replaced %lu pending values, largest batch %lu",
+                 (unsigned long)coalesce.coalesced, (unsigned long)coalesce.superseded,
+                 (unsigned long)coalesce.max_batch);
+    }
+
+    gt1000_sync_stats_t sync;
+    gt1000_get_sync_stats(&sync);
+    if (sync.plans) {
+        ESP_LOGI(TAG, "Sync: %lu plans, %lu requests, %lu failed, last %lu bytes on wire, "
+                 "%luus estimated, %luus to full sync",
+                 (unsigned long)sync.plans, (unsigned long)sync.requests,
+                 (unsigned long)sync.failed_requests, (unsigned long)sync.wire_bytes,
+                 (unsigned long)sync.wire_time_us, (unsigned long)sync.sync_time_us);
+    }
+
+    gt1000_epoch_stats_t epoch;
+    gt1000_get_epoch_stats(&epoch);
+    if (epoch.stale_replies || epoch.cancelled_requests) {
+        ESP_LOGI(TAG, "Epochs: %lu preset changes, %lu stale replies dropped, %lu queued RQ1s cancelled",
+                 (unsigned long)epoch.epoch, (unsigned long)epoch.stale_replies,
+                 (unsigned long)epoch.cancelled_requests);
+    }
+
+    gt1000_patch_cache_stats_t cache;
+    gt1000_get_patch_cache_stats(&cache);
+    if (cache.hits || cache.misses) {
+        ESP_LOGI(TAG, "Patch cache: %lu hits, %lu misses, %lu patches in %lu bytes (%lu unencoded), "
+                 "%lu evicted, %lu stale blocks, ready after %luus (hit) %luus (miss)",
+                 (unsigned long)cache.hits, (unsigned long)cache.misses,
+                 (unsigned long)cache.entries, (unsigned long)cache.bytes_used, (unsigned long)cache.raw_bytes,
+                 (unsigned long)cache.evictions, (unsigned long)cache.stale_blocks,
+                 (unsigned long)cache.hit_ready_us, (unsigned long)cache.miss_ready_us);
+    }
+
+    gt1000_latency_stats_t latency;
+    gt1000_get_latency_stats(&latency);
+    if (latency.messages) {
+        ESP_LOGI(TAG, "Latency: %lu DT1s, last %luus avg %luus max %luus",
+                 (unsigned long)latency.messages, (unsigned long)latency.last_us,
+                 (unsigned long)latency.avg_us, (unsigned long)latency.max_us);
+    }
+}
+
+// Feeds the parser directly with parameter change notifications, the way the
+// device sends them while a knob turns, and drains the results inline.
+static void run_parser_benchmark(int messages)
+{
+    size_t stream_length = (size_t)messages * HOST_BENCH_MESSAGE_SIZE;
+    uint8_t *stream = malloc(stream_length);
+    QueueHandle_t queue = xQueueCreate(8, sizeof(sysex_buffer_t *));
+    if (!stream || !queue) {
+        ESP_LOGE(TAG, "Out of memory for benchmark");
+        exit(1);
+    }
+
+    for (int i = 0; i < messages; ++i) {
+        uint8_t *msg = stream + (size_t)i * HOST_BENCH_MESSAGE_SIZE;
+        const uint8_t header[] = { 0xF0, 0x41, 0x10, 0x00, 0x00, 0x00, 0x4F, 0x12 };
+        memcpy(msg, header, sizeof(header));
+        // Address and a 4 byte value
+        const uint8_t body[] = { 0x10, 0x00, 0x12 + (i % 0x60), i & 0x7F, 0x00, 0x00, (i >> 7) & 0x7F, i & 0x7F };
+        memcpy(msg + sizeof(header), body, sizeof(body));
+        uint8_t sum = 0;
+        for (int j = 0; j < sizeof(body); ++j) {
+            sum += body[j];
+        }
+        msg[HOST_BENCH_MESSAGE_SIZE - 2] = -sum & 0x7F;
+        msg[HOST_BENCH_MESSAGE_SIZE - 1] = 0xF7;
+    }
+
+    sysex_register_device_message_queue(queue);
+
+    uint32_t valid = 0;
+    int64_t start = esp_timer_get_time();
+    for (size_t offset = 0; offset < stream_length; offset += HOST_BENCH_CHUNK_SIZE) {
+        size_t chunk = stream_length - offset < HOST_BENCH_CHUNK_SIZE ?
+            stream_length - offset : HOST_BENCH_CHUNK_SIZE;
+        sysex_feed(stream + offset, chunk, esp_timer_get_time());
+
+        sysex_buffer_t *buffer;
+        while (xQueueReceive(queue, &buffer, 0)) {
+            valid += buffer->dt1.valid && buffer->dt1.checksum_ok;
+            sysex_free_buffer(buffer);
+        }
+    }
+    double elapsed = (esp_timer_get_time() - start) / 1000000.0;
+
+    ESP_LOGI(TAG, "Parser: %d messages in %.3fs (%.0f/s), %lu valid",
+             messages, elapsed, messages / elapsed, (unsigned long)valid);
+    free(stream);
+    exit(valid == messages ? 0 : 1);
+}
+
+static void decode_into_patch(int block, const uint8_t *data, size_t extent, void *arg)
+{
+    memcpy((uint8_t *)arg + block * EFFECT_BLOCK_SIZE, data, extent);
+}
+
+static size_t block_extent(int block)
+{
+    return gt1000_get_block_extent((uint8_t *)&gt1000_get_device()->effect + block * EFFECT_BLOCK_SIZE);
+}
+
+// Encodes and decodes synthetic patches that differ from a default patch in a
+// few parameters, against the default patch and against an all-zero one
+static void run_codec_benchmark(int patches)
+{
+    gt1000_effect_t *defaults = calloc(1, sizeof(gt1000_effect_t));
+    gt1000_effect_t *patch = calloc(1, sizeof(gt1000_effect_t));
+    gt1000_effect_t *decoded = calloc(1, sizeof(gt1000_effect_t));
+    patch_codec_reference_t *reference = malloc(sizeof(patch_codec_reference_t));
+    patch_codec_reference_t *zeros = calloc(1, sizeof(patch_codec_reference_t));
+    size_t encoded_size = 2 * patch_codec_packed_size();
+    uint8_t *encoded = malloc(encoded_size);
+    if (patches <= 0 || !defaults || !patch || !decoded || !reference || !zeros || !encoded) {
+        exit(1);
+    }
+
+    srand(1);
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        uint8_t *data = (uint8_t *)defaults + block * EFFECT_BLOCK_SIZE;
+        for (size_t i = 0; i < block_extent(block); ++i) {
+            data[i] = rand() & 0x7F;
+        }
+    }
+    patch_codec_pack(reference, defaults);
+
+    uint64_t delta_bytes = 0;
+    uint64_t zero_bytes = 0;
+    int64_t encode_us = 0;
+    int64_t decode_us = 0;
+    bool ok = true;
+    for (int n = 0; n < patches; ++n) {
+        memcpy(patch, defaults, sizeof(gt1000_effect_t));
+        for (int i = 0; i < HOST_BENCH_CODEC_EDITS; ++i) {
+            int block = rand() % GT1000_EFFECT_BLOCK_COUNT;
+            ((uint8_t *)patch)[block * EFFECT_BLOCK_SIZE + rand() % block_extent(block)] = rand() & 0x7F;
+        }
+
+        int length = 0;
+        int64_t start = esp_timer_get_time();
+        for (int round = 0; round < HOST_BENCH_CODEC_ROUNDS; ++round) {
+            length = patch_codec_encode(patch, NULL, reference, encoded, encoded_size);
+        }
+        encode_us += esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        for (int round = 0; round < HOST_BENCH_CODEC_ROUNDS; ++round) {
+            ok &= patch_codec_decode(encoded, length, NULL, reference, decode_into_patch, decoded);
+        }
+        decode_us += esp_timer_get_time() - start;
+
+        ok &= length >= 0 && memcmp(decoded, patch, sizeof(gt1000_effect_t)) == 0;
+        delta_bytes += length;
+        zero_bytes += patch_codec_encode(patch, NULL, zeros, encoded, encoded_size);
+    }
+
+    double delta = (double)delta_bytes / patches;
+    double zero = (double)zero_bytes / patches;
+    double calls = (double)patches * HOST_BENCH_CODEC_ROUNDS;
+    ESP_LOGI(TAG, "Codec: %u byte patch, %u parameter bytes, %d edits from the defaults",
+             (unsigned)sizeof(gt1000_effect_t), (unsigned)patch_codec_packed_size(), HOST_BENCH_CODEC_EDITS);
+    ESP_LOGI(TAG, "Codec: %.1f bytes against the defaults (%.0fx), %.1f bytes against zeros (%.0fx)",
+             delta, sizeof(gt1000_effect_t) / delta, zero, sizeof(gt1000_effect_t) / zero);
+    ESP_LOGI(TAG, "Codec: encode %.2f us, decode %.2f us per patch",
+             encode_us / calls, decode_us / calls);
+
+    free(defaults);
+    free(patch);
+    free(decoded);
+    free(reference);
+    free(zeros);
+    free(encoded);
+    exit(ok ? 0 : 1);
+}
+
+// Takes full snapshots from the simulated device with growing RQ1 windows
+static void run_snapshot_benchmark(void)
+{
+    static const int windows[] = { 1, 2, 4, 8, GT1000_SNAPSHOT_MAX_WINDOW };
+    bool ok = true;
+
+    for (int i = 0; i < sizeof(windows) / sizeof(windows[0]); ++i) {
+        gt1000_snapshot_stats_t stats;
+        gt1000_get_snapshot_stats(&stats);
+        uint32_t completed = stats.snapshots;
+
+        if (!gt1000_start_snapshot(windows[i])) {
+            exit(1);
+        }
+        int64_t deadline = esp_timer_get_time() + HOST_BENCH_SNAPSHOT_TIMEOUT_MS * 1000LL;
+        do {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            gt1000_get_snapshot_stats(&stats);
+        } while (stats.snapshots == completed && esp_timer_get_time() < deadline);
+
+        if (stats.snapshots == completed) {
+            ESP_LOGE(TAG, "Window %d: snapshot did not finish", windows[i]);
+            exit(1);
+        }
+        ESP_LOGI(TAG, "Window %2d: %lu blocks in %lu ms, %lu failed, %lu FX sub-blocks skipped",
+                 windows[i], (unsigned long)stats.blocks_landed,
+                 (unsigned long)(stats.sync_time_us / 1000), (unsigned long)stats.blocks_failed,
+                 (unsigned long)stats.blocks_skipped);
+        ok &= stats.blocks_failed == 0;
+    }
+    exit(ok ? 0 : 1);
+}
+
+// Hydrates the mirror from the simulated device, the button-mapped blocks of
+// the firmware first
+static void run_hydration_benchmark(void)
+{
+    gt1000_t *device = gt1000_get_device();
+    const gt1000_param_addr_t mapped[] = {
+        &device->effect.comp.sw,
+        &device->effect.dist1.sw,
+        &device->effect.mstdelay.sw,
+    };
+    gt1000_set_priority_parameters(mapped, sizeof(mapped) / sizeof(mapped[0]));
+    gt1000_set_prefetch(true);
+
+    gt1000_hydration_stats_t stats;
+    int64_t deadline = esp_timer_get_time() + HOST_BENCH_SNAPSHOT_TIMEOUT_MS * 1000LL;
+    do {
+        vTaskDelay(pdMS_TO_TICKS(10));
+        gt1000_get_hydration_stats(&stats);
+    } while (stats.converge_time_us == 0 && esp_timer_get_time() < deadline);
+
+    if (stats.converge_time_us == 0) {
+        ESP_LOGE(TAG, "Hydration did not finish");
+        exit(1);
+    }
+    ESP_LOGI(TAG, "Hydration: priority blocks in %lu ms, mirror in %lu ms, %lu blocks, %lu failed",
+             (unsigned long)(stats.priority_time_us / 1000),
+             (unsigned long)(stats.converge_time_us / 1000),
+             (unsigned long)stats.prefetched, (unsigned long)stats.failed);
+    exit(stats.failed == 0 ? 0 : 1);
+}
+
+// Waits for the librarian to go idle, false on timeout
+static bool wait_librarian(void)
+{
+    librarian_stats_t stats;
+    int64_t deadline = esp_timer_get_time() + HOST_BENCH_LIBRARIAN_TIMEOUT_MS * 1000LL;
+    do {
+        vTaskDelay(pdMS_TO_TICKS(100));
+        librarian_get_stats(&stats);
+    } while (stats.state != LIBRARIAN_IDLE && esp_timer_get_time() < deadline);
+    return stats.state == LIBRARIAN_IDLE;
+}
+
+// Dumps patches from the simulated device into the flash partition, erases
+// them on the device and restores them
+static void run_librarian_benchmark(int patches)
+{
+    if (patches <= 0 || patches > LIBRARIAN_PATCH_COUNT || !librarian_init()) {
+        exit(1);
+    }
+    // Only the dump's reads are compared
+    host_sim_reset_memory();
+    if (!librarian_start_dump(patches, false) || !wait_librarian()) {
+        ESP_LOGE(TAG, "Dump did not finish");
+        exit(1);
+    }
+    host_sim_erase_sent();
+    if (!librarian_start_restore(0, patches) || !wait_librarian()) {
+        ESP_LOGE(TAG, "Restore did not finish");
+        exit(1);
+    }
+    // The last DT1s are still queued when the restore returns
+    midi_tx_lane_stats_t tx;
+    while (midi_tx_get_stats(MIDI_TX_LANE_BULK, &tx) && tx.queue_depth > 0) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    vTaskDelay(pdMS_TO_TICKS(HOST_BENCH_LIBRARIAN_SETTLE_MS));
+    uint32_t compared;
+    uint32_t differing = host_sim_compare_sent(&compared);
+
+    librarian_stats_t stats;
+    librarian_get_stats(&stats);
+    ESP_LOGI(TAG, "Librarian: dump %d patches in %lu ms (%lu ms each), %lu RQ1s retried",
+             patches, (unsigned long)(stats.dump_time_us / 1000),
+             (unsigned long)(stats.dump_time_us / 1000 / patches), (unsigned long)stats.failed_requests);
+    ESP_LOGI(TAG, "Librarian: restore in %lu ms (%lu ms each), %lu flow control waits, %lu writes failed",
+             (unsigned long)(stats.restore_time_us / 1000),
+             (unsigned long)(stats.restore_time_us / 1000 / patches), (unsigned long)stats.flow_waits,
+             (unsigned long)stats.failed_writes);
+    ESP_LOGI(TAG, "Librarian: %lu bytes per patch in a %lu byte slot, %lu patches stored",
+             (unsigned long)stats.record_bytes, (unsigned long)stats.slot_bytes,
+             (unsigned long)stats.patches_stored);
+    ESP_LOGI(TAG, "Librarian: %lu of %lu dumped bytes differ on the device after the restore",
+             (unsigned long)differing, (unsigned long)compared);
+    bool ok = stats.patches_stored == patches && stats.restored == patches && compared > 0 && differing == 0;
+    exit(ok ? 0 : 1);
+}
+
+void app_main(void)
+{
+    // The parser benchmark drains the device queue itself
+    bool inline_rx = getenv(HOST_RX_INLINE_ENV) && !getenv(HOST_BENCH_PARSER_ENV);
+    MessageBufferHandle_t parser_buffer = NULL;
+    if (inline_rx) {
+        if (!gt1000_init_inline() || !sysex_init_inline()) {
+            return;
+        }
+    } else {
+        QueueHandle_t gt1000_msg_queue = gt1000_init();
+        parser_buffer = sysex_init();
+        sysex_register_device_message_queue(gt1000_msg_queue);
+    }
+    gt1000_register_callback(gt1000_event_callback);
+    gt1000_set_patch_cache_budget(HOST_PATCH_CACHE_BYTES);
+
+    const char *bench_messages = getenv(HOST_BENCH_PARSER_ENV);
+    if (bench_messages) {
+        run_parser_benchmark(atoi(bench_messages));
+    }
+    const char *bench_codec = getenv(HOST_BENCH_CODEC_ENV);
+    if (bench_codec) {
+        run_codec_benchmark(atoi(bench_codec));
+    }
+
+    bool bench_snapshot = getenv(HOST_BENCH_SNAPSHOT_ENV) != NULL;
+    bool bench_hydrate = getenv(HOST_BENCH_HYDRATE_ENV) != NULL;
+    const char *bench_patches = getenv(HOST_BENCH_LIBRARIAN_ENV);
+    bool simulated = bench_snapshot || bench_hydrate || bench_patches;
+    if (!midi_transport_init(simulated ? host_sim_get_transport() : host_get_transport())) {
+        return;
+    }
+    midi_transport_register_event_callback(transport_event_callback);
+    if (parser_buffer) {
+        midi_transport_register_consumer(parser_buffer);
+    }
+    midi_tx_init();
+
+    const char *device_id = getenv(HOST_DEVICE_ID_ENV);
+    if (simulated) {
+        gt1000_set_device_id(HOST_SIM_DEVICE_ID);
+        sysex_start_parsing();
+        if (bench_snapshot) {
+            run_snapshot_benchmark();
+        }
+        if (bench_patches) {
+            run_librarian_benchmark(atoi(bench_patches));
+        }
+        run_hydration_benchmark();
+    } else if (device_id) {
+        gt1000_set_device_id(strtol(device_id, NULL, 0));
+    } else {
+        // Talking to a device (or simulator) on the pseudo-terminal
+        sysex_identity_reply ir;
+        if (!sysex_device_inquiry(&ir, pdMS_TO_TICKS(5000), 5)) {
+            return;
+        }
+        gt1000_set_device_id(ir.dev_id);
+        gt1000_enable_notifications();
+    }
+
+    sysex_start_parsing();
+
+    int64_t start = esp_timer_get_time();
+    while (!stream_closed) {
+        vTaskDelay(pdMS_TO_TICKS(HOST_REPORT_INTERVAL_MS));
+        report(start, false);
+    }
+
+    // Let the handler drain what the parser already queued
+    vTaskDelay(pdMS_TO_TICKS(100));
+    report(start, true);
+    exit(0);
+}
@@ -0,0 +1,313 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [host_sim.c] - Simulated GT-1000 MIDI transport for the linux target
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sysex.h"
+#include "host_sim.h"
+
+#define SIM_TASK_STACK_SIZE             4096
+#define SIM_TASK_PRIORITY               10
+#define SIM_QUEUE_LENGTH                32
+
+#define SIM_RQ1_LENGTH                  18
+// Header, address, checksum and EOX around the data of a DT1
+#define SIM_DT1_ENVELOPE_LENGTH         14
+// Memory is kept in pages of linear bytes, found by open addressing
+#define SIM_PAGE_SIZE                   128
+#define SIM_PAGE_SLOTS                  65536
+// Flips a 7-bit value into another one
+#define SIM_ERASE_MASK                  0x40
+// Time the device takes before a reply starts
+#define SIM_REPLY_DELAY_US              4000
+// Start, 8 data and stop bits at 31250 baud
+#define SIM_BYTE_TIME_US                320
+
+#define TAG "SIM"
+
+typedef struct {
+    uint32_t address;
+    uint32_t size;              // Bytes
+    int64_t ready_at;           // When the reply may start on the wire
+} sim_request_t;
+
+typedef struct {
+    uint32_t index;             // Linear address / SIM_PAGE_SIZE
+    uint8_t data[SIM_PAGE_SIZE];
+    // What replies carried last, for comparing a restore with the dump
+    uint8_t sent[SIM_PAGE_SIZE];
+    uint8_t sent_bits[SIM_PAGE_SIZE / 8];
+} sim_page_t;
+
+static const uint8_t rq1_header[] = { 0xF0, 0x41, HOST_SIM_DEVICE_ID, 0x00, 0x00, 0x00, 0x4F, 0x11 };
+static const uint8_t dt1_header[] = { 0xF0, 0x41, HOST_SIM_DEVICE_ID, 0x00, 0x00, 0x00, 0x4F, 0x12 };
+
+static QueueHandle_t request_queue;
+static TaskHandle_t sim_task;
+static int64_t rx_free_at;
+
+static midi_transport_receive_cb_t on_receive;
+static midi_transport_event_cb_t on_event;
+
+static sim_page_t *pages[SIM_PAGE_SLOTS];
+static SemaphoreHandle_t memory_mutex;
+
+// Returns the page holding linear, created on first use. Unwritten memory
+// holds a pattern any reply can be checked against. Called with memory_mutex held.
+static sim_page_t *get_page(uint32_t linear)
+{
+    uint32_t index = linear / SIM_PAGE_SIZE;
+    for (uint32_t i = 0; i < SIM_PAGE_SLOTS; ++i) {
+        uint32_t slot = (index + i) % SIM_PAGE_SLOTS;
+        if (pages[slot] && pages[slot]->index == index) {
+            return pages[slot];
+        }
+        if (!pages[slot]) {
+            sim_page_t *page = calloc(1, sizeof(sim_page_t));
+            if (!page) {
+                break;
+            }
+            page->index = index;
+            for (int j = 0; j < SIM_PAGE_SIZE; ++j) {
+                page->data[j] = (index * SIM_PAGE_SIZE + j) & 0x7F;
+            }
+            pages[slot] = page;
+            return page;
+        }
+    }
+    ESP_LOGE(TAG, "No memory for address 0x%08lx", (unsigned long)sysex_linear_to_address(linear));
+    abort();
+}
+
+static void read_memory(uint32_t linear, uint8_t *data, int length)
+{
+    xSemaphoreTake(memory_mutex, portMAX_DELAY);
+    for (int i = 0; i < length; ++i) {
+        sim_page_t *page = get_page(linear + i);
+        int offset = (linear + i) % SIM_PAGE_SIZE;
+        data[i] = page->data[offset];
+        page->sent[offset] = data[i];
+        page->sent_bits[offset / 8] |= 1 << (offset % 8);
+    }
+    xSemaphoreGive(memory_mutex);
+}
+
+static void write_memory(uint32_t linear, const uint8_t *data, int length)
+{
+    xSemaphoreTake(memory_mutex, portMAX_DELAY);
+    for (int i = 0; i < length; ++i) {
+        get_page(linear + i)->data[(linear + i) % SIM_PAGE_SIZE] = data[i];
+    }
+    xSemaphoreGive(memory_mutex);
+}
+
+static void wait_until(int64_t deadline)
+{
+    int64_t wait_us = deadline - esp_timer_get_time();
+    if (wait_us > 0) {
+        TickType_t ticks = pdMS_TO_TICKS((wait_us + 999) / 1000);
+        vTaskDelay(ticks > 0 ? ticks : 1);
+    }
+}
+
+// Sends one DT1 once its last byte would have arrived on the wire
+static void send_dt1(uint32_t address, int length)
+{
+    uint8_t message[8 + 4 + SYSEX_REPLY_SPLIT_SIZE + 2] = {
+        0xF0, 0x41, HOST_SIM_DEVICE_ID, 0x00, 0x00, 0x00, 0x4F, 0x12,
+    };
+    int pos = 8;
+    for (int i = 0; i < 4; ++i) {
+        message[pos++] = (address >> (24 - 8 * i)) & 0x7F;
+    }
+    read_memory(sysex_address_to_linear(address), message + pos, length);
+    pos += length;
+    uint8_t sum = 0;
+    for (int i = 8; i < pos; ++i) {
+        sum += message[i];
+    }
+    message[pos++] = -sum & 0x7F;
+    message[pos++] = 0xF7;
+
+    rx_free_at += (int64_t)pos * SIM_BYTE_TIME_US;
+    wait_until(rx_free_at);
+
+    for (int offset = 0; offset < pos; offset += MIDI_TRANSPORT_MAX_CHUNK_SIZE) {
+        int chunk = pos - offset < MIDI_TRANSPORT_MAX_CHUNK_SIZE ? pos - offset : MIDI_TRANSPORT_MAX_CHUNK_SIZE;
+        on_receive(message + offset, chunk);
+    }
+}
+
+static void sim_device_task(void *pvParameter)
+{
+    sim_request_t request;
+    for (;;) {
+        if (!xQueueReceive(request_queue, &request, portMAX_DELAY)) {
+            continue;
+        }
+
+        // Replies share the device's TX line one after another
+        if (rx_free_at < request.ready_at) {
+            rx_free_at = request.ready_at;
+        }
+        uint32_t linear = sysex_address_to_linear(request.address);
+        uint32_t remaining = request.size;
+        while (remaining > 0) {
+            int length = remaining < SYSEX_REPLY_SPLIT_SIZE ? remaining : SYSEX_REPLY_SPLIT_SIZE;
+            send_dt1(sysex_linear_to_address(linear), length);
+            linear += length;
+            remaining -= length;
+        }
+    }
+}
+
+// Stores the data of a DT1 with a good checksum
+static void handle_dt1(const uint8_t *data, int len)
+{
+    uint8_t sum = 0;
+    for (int i = sizeof(dt1_header); i < len - 1; ++i) {
+        sum += data[i];
+    }
+    if (sum & 0x7F || data[len - 1] != 0xF7) {
+        ESP_LOGW(TAG, "Damaged DT1 ignored");
+        return;
+    }
+
+    uint32_t address = 0;
+    for (int i = 0; i < 4; ++i) {
+        address = (address << 8) | data[8 + i];
+    }
+    write_memory(sysex_address_to_linear(address), data + 12, len - SIM_DT1_ENVELOPE_LENGTH);
+}
+
+static int sim_send(const uint8_t *data, int len)
+{
+    if (len > SIM_DT1_ENVELOPE_LENGTH && memcmp(data, dt1_header, sizeof(dt1_header)) == 0) {
+        handle_dt1(data, len);
+        return len;
+    }
+    if (len != SIM_RQ1_LENGTH || memcmp(data, rq1_header, sizeof(rq1_header)) != 0) {
+        // Only data requests get an answer
+        return len;
+    }
+
+    uint32_t address = 0;
+    uint32_t size = 0;
+    for (int i = 0; i < 4; ++i) {
+        address = (address << 8) | data[8 + i];
+        size = (size << 8) | data[12 + i];
+    }
+
+    sim_request_t request = {
+        .address = address,
+        .size = sysex_address_to_linear(size),
+        // The request is on the wire from now on
+        .ready_at = esp_timer_get_time() + (int64_t)len * SIM_BYTE_TIME_US + SIM_REPLY_DELAY_US,
+    };
+    if (!xQueueSend(request_queue, &request, 0)) {
+        ESP_LOGW(TAG, "Request queue full, RQ1 0x%08lx ignored", (unsigned long)address);
+    }
+    return len;
+}
+
+static bool sim_open(midi_transport_receive_cb_t receive_cbk, midi_transport_event_cb_t event_cbk)
+{
+    on_receive = receive_cbk;
+    on_event = event_cbk;
+
+    memory_mutex = xSemaphoreCreateMutex();
+    if (!memory_mutex) {
+        ESP_LOGE(TAG, "Failed to create memory mutex.");
+        return false;
+    }
+
+    request_queue = xQueueCreate(SIM_QUEUE_LENGTH, sizeof(sim_request_t));
+    if (!request_queue) {
+        ESP_LOGE(TAG, "Failed to create request queue.");
+        return false;
+    }
+
+    xTaskCreate(sim_device_task,
+                "sim_device",
+                SIM_TASK_STACK_SIZE,
+                NULL,
+                SIM_TASK_PRIORITY,
+                &sim_task);
+    return true;
+}
+
+static void sim_close(void)
+{
+    if (sim_task != NULL) {
+        vTaskDelete(sim_task);
+        sim_task = NULL;
+    }
+    if (request_queue) {
+        vQueueDelete(request_queue);
+        request_queue = NULL;
+    }
+}
+
+static const midi_transport_t sim_transport = {
+    .name = "simulated device",
+    .open = sim_open,
+    .close = sim_close,
+    .send = sim_send,
+};
+
+const midi_transport_t *host_sim_get_transport(void)
+{
+    return &sim_transport;
+}
+
+void host_sim_reset_memory(void)
+{
+    xSemaphoreTake(memory_mutex, portMAX_DELAY);
+    for (int slot = 0; slot < SIM_PAGE_SLOTS; ++slot) {
+        free(pages[slot]);
+        pages[slot] = NULL;
+    }
+    xSemaphoreGive(memory_mutex);
+}
+
+void host_sim_erase_sent(void)
+{
+    xSemaphoreTake(memory_mutex, portMAX_DELAY);
+    for (int slot = 0; slot < SIM_PAGE_SLOTS; ++slot) {
+        sim_page_t *page = pages[slot];
+        for (int i = 0; page && i < SIM_PAGE_SIZE; ++i) {
+            if (page->sent_bits[i / 8] & (1 << (i % 8))) {
+                page->data[i] = page->sent[i] ^ SIM_ERASE_MASK;
+            }
+        }
+    }
+    xSemaphoreGive(memory_mutex);
+}
+
+uint32_t host_sim_compare_sent(uint32_t *compared)
+{
+    uint32_t differing = 0;
+    *compared = 0;
+    xSemaphoreTake(memory_mutex, portMAX_DELAY);
+    for (int slot = 0; slot < SIM_PAGE_SLOTS; ++slot) {
+        sim_page_t *page = pages[slot];
+        for (int i = 0; page && i < SIM_PAGE_SIZE; ++i) {
+            if (page->sent_bits[i / 8] & (1 << (i % 8))) {
+                ++*compared;
+                differing += page->data[i] != page->sent[i];
+            }
+        }
+    }
+    xSemaphoreGive(memory_mutex);
+    return differing;
+}
@@ -0,0 +1,19 @@
+#ifndef _HOST_SIM_H
+#define _HOST_SIM_H
+
+#include "midi_transport.h"
+
+#define HOST_SIM_DEVICE_ID              0x10
+
+// A GT-1000 stand-in that answers RQ1 with DT1 at MIDI wire speed. DT1s it
+// receives are written to its memory.
+const midi_transport_t *host_sim_get_transport(void);
+// Drops everything written and read, memory holds its pattern again
+void host_sim_reset_memory(void);
+// Changes every byte that replies carried, as if the device lost the data
+void host_sim_erase_sent(void);
+// Compares every byte that replies carried with the memory now. Returns the
+// bytes that differ, compared is set to the bytes checked.
+uint32_t host_sim_compare_sent(uint32_t *compared);
+
+#endif
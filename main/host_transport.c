@@ -0,0 +1,169 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [host_transport.c] - Pseudo-terminal / byte stream file MIDI transport for the linux target
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "host_transport.h"
+
+#define HOST_TASK_STACK_SIZE            4096
+#define HOST_TASK_PRIORITY              10
+
+#define TAG "HOST"
+
+static int rx_fd = -1;
+static int tx_fd = -1;
+static bool is_replay = false;
+
+static TaskHandle_t host_task;
+
+static midi_transport_receive_cb_t on_receive;
+static midi_transport_event_cb_t on_event;
+
+static void host_receive_task(void *pvParameter)
+{
+    uint8_t chunk[MIDI_TRANSPORT_MAX_CHUNK_SIZE];
+    for (;;) {
+        // A replayed file runs as fast as the pipeline drains it, but never
+        // faster, so throughput measurements are not skewed by dropped chunks.
+        if (is_replay && !midi_transport_can_accept(sizeof(chunk))) {
+            vTaskDelay(1);
+            continue;
+        }
+
+        ssize_t len = read(rx_fd, chunk, sizeof(chunk));
+        if (len > 0) {
+            on_receive(chunk, len);
+            continue;
+        }
+
+        if (len == 0 && is_replay) {
+            ESP_LOGI(TAG, "End of replay stream");
+            on_event(MIDI_TRANSPORT_EVENT_CLOSED);
+            host_task = NULL;
+            vTaskDelete(NULL);
+        }
+
+        // Nothing to read yet (or PTY peer not attached).
+        vTaskDelay(1);
+    }
+}
+
+static bool open_pty(void)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        ESP_LOGE(TAG, "Failed to create pseudo-terminal: %d", errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    rx_fd = fd;
+    tx_fd = fd;
+    ESP_LOGI(TAG, "MIDI pseudo-terminal: %s", ptsname(fd));
+    return true;
+}
+
+static bool open_replay(const char *rx_path)
+{
+    rx_fd = open(rx_path, O_RDONLY);
+    if (rx_fd < 0) {
+        ESP_LOGE(TAG, "Failed to open %s: %d", rx_path, errno);
+        return false;
+    }
+
+    const char *tx_path = getenv(HOST_TRANSPORT_TX_ENV);
+    if (tx_path) {
+        tx_fd = open(tx_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (tx_fd < 0) {
+            ESP_LOGW(TAG, "Failed to open %s: %d. Sent bytes are discarded.", tx_path, errno);
+        }
+    }
+
+    is_replay = true;
+    ESP_LOGI(TAG, "Replaying %s", rx_path);
+    return true;
+}
+
+static bool host_open(midi_transport_receive_cb_t receive_cbk, midi_transport_event_cb_t event_cbk)
+{
+    on_receive = receive_cbk;
+    on_event = event_cbk;
+
+    const char *rx_path = getenv(HOST_TRANSPORT_RX_ENV);
+    if (!(rx_path ? open_replay(rx_path) : open_pty())) {
+        return false;
+    }
+
+    xTaskCreate(host_receive_task,
+                "host_recv",
+                HOST_TASK_STACK_SIZE,
+                NULL,
+                HOST_TASK_PRIORITY,
+                &host_task);
+    return true;
+}
+
+static void host_close(void)
+{
+    if (host_task != NULL) {
+        vTaskDelete(host_task);
+        host_task = NULL;
+    }
+
+    if (tx_fd >= 0 && tx_fd != rx_fd) {
+        close(tx_fd);
+    }
+    if (rx_fd >= 0) {
+        close(rx_fd);
+    }
+    rx_fd = -1;
+    tx_fd = -1;
+    is_replay = false;
+}
+
+static int host_send(const uint8_t *data, int len)
+{
+    if (tx_fd < 0) {
+        // Replay without a TX sink
+        return len;
+    }
+
+    int written = 0;
+    while (written < len) {
+        ssize_t res = write(tx_fd, data + written, len - written);
+        if (res < 0) {
+            if (errno == EAGAIN) {
+                vTaskDelay(1);
+                continue;
+            }
+            return -1;
+        }
+        written += res;
+    }
+    return written;
+}
+
+static const midi_transport_t host_transport = {
+    .name = "host",
+    .open = host_open,
+    .close = host_close,
+    .send = host_send,
+};
+
+const midi_transport_t *host_get_transport(void)
+{
+    return &host_transport;
+}
@@ -0,0 +1,12 @@
+#ifndef _HOST_TRANSPORT_H
+#define _HOST_TRANSPORT_H
+
+#include "midi_transport.h"
+
+// Environment variables read when the transport is opened
+#define HOST_TRANSPORT_RX_ENV           "GT1000_MIDI_RX"     // Byte stream file to replay, PTY when unset
+#define HOST_TRANSPORT_TX_ENV           "GT1000_MIDI_TX"     // File receiving sent bytes in replay mode
+
+const midi_transport_t *host_get_transport(void);
+
+#endif
@@ -0,0 +1,512 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [librarian.c] - Flash-backed dump and restore of the GT-1000 user patches
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include "librarian.h"
+#include "gt1000.h"
+#include "sysex.h"
+#include "midi_tx.h"
+
+#define LIBRARIAN_PARTITION_LABEL       "librarian"
+#define LIBRARIAN_TASK_STACK_SIZE       3072
+#define LIBRARIAN_TASK_PRIORITY         1
+
+#define LIBRARIAN_HEADER_MAGIC          0x4C494231  // "LIB1"
+#define LIBRARIAN_RECORD_MAGIC          0x50415431  // "PAT1"
+#define LIBRARIAN_VERSION               1
+
+// Three slots to an erase sector and none across a boundary, so an interrupted
+// dump resumes at the start of a sector without touching finished ones
+#define LIBRARIAN_SECTOR_SIZE           4096
+#define LIBRARIAN_SLOTS_PER_SECTOR      3
+#define LIBRARIAN_SLOT_SIZE             ((LIBRARIAN_SECTOR_SIZE / LIBRARIAN_SLOTS_PER_SECTOR) & ~3)
+
+// User patch n is laid out like the temporary patch, n patch strides after U001
+#define USER_PATCH_ADDRESS              0x20000000
+#define USER_PATCH_STRIDE               0x00010000
+#define PATCH_NAME_OFFSET               0x00000000
+#define PATCH_NAME_SIZE                 16
+#define PATCH_EFFECT_OFFSET             0x00001200
+
+// RQ1s in flight during a dump, leaving request slots to the mirror
+#define DUMP_WINDOW                     8
+#define DUMP_MAX_RETRIES                8
+#define DUMP_WAIT_MS                    100
+// Restore DT1s wait while the bulk lane has fewer free slots
+#define RESTORE_MIN_FREE_SLOTS          4
+#define RESTORE_FLOW_WAIT_MS            5
+
+// The name and every effect block with parameters
+#define MAX_DUMP_ITEMS                  (1 + GT1000_EFFECT_BLOCK_COUNT)
+
+#define TAG "LIBRARIAN"
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation;        // Advances with every dump started over
+    uint32_t patch_count;       // Patches the dump covers
+    uint32_t slot_size;
+} librarian_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t generation;
+    uint16_t patch;
+    uint16_t size;              // Bytes of block data
+    uint32_t crc;               // Of the name and the block data
+    char name[PATCH_NAME_SIZE];
+    uint8_t data[];             // Extents of the effect blocks, in block order
+} librarian_record_t;
+
+typedef enum {
+    ITEM_PENDING,
+    ITEM_INFLIGHT,
+    ITEM_DONE,
+} item_state_t;
+
+typedef struct {
+    uint32_t offset;            // From the start of the patch
+    uint16_t size;
+    uint16_t record_offset;     // In the record
+} dump_item_t;
+
+typedef struct {
+    librarian_state_t request;  // Set by the API, taken by the task
+    int count;
+    int first;
+    bool resume;
+    // The patch in flight, written by reply callbacks
+    int patch;
+    item_state_t items[MAX_DUMP_ITEMS];
+    int inflight;
+    librarian_stats_t stats;
+} librarian_t;
+
+static const esp_partition_t *partition;
+static const uint8_t *partition_map;
+static esp_partition_mmap_handle_t partition_map_handle;
+static TaskHandle_t librarian_task;
+
+static librarian_t librarian;
+static portMUX_TYPE librarian_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static dump_item_t dump_items[MAX_DUMP_ITEMS];
+static int dump_item_count;
+// Offset of each effect block's data in a record, 0xFFFF if it has none
+static uint16_t block_offsets[GT1000_EFFECT_BLOCK_COUNT];
+static uint32_t data_size;
+// Built for one patch, then written to its slot
+static uint8_t staging[LIBRARIAN_SLOT_SIZE];
+
+static inline uint32_t record_size(void) {
+    return sizeof(librarian_record_t) + data_size;
+}
+
+static inline uint32_t slot_offset(int patch) {
+    // The header has the first sector to itself
+    return LIBRARIAN_SECTOR_SIZE * (1 + patch / LIBRARIAN_SLOTS_PER_SECTOR) +
+           LIBRARIAN_SLOT_SIZE * (patch % LIBRARIAN_SLOTS_PER_SECTOR);
+}
+
+static inline uint32_t patch_address(int patch, uint32_t offset) {
+    uint32_t base = sysex_address_to_linear(USER_PATCH_ADDRESS) +
+                    patch * sysex_address_to_linear(USER_PATCH_STRIDE);
+    return sysex_linear_to_address(base + sysex_address_to_linear(offset));
+}
+
+static const librarian_header_t *mapped_header(void) {
+    const librarian_header_t *header = (const librarian_header_t *)partition_map;
+    bool valid = header->magic == LIBRARIAN_HEADER_MAGIC && header->version == LIBRARIAN_VERSION &&
+                 header->slot_size == LIBRARIAN_SLOT_SIZE;
+    return valid ? header : NULL;
+}
+
+// The stored record of the patch, or NULL if it is missing or damaged
+static const librarian_record_t *mapped_record(int patch) {
+    const librarian_header_t *header = mapped_header();
+    if (!header || patch < 0 || patch >= header->patch_count || slot_offset(patch) + record_size() > partition->size) {
+        return NULL;
+    }
+    const librarian_record_t *record = (const librarian_record_t *)(partition_map + slot_offset(patch));
+    if (record->magic != LIBRARIAN_RECORD_MAGIC || record->generation != header->generation ||
+        record->patch != patch || record->size != data_size) {
+        return NULL;
+    }
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)record->name, PATCH_NAME_SIZE + data_size);
+    return crc == record->crc ? record : NULL;
+}
+
+static void handle_dump_reply(const sysex_request_result_t *result, void *arg) {
+    int patch = (uintptr_t)arg / MAX_DUMP_ITEMS;
+    int item = (uintptr_t)arg % MAX_DUMP_ITEMS;
+    const dump_item_t *dump_item = &dump_items[item];
+
+    // A reply split by the device only hands over its last part
+    bool complete = false;
+    if (result->status == SYSEX_REQUEST_COMPLETED && result->reply &&
+        result->reply_length == dump_item->size + 14) {
+        const uint8_t *reply = result->reply;
+        uint32_t address = (uint32_t)reply[8] << 24 | reply[9] << 16 | reply[10] << 8 | reply[11];
+        complete = address == patch_address(patch, dump_item->offset);
+    }
+
+    portENTER_CRITICAL(&librarian_lock);
+    if (patch == librarian.patch && librarian.items[item] == ITEM_INFLIGHT) {
+        --librarian.inflight;
+        if (complete) {
+            memcpy(staging + dump_item->record_offset, result->reply + 12, dump_item->size);
+            librarian.items[item] = ITEM_DONE;
+        } else {
+            librarian.items[item] = ITEM_PENDING;
+            ++librarian.stats.failed_requests;
+        }
+    }
+    portEXIT_CRITICAL(&librarian_lock);
+
+    xTaskNotifyGive(librarian_task);
+}
+
+// Fetches one patch into the staging record, DUMP_WINDOW RQ1s at a time
+static bool fetch_patch(int patch, uint32_t generation) {
+    portENTER_CRITICAL(&librarian_lock);
+    librarian.patch = patch;
+    librarian.inflight = 0;
+    for (int i = 0; i < dump_item_count; ++i) {
+        librarian.items[i] = ITEM_PENDING;
+    }
+    uint32_t failed_before = librarian.stats.failed_requests;
+    portEXIT_CRITICAL(&librarian_lock);
+
+    for (;;) {
+        int done = 0;
+        int send[DUMP_WINDOW];
+        int send_count = 0;
+        portENTER_CRITICAL(&librarian_lock);
+        bool gave_up = librarian.stats.failed_requests - failed_before > DUMP_MAX_RETRIES;
+        for (int i = 0; i < dump_item_count; ++i) {
+            if (librarian.items[i] == ITEM_DONE) {
+                ++done;
+            } else if (librarian.items[i] == ITEM_PENDING && !gave_up &&
+                       librarian.inflight + send_count < DUMP_WINDOW) {
+                librarian.items[i] = ITEM_INFLIGHT;
+                send[send_count++] = i;
+            }
+        }
+        librarian.inflight += send_count;
+        int inflight = librarian.inflight;
+        portEXIT_CRITICAL(&librarian_lock);
+
+        if (done == dump_item_count) {
+            break;
+        }
+        if (gave_up && inflight == 0) {
+            ESP_LOGW(TAG, "Patch %d could not be read", patch + 1);
+            return false;
+        }
+
+        for (int i = 0; i < send_count; ++i) {
+            const dump_item_t *item = &dump_items[send[i]];
+            void *arg = (void *)(uintptr_t)(patch * MAX_DUMP_ITEMS + send[i]);
+            if (gt1000_read_range(patch_address(patch, item->offset), item->size, handle_dump_reply, arg) < 0) {
+                portENTER_CRITICAL(&librarian_lock);
+                librarian.items[send[i]] = ITEM_PENDING;
+                --librarian.inflight;
+                ++librarian.stats.failed_requests;
+                portEXIT_CRITICAL(&librarian_lock);
+            }
+        }
+        // Replies and timeouts wake the task
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DUMP_WAIT_MS));
+    }
+
+    librarian_record_t *record = (librarian_record_t *)staging;
+    record->magic = LIBRARIAN_RECORD_MAGIC;
+    record->generation = generation;
+    record->patch = patch;
+    record->size = data_size;
+    record->crc = esp_rom_crc32_le(0, (const uint8_t *)record->name, PATCH_NAME_SIZE + data_size);
+    return true;
+}
+
+static bool write_header(uint32_t generation, int count) {
+    librarian_header_t header = {
+        .magic = LIBRARIAN_HEADER_MAGIC,
+        .version = LIBRARIAN_VERSION,
+        .generation = generation,
+        .patch_count = count,
+        .slot_size = LIBRARIAN_SLOT_SIZE,
+    };
+    return esp_partition_erase_range(partition, 0, LIBRARIAN_SECTOR_SIZE) == ESP_OK &&
+           esp_partition_write(partition, 0, &header, sizeof(header)) == ESP_OK;
+}
+
+static void run_dump(int count, bool resume) {
+    const librarian_header_t *header = mapped_header();
+    uint32_t generation = header ? header->generation : 0;
+    int first = 0;
+    if (resume && header && header->patch_count == count) {
+        while (first < count && mapped_record(first)) {
+            ++first;
+        }
+        // The rest of the sector may hold part of a record
+        first -= first % LIBRARIAN_SLOTS_PER_SECTOR;
+    } else if (!write_header(++generation, count)) {
+        ESP_LOGE(TAG, "Failed to write the header.");
+        return;
+    }
+    ESP_LOGI(TAG, "Dumping patches %d-%d", first + 1, count);
+
+    int64_t started_at = esp_timer_get_time();
+    int dumped = 0;
+    for (int patch = first; patch < count; ++patch) {
+        portENTER_CRITICAL(&librarian_lock);
+        librarian.stats.patch = patch;
+        portEXIT_CRITICAL(&librarian_lock);
+
+        if (!fetch_patch(patch, generation)) {
+            break;
+        }
+        uint32_t offset = slot_offset(patch);
+        if (patch % LIBRARIAN_SLOTS_PER_SECTOR == 0 &&
+            esp_partition_erase_range(partition, offset, LIBRARIAN_SECTOR_SIZE) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase the slot of patch %d.", patch + 1);
+            break;
+        }
+        if (esp_partition_write(partition, offset, staging, record_size()) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write patch %d.", patch + 1);
+            break;
+        }
+        ++dumped;
+    }
+
+    uint32_t stored = 0;
+    for (int patch = 0; patch < count; ++patch) {
+        stored += mapped_record(patch) != NULL;
+    }
+    uint32_t elapsed = esp_timer_get_time() - started_at;
+    portENTER_CRITICAL(&librarian_lock);
+    librarian.stats.dumped = dumped;
+    librarian.stats.dump_time_us = elapsed;
+    librarian.stats.patches_stored = stored;
+    portEXIT_CRITICAL(&librarian_lock);
+    ESP_LOGI(TAG, "Dumped %d patches in %lu ms, %lu of %d stored",
+             dumped, (unsigned long)(elapsed / 1000), (unsigned long)stored, count);
+}
+
+// Waits for room in the bulk lane, so DT1s never overrun the TX queue.
+// Returns false if the DT1 was not queued.
+static bool write_with_flow_control(uint32_t dev_addr, const uint8_t *data, int length) {
+    while (midi_tx_get_free_slots(MIDI_TX_LANE_BULK) < RESTORE_MIN_FREE_SLOTS) {
+        portENTER_CRITICAL(&librarian_lock);
+        ++librarian.stats.flow_waits;
+        portEXIT_CRITICAL(&librarian_lock);
+        vTaskDelay(pdMS_TO_TICKS(RESTORE_FLOW_WAIT_MS));
+    }
+    if (gt1000_write_range(dev_addr, data, length) < 0) {
+        portENTER_CRITICAL(&librarian_lock);
+        ++librarian.stats.failed_writes;
+        portEXIT_CRITICAL(&librarian_lock);
+        return false;
+    }
+    return true;
+}
+
+static void run_restore(int first, int count) {
+    int64_t started_at = esp_timer_get_time();
+    int restored = 0;
+    for (int patch = first; patch < first + count; ++patch) {
+        const librarian_record_t *record = mapped_record(patch);
+        if (!record) {
+            ESP_LOGW(TAG, "Patch %d is not stored", patch + 1);
+            continue;
+        }
+        portENTER_CRITICAL(&librarian_lock);
+        librarian.stats.patch = patch;
+        portEXIT_CRITICAL(&librarian_lock);
+
+        // Straight from the mapped partition
+        bool written = true;
+        for (int i = 0; i < dump_item_count; ++i) {
+            const dump_item_t *item = &dump_items[i];
+            written &= write_with_flow_control(patch_address(patch, item->offset),
+                                               (const uint8_t *)record + item->record_offset, item->size);
+        }
+        if (!written) {
+            ESP_LOGW(TAG, "Patch %d is not fully restored", patch + 1);
+            continue;
+        }
+        ++restored;
+    }
+
+    uint32_t elapsed = esp_timer_get_time() - started_at;
+    portENTER_CRITICAL(&librarian_lock);
+    librarian.stats.restored = restored;
+    librarian.stats.restore_time_us = elapsed;
+    portEXIT_CRITICAL(&librarian_lock);
+    ESP_LOGI(TAG, "Restored %d patches in %lu ms", restored, (unsigned long)(elapsed / 1000));
+}
+
+static void librarian_task_fn(void *pvParameter)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        portENTER_CRITICAL(&librarian_lock);
+        librarian_state_t request = librarian.request;
+        int first = librarian.first;
+        int count = librarian.count;
+        bool resume = librarian.resume;
+        portEXIT_CRITICAL(&librarian_lock);
+
+        if (request == LIBRARIAN_DUMPING) {
+            run_dump(count, resume);
+        } else if (request == LIBRARIAN_RESTORING) {
+            run_restore(first, count);
+        }
+
+        portENTER_CRITICAL(&librarian_lock);
+        librarian.request = LIBRARIAN_IDLE;
+        librarian.stats.state = LIBRARIAN_IDLE;
+        portEXIT_CRITICAL(&librarian_lock);
+    }
+}
+
+// Lays out a record: the name, then the extent of every effect block
+static void init_layout(void) {
+    gt1000_t *device = gt1000_get_device();
+    dump_items[0] = (dump_item_t) {
+        .offset = PATCH_NAME_OFFSET,
+        .size = PATCH_NAME_SIZE,
+        .record_offset = offsetof(librarian_record_t, name),
+    };
+    dump_item_count = 1;
+    data_size = 0;
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        size_t extent = gt1000_get_block_extent((uint8_t *)&device->effect + block * EFFECT_BLOCK_SIZE);
+        block_offsets[block] = extent ? sizeof(librarian_record_t) + data_size : 0xFFFF;
+        if (extent == 0) {
+            continue;
+        }
+        dump_items[dump_item_count++] = (dump_item_t) {
+            .offset = sysex_linear_to_address(sysex_address_to_linear(PATCH_EFFECT_OFFSET) +
+                                              block * sysex_address_to_linear(EFFECT_BLOCK_SIZE)),
+            .size = extent,
+            .record_offset = block_offsets[block],
+        };
+        data_size += extent;
+    }
+}
+
+bool librarian_init(void) {
+    init_layout();
+    if (record_size() > LIBRARIAN_SLOT_SIZE) {
+        ESP_LOGE(TAG, "A patch needs %lu bytes, more than a slot.", (unsigned long)record_size());
+        return false;
+    }
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                         LIBRARIAN_PARTITION_LABEL);
+    if (!partition) {
+        ESP_LOGW(TAG, "No \"%s\" partition, librarian disabled.", LIBRARIAN_PARTITION_LABEL);
+        return false;
+    }
+    if (slot_offset(LIBRARIAN_PATCH_COUNT - 1) + LIBRARIAN_SLOT_SIZE > partition->size) {
+        ESP_LOGE(TAG, "Partition too small for %d patches.", LIBRARIAN_PATCH_COUNT);
+        return false;
+    }
+    const void *map;
+    if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA,
+                           &map, &partition_map_handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map the partition.");
+        return false;
+    }
+    partition_map = map;
+
+    if (xTaskCreate(librarian_task_fn,
+                    "librarian",
+                    LIBRARIAN_TASK_STACK_SIZE,
+                    NULL,
+                    LIBRARIAN_TASK_PRIORITY,
+                    &librarian_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create librarian task.");
+        return false;
+    }
+
+    const librarian_header_t *header = mapped_header();
+    uint32_t stored = 0;
+    for (int patch = 0; header && patch < header->patch_count; ++patch) {
+        stored += mapped_record(patch) != NULL;
+    }
+    librarian.stats.patches_stored = stored;
+    librarian.stats.record_bytes = record_size();
+    librarian.stats.slot_bytes = LIBRARIAN_SLOT_SIZE;
+    ESP_LOGI(TAG, "%lu patches stored, %lu bytes each", (unsigned long)stored, (unsigned long)record_size());
+    return true;
+}
+
+static bool start(librarian_state_t request, int first, int count, bool resume) {
+    if (!librarian_task || count <= 0 || first < 0 || first + count > LIBRARIAN_PATCH_COUNT) {
+        return false;
+    }
+    portENTER_CRITICAL(&librarian_lock);
+    bool idle = librarian.request == LIBRARIAN_IDLE;
+    if (idle) {
+        librarian.request = request;
+        librarian.stats.state = request;
+        librarian.first = first;
+        librarian.count = count;
+        librarian.resume = resume;
+    }
+    portEXIT_CRITICAL(&librarian_lock);
+    if (idle) {
+        xTaskNotifyGive(librarian_task);
+    }
+    return idle;
+}
+
+bool librarian_start_dump(int count, bool resume) {
+    return start(LIBRARIAN_DUMPING, 0, count, resume);
+}
+
+bool librarian_start_restore(int first, int count) {
+    return start(LIBRARIAN_RESTORING, first, count, false);
+}
+
+void librarian_get_stats(librarian_stats_t *stats) {
+    portENTER_CRITICAL(&librarian_lock);
+    *stats = librarian.stats;
+    portEXIT_CRITICAL(&librarian_lock);
+}
+
+const char *librarian_get_patch_name(int patch) {
+    const librarian_record_t *record = partition_map ? mapped_record(patch) : NULL;
+    return record ? record->name : NULL;
+}
+
+bool librarian_read_parameter(int patch, gt1000_param_addr_t parameter, uint32_t *value) {
+    const librarian_record_t *record = partition_map ? mapped_record(patch) : NULL;
+    gt1000_param_t param;
+    if (!record || !gt1000_get_parameter_info(&param, parameter)) {
+        return false;
+    }
+    size_t offset = (uint8_t *)parameter - (uint8_t *)&gt1000_get_device()->effect;
+    uint16_t block_offset = block_offsets[offset / EFFECT_BLOCK_SIZE];
+    if (block_offset == 0xFFFF) {
+        return false;
+    }
+    *value = 0;
+    memcpy(value, (const uint8_t *)record + block_offset + offset % EFFECT_BLOCK_SIZE, param.size);
+    return true;
+}
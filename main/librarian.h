@@ -0,0 +1,45 @@
+#ifndef _LIBRARIAN_H
+#define _LIBRARIAN_H
+
+#include "freertos/FreeRTOS.h"
+#include "gt1000.h"
+
+// User patches U001-U250
+#define LIBRARIAN_PATCH_COUNT           250
+
+typedef enum {
+    LIBRARIAN_IDLE,
+    LIBRARIAN_DUMPING,
+    LIBRARIAN_RESTORING,
+} librarian_state_t;
+
+typedef struct {
+    librarian_state_t state;
+    int patch;                      // Being dumped or restored
+    uint32_t patches_stored;        // Valid in flash, of the last dump
+    uint32_t record_bytes;          // Per patch: header, name and block data
+    uint32_t slot_bytes;            // Flash per patch
+    uint32_t dumped;                // Patches of the last dump run
+    uint32_t dump_time_us;
+    uint32_t restored;              // Patches of the last restore, every DT1 queued
+    uint32_t restore_time_us;
+    uint32_t failed_requests;       // RQ1s retried during dumps
+    uint32_t flow_waits;            // Restore DT1s held back for a full TX queue
+    uint32_t failed_writes;         // Restore DT1s that could not be queued
+} librarian_stats_t;
+
+// Finds and maps the librarian partition. Returns false if there is none.
+bool librarian_init(void);
+// Dumps user patches 0..count-1 into flash. resume continues the previous
+// dump of the same count where it stopped, instead of starting over.
+bool librarian_start_dump(int count, bool resume);
+// Writes stored patches first..first+count-1 back to the device
+bool librarian_start_restore(int first, int count);
+void librarian_get_stats(librarian_stats_t *stats);
+// Reads straight from the mapped partition, nothing is copied into the mirror.
+// The name is not terminated.
+const char *librarian_get_patch_name(int patch);
+// parameter is the address of the parameter in the mirror
+bool librarian_read_parameter(int patch, gt1000_param_addr_t parameter, uint32_t *value);
+
+#endif
@@ -13,13 +13,34 @@
 #include "esp_log.h"
 
 #include "sysex.h"
+#include "midi_transport.h"
 #include "uart.h"
+#include "midi_tx.h"
 #include "gt1000.h"
 #include "gt1000_param.h"
 #include "display.h"
 #include "ui_controller.h"
 #include "button_controller.h"
 #include "led.h"
+#include "librarian.h"
+
+// 1: read, parse and apply DT1 in the UART receive task, without the parser
+//    and handler tasks or the queues between them
+// 0: uart_recv -> sysex_parser -> handle_message tasks
+#define MIDI_RX_RUN_TO_COMPLETION   0
+// Receive task stack in run-to-completion mode, it also runs the event callback
+#define MIDI_RX_INLINE_STACK_SIZE   4096
+// RQ1s in flight for a full snapshot of the effect blocks after every preset
+// change, 0 mirrors only what the UI requests
+#define SNAPSHOT_WINDOW             0
+// 1: fetch the button-mapped blocks first after every preset change, then the
+//    rest of the mirror in the background
+// 0: fetch only the mapped parameters
+#define MIRROR_PREFETCH             1
+// Share of the MIDI line the mirror may be polled with once notifications stop
+#define POLL_BANDWIDTH_PERCENT      20
+// RAM for the mirror of recently used patches, about 1.2 KB each, 0 disables
+#define PATCH_CACHE_BYTES           (8 * 1024)
 
 #define TAG "MAIN"
 
@@ -31,29 +52,80 @@ typedef struct {
 
 static gt1000_t *device;
 static button_mapping_t mapping;
+// Pressed before its block was valid, toggled once the block lands
+static gt1000_param_addr_t pending_toggle;
+static portMUX_TYPE toggle_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static void update_current() {
     gt1000_update_patch_name();
-    gt1000_update_parameter(mapping.btn1);
-    gt1000_update_parameter(mapping.btn2);
-    gt1000_update_parameter(mapping.btn3);
+
+#if !MIRROR_PREFETCH
+    // Mapped parameters in the same block share one request
+    const gt1000_param_addr_t parameters[] = { mapping.btn1, mapping.btn2, mapping.btn3 };
+    gt1000_sync_plan_t plan;
+    if (gt1000_plan_sync(parameters, sizeof(parameters) / sizeof(parameters[0]),
+                         GT1000_SYNC_MAX_RANGE_SIZE, &plan)) {
+        gt1000_sync(&plan);
+    }
+#endif
 }
 
 static void toggle_param(gt1000_param_addr_t parameter) {
     gt1000_param_t param;
-    gt1000_get_parameter_info(&param, parameter);
+    // A block that is not valid yet is fetched. Its value may be stale, so
+    // the write waits for RANGE_SYNCED.
+    if (!gt1000_read_parameter(&param, parameter)) {
+        portENTER_CRITICAL(&toggle_lock);
+        // A second press before the block lands cancels the first
+        pending_toggle = pending_toggle == parameter ? NULL : parameter;
+        portEXIT_CRITICAL(&toggle_lock);
+        return;
+    }
     gt1000_set_parameter(parameter, !(bool)param.value);
 }
 
-static void gt1000_event_callback(gt1000_event_t event)
+static void apply_pending_toggle(void) {
+    gt1000_param_addr_t parameter = pending_toggle;
+    if (!parameter || !gt1000_is_block_valid(parameter)) {
+        return;
+    }
+    portENTER_CRITICAL(&toggle_lock);
+    bool pending = pending_toggle == parameter;
+    if (pending) {
+        pending_toggle = NULL;
+    }
+    portEXIT_CRITICAL(&toggle_lock);
+    if (pending) {
+        toggle_param(parameter);
+    }
+}
+
+static void gt1000_event_callback(gt1000_event_t event, const gt1000_range_t *range)
 {
     switch (event) {
         case PRESET_CHANGE:
+            // A press meant for the previous patch
+            portENTER_CRITICAL(&toggle_lock);
+            pending_toggle = NULL;
+            portEXIT_CRITICAL(&toggle_lock);
             update_current();
             break;
         case PRESET_NAME_UPDATE:
             set_ui_preset_name(device->patch_name);
             break;
+        case PATCH_RESTORED:
+            // The cached name and LEDs show until the device's replies land
+            set_ui_preset_name(device->patch_name);
+            set_led(LED_1_GPIO, *(bool *)mapping.btn1);
+            set_led(LED_2_GPIO, *(bool *)mapping.btn2);
+            set_led(LED_3_GPIO, *(bool *)mapping.btn3);
+            break;
+        case SNAPSHOT_PROGRESS:
+            apply_pending_toggle();
+            break;
+        case RANGE_SYNCED:
+            apply_pending_toggle();
+            // fall through
         case PARAMETER_UPDATE:
             set_led(LED_1_GPIO, *(bool *)mapping.btn1);
             set_led(LED_2_GPIO, *(bool *)mapping.btn2);
@@ -77,6 +149,8 @@ static void button_event_callback(button_controller_event_t event) {
             toggle_param(mapping.btn3);
             break;
         case BUTTON_4_PRESSED:
+            // Back up the user patches, picking up an interrupted dump
+            librarian_start_dump(LIBRARIAN_PATCH_COUNT, true);
             break;
         default:
             break;
@@ -87,11 +161,24 @@ static void button_event_callback(button_controller_event_t event) {
 void app_main(void)
 {
 
+#if MIDI_RX_RUN_TO_COMPLETION
+    if (!gt1000_init_inline() || !sysex_init_inline()) {
+        return;
+    }
+    uart_set_task_stack_size(MIDI_RX_INLINE_STACK_SIZE);
+    if (!midi_transport_init(uart_get_transport())) {
+        return;
+    }
+#else
     QueueHandle_t gt1000_msg_queue = gt1000_init();
-    QueueHandle_t parser_queue = sysex_init();
-    uart_driver_init();    
-    uart_register_consumer(parser_queue);
+    MessageBufferHandle_t parser_buffer = sysex_init();
+    if (!midi_transport_init(uart_get_transport())) {
+        return;
+    }
+    midi_transport_register_consumer(parser_buffer);
     sysex_register_device_message_queue(gt1000_msg_queue);
+#endif
+    midi_tx_init();
     
     start_display();
     init_ui_controller();
@@ -116,6 +203,16 @@ void app_main(void)
     };
     
     gt1000_register_callback(gt1000_event_callback);
+    gt1000_set_snapshot_window(SNAPSHOT_WINDOW);
+    const gt1000_param_addr_t mapped[] = { mapping.btn1, mapping.btn2, mapping.btn3 };
+    gt1000_set_priority_parameters(mapped, sizeof(mapped) / sizeof(mapped[0]));
+    gt1000_set_prefetch(MIRROR_PREFETCH);
+    gt1000_set_patch_cache_budget(PATCH_CACHE_BYTES);
+    gt1000_poll_config_t poll_config;
+    gt1000_get_poll_config(&poll_config);
+    poll_config.bandwidth_percent = POLL_BANDWIDTH_PERCENT;
+    gt1000_set_poll_config(&poll_config);
+    librarian_init();
     button_register_callback(button_event_callback);
 
     sysex_start_parsing();
@@ -0,0 +1,244 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [midi_transport.c] - MIDI transport binding and chunked consumer fan-out
+ */
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/message_buffer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "midi_transport.h"
+
+#define MIDI_TRANSPORT_MAX_CONSUMERS        10
+#define MIDI_TRANSPORT_MAX_EVENT_CALLBACKS  4
+
+#define TAG "TRANSPORT"
+
+typedef struct {
+    MessageBufferHandle_t buffer;
+    size_t capacity;
+    midi_transport_consumer_stats_t stats;
+} consumer_t;
+
+static const midi_transport_t *active_transport;
+
+static consumer_t consumers[MIDI_TRANSPORT_MAX_CONSUMERS];
+static size_t consumer_count = 0;
+static SemaphoreHandle_t consumer_mutex;
+
+static midi_transport_event_cb_t event_callbacks[MIDI_TRANSPORT_MAX_EVENT_CALLBACKS];
+static midi_transport_chunk_cb_t receiver;
+
+
+static void dispatch_event(midi_transport_event_t event)
+{
+    for (int i = 0; i < MIDI_TRANSPORT_MAX_EVENT_CALLBACKS; ++i) {
+        if (event_callbacks[i]) {
+            event_callbacks[i](event);
+        }
+    }
+}
+
+static void dispatch_chunk(const uint8_t *chunk, int len)
+{
+    uint8_t record[MIDI_TRANSPORT_MAX_RECORD_SIZE];
+    midi_transport_chunk_header_t header = {
+        .received_at = esp_timer_get_time(),
+    };
+    if (receiver) {
+        receiver(chunk, len, header.received_at);
+    }
+    if (!consumer_count) {
+        return;
+    }
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), chunk, len);
+    size_t record_len = sizeof(header) + len;
+
+    bool dropped = false;
+    if (xSemaphoreTake(consumer_mutex, portMAX_DELAY)) {
+        for (int i = 0; i < MIDI_TRANSPORT_MAX_CONSUMERS; ++i) {
+            consumer_t *consumer = &consumers[i];
+            if (consumer->buffer == NULL) {
+                continue;
+            }
+
+            // Never block here: a slow consumer loses the chunk instead of
+            // stalling the receive task and overflowing the RX FIFO.
+            size_t sent = xMessageBufferSend(consumer->buffer, record, record_len, 0);
+            if (sent != record_len) {
+                ++consumer->stats.dropped_chunks;
+                consumer->stats.dropped_bytes += len;
+                ESP_LOGD(TAG, "Consumer %d buffer full. Chunk dropped.", i);
+                dropped = true;
+                continue;
+            }
+
+            ++consumer->stats.chunks;
+            consumer->stats.bytes += len;
+
+            size_t used = consumer->capacity - xMessageBufferSpacesAvailable(consumer->buffer);
+            if (used > consumer->stats.high_water) {
+                consumer->stats.high_water = used;
+            }
+        }
+        xSemaphoreGive(consumer_mutex);
+    }
+
+    if (dropped) {
+        dispatch_event(MIDI_TRANSPORT_EVENT_RX_DROPPED);
+    }
+}
+
+bool midi_transport_init(const midi_transport_t *transport)
+{
+    consumer_mutex = xSemaphoreCreateMutex();
+    if (!consumer_mutex) {
+        ESP_LOGE(TAG, "Failed to create consumer mutex.");
+        return false;
+    }
+
+    if (!transport->open(dispatch_chunk, dispatch_event)) {
+        ESP_LOGE(TAG, "Failed to open %s transport.", transport->name);
+        vSemaphoreDelete(consumer_mutex);
+        consumer_mutex = NULL;
+        return false;
+    }
+
+    active_transport = transport;
+    ESP_LOGI(TAG, "Using %s transport", transport->name);
+    return true;
+}
+
+int midi_transport_send(const uint8_t *data, int len)
+{
+    if (!active_transport) {
+        return -1;
+    }
+    return active_transport->send(data, len);
+}
+
+int midi_transport_register_consumer(MessageBufferHandle_t buffer)
+{
+    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
+    if (consumer_count >= MIDI_TRANSPORT_MAX_CONSUMERS) {
+        xSemaphoreGive(consumer_mutex);
+        return -1;
+    }
+
+    for (size_t i = 0; i < MIDI_TRANSPORT_MAX_CONSUMERS; ++i) {
+        if (!consumers[i].buffer) {
+            consumers[i] = (consumer_t) {
+                .buffer = buffer,
+                .capacity = xMessageBufferSpacesAvailable(buffer),
+            };
+            ++consumer_count;
+            xSemaphoreGive(consumer_mutex);
+            return i;
+        }
+    }
+    xSemaphoreGive(consumer_mutex);
+    return -1;
+}
+
+void midi_transport_deregister_consumer(int consumer_id)
+{
+    if (consumer_id < 0 || consumer_id >= MIDI_TRANSPORT_MAX_CONSUMERS) {
+        return;
+    }
+
+    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
+    if (consumers[consumer_id].buffer) {
+        consumers[consumer_id].buffer = NULL;
+        --consumer_count;
+    }
+    xSemaphoreGive(consumer_mutex);
+    return;
+}
+
+bool midi_transport_get_consumer_stats(int consumer_id, midi_transport_consumer_stats_t *stats)
+{
+    if (consumer_id < 0 || consumer_id >= MIDI_TRANSPORT_MAX_CONSUMERS) {
+        return false;
+    }
+
+    bool registered = false;
+    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
+    if (consumers[consumer_id].buffer) {
+        *stats = consumers[consumer_id].stats;
+        registered = true;
+    }
+    xSemaphoreGive(consumer_mutex);
+    return registered;
+}
+
+bool midi_transport_register_event_callback(midi_transport_event_cb_t cbk)
+{
+    for (int i = 0; i < MIDI_TRANSPORT_MAX_EVENT_CALLBACKS; ++i) {
+        if (!event_callbacks[i]) {
+            event_callbacks[i] = cbk;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool midi_transport_register_receiver(midi_transport_chunk_cb_t cbk)
+{
+    if (receiver) {
+        return false;
+    }
+    receiver = cbk;
+    return true;
+}
+
+// For backends that can pace their source (files, host pipes): true when every
+// consumer has room for a chunk of len bytes, so nothing would be dropped.
+bool midi_transport_can_accept(size_t len)
+{
+    bool can_accept = true;
+    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
+    for (int i = 0; i < MIDI_TRANSPORT_MAX_CONSUMERS; ++i) {
+        if (consumers[i].buffer &&
+            xMessageBufferSpacesAvailable(consumers[i].buffer) <
+                sizeof(midi_transport_chunk_header_t) + len + sizeof(size_t)) {
+            can_accept = false;
+            break;
+        }
+    }
+    xSemaphoreGive(consumer_mutex);
+    return can_accept;
+}
+
+static void cleanup_consumers(void)
+{
+    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
+    for (size_t i = 0; i < MIDI_TRANSPORT_MAX_CONSUMERS; i++) {
+        consumers[i] = (consumer_t){0};
+    }
+    consumer_count = 0;
+    xSemaphoreGive(consumer_mutex);
+}
+
+void midi_transport_deinit(void)
+{
+    if (active_transport) {
+        active_transport->close();
+        active_transport = NULL;
+    }
+
+    if (consumer_mutex != NULL) {
+        cleanup_consumers();
+        vSemaphoreDelete(consumer_mutex);
+        consumer_mutex = NULL;
+    }
+
+    for (int i = 0; i < MIDI_TRANSPORT_MAX_EVENT_CALLBACKS; ++i) {
+        event_callbacks[i] = NULL;
+    }
+}
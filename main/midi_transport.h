@@ -0,0 +1,61 @@
+#ifndef _MIDI_TRANSPORT_H
+#define _MIDI_TRANSPORT_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/message_buffer.h"
+
+// Largest chunk handed to a consumer in one message buffer write.
+#define MIDI_TRANSPORT_MAX_CHUNK_SIZE       128
+// Consumers must receive into a buffer at least this large
+#define MIDI_TRANSPORT_MAX_RECORD_SIZE      (sizeof(midi_transport_chunk_header_t) + MIDI_TRANSPORT_MAX_CHUNK_SIZE)
+
+typedef enum
+{
+    MIDI_TRANSPORT_EVENT_RX_OVERFLOW,
+    MIDI_TRANSPORT_EVENT_RX_DROPPED,        // A consumer buffer was full
+    MIDI_TRANSPORT_EVENT_FRAME_ERROR,
+    MIDI_TRANSPORT_EVENT_PARITY_ERROR,
+    MIDI_TRANSPORT_EVENT_CLOSED,
+} midi_transport_event_t;
+
+// Each message buffer record is this header followed by the chunk
+typedef struct {
+    int64_t received_at;                    // esp_timer_get_time() when the chunk was read
+} midi_transport_chunk_header_t;
+
+typedef void (*midi_transport_receive_cb_t)(const uint8_t *chunk, int len);
+typedef void (*midi_transport_event_cb_t)(midi_transport_event_t event);
+// Called from the transport's receive task, see midi_transport_register_receiver()
+typedef void (*midi_transport_chunk_cb_t)(const uint8_t *chunk, size_t len, int64_t received_at);
+
+// A byte stream backend. open() starts delivering received chunks through
+// on_receive and line conditions through on_event, send() writes a whole
+// message and returns the number of bytes written or -1.
+typedef struct {
+    const char *name;
+    bool (*open)(midi_transport_receive_cb_t on_receive, midi_transport_event_cb_t on_event);
+    void (*close)(void);
+    int (*send)(const uint8_t *data, int len);
+} midi_transport_t;
+
+typedef struct {
+    uint32_t chunks;
+    uint32_t bytes;
+    uint32_t dropped_chunks;
+    uint32_t dropped_bytes;
+    size_t high_water;
+} midi_transport_consumer_stats_t;
+
+bool midi_transport_init(const midi_transport_t *transport);
+void midi_transport_deinit(void);
+int midi_transport_send(const uint8_t *data, int len);
+int midi_transport_register_consumer(MessageBufferHandle_t buffer);
+void midi_transport_deregister_consumer(int consumer_id);
+bool midi_transport_get_consumer_stats(int consumer_id, midi_transport_consumer_stats_t *stats);
+bool midi_transport_register_event_callback(midi_transport_event_cb_t cbk);
+// Processes every chunk in the receive task before consumers get it. Only one
+// receiver can be registered, and it runs on the transport task's stack.
+bool midi_transport_register_receiver(midi_transport_chunk_cb_t cbk);
+bool midi_transport_can_accept(size_t len);
+
+#endif
@@ -0,0 +1,532 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [midi_tx.c] - Asynchronous prioritized MIDI message transmitter
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "midi_tx.h"
+#include "midi_transport.h"
+
+#define MIDI_TX_REALTIME_QUEUE_SIZE         8
+#define MIDI_TX_BULK_QUEUE_SIZE             24
+
+#define MIDI_TX_TASK_STACK_SIZE             2048
+#define MIDI_TX_TASK_PRIORITY               8
+
+#define MIDI_BAUDRATE                       31250
+#define MIDI_LINE_RATE_BYTES                (MIDI_BAUDRATE / 10)
+#define MIDI_BYTE_TIME_US                   (1000000 / MIDI_LINE_RATE_BYTES)
+
+#define MIDI_TX_MAX_OUTSTANDING             16
+#define MIDI_TX_RATE_WINDOW_US              1000000
+
+// Default pacing, see midi_tx_pacing_config_t
+#define MIDI_TX_DEFAULT_MIN_GAP_US          2000
+#define MIDI_TX_DEFAULT_MAX_GAP_US          100000
+#define MIDI_TX_DEFAULT_WINDOW_MS           100
+#define MIDI_TX_DEFAULT_WINDOW_BYTES        250
+#define MIDI_TX_DEFAULT_REPLY_TIMEOUT_MS    500
+#define MIDI_TX_DEFAULT_LATENCY_CEILING_US  50000
+
+#define TAG "MIDI_TX"
+
+typedef struct {
+    uint8_t data[MIDI_TX_MAX_MESSAGE_SIZE];
+    uint8_t length;
+    bool expects_reply;
+    uint32_t tag;               // Of a request, handed back by midi_tx_report_reply()
+    int64_t enqueued_at;
+} midi_tx_message_t;
+
+typedef struct {
+    uint32_t tag;
+    int64_t sent_at;
+} outstanding_request_t;
+
+typedef struct {
+    QueueHandle_t queue;
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t cancelled;
+    uint32_t queue_high_water;
+    uint32_t latency_last_us;
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;
+} lane_state_t;
+
+typedef struct {
+    midi_tx_pacing_config_t config;
+    uint32_t gap_us;
+    int64_t line_free_at;       // End of the previous message on the wire
+    int64_t next_send_at;       // Of the bulk lane, after the adaptive gap
+    int64_t tokens_updated_at;
+    uint32_t tokens;
+    // Requests still waiting for a reply, in no particular order
+    outstanding_request_t outstanding[MIDI_TX_MAX_OUTSTANDING];
+    int outstanding_count;
+    int64_t last_reply_at;
+    int64_t rate_window_start;
+    uint32_t rate_window_bytes;
+    midi_tx_pacing_stats_t stats;
+    uint64_t reply_latency_total_us;
+} pacing_state_t;
+
+static lane_state_t lanes[MIDI_TX_LANE_MAX];
+static pacing_state_t pacing;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t tx_task;
+static midi_tx_request_filter_t request_filter;
+
+static void increase_gap(void)
+{
+    uint32_t gap = pacing.gap_us * 2;
+    if (gap < pacing.config.min_gap_us + MIDI_BYTE_TIME_US) {
+        gap = pacing.config.min_gap_us + MIDI_BYTE_TIME_US;
+    }
+    pacing.gap_us = gap < pacing.config.max_gap_us ? gap : pacing.config.max_gap_us;
+}
+
+static void decrease_gap(void)
+{
+    uint32_t gap = pacing.gap_us - pacing.gap_us / 16;
+    pacing.gap_us = gap > pacing.config.min_gap_us ? gap : pacing.config.min_gap_us;
+}
+
+// Must be called with stats_lock held
+static void remove_outstanding(int index)
+{
+    pacing.outstanding[index] = pacing.outstanding[--pacing.outstanding_count];
+}
+
+// Must be called with stats_lock held
+static void expire_requests(int64_t now)
+{
+    int64_t deadline = (int64_t)pacing.config.reply_timeout_ms * 1000;
+    for (int i = pacing.outstanding_count - 1; i >= 0; --i) {
+        if (now - pacing.outstanding[i].sent_at > deadline) {
+            remove_outstanding(i);
+            ++pacing.stats.timeouts;
+            increase_gap();
+        }
+    }
+}
+
+static TickType_t pacing_ticks(int64_t wait_us)
+{
+    TickType_t ticks = pdMS_TO_TICKS((wait_us + 999) / 1000);
+    return ticks > 0 ? ticks : 1;
+}
+
+// Returns how long the next message of the given length has to wait. A
+// realtime message only keeps the minimum gap, a bulk message also keeps the
+// adaptive gap and the byte budget of the current window.
+static TickType_t pacing_wait(midi_tx_lane_t lane, int length, int64_t now)
+{
+    portENTER_CRITICAL(&stats_lock);
+    const midi_tx_pacing_config_t *config = &pacing.config;
+
+    if (lane == MIDI_TX_LANE_REALTIME) {
+        int64_t wait_us = pacing.line_free_at + config->min_gap_us - now;
+        portEXIT_CRITICAL(&stats_lock);
+        return wait_us > 0 ? pacing_ticks(wait_us) : 0;
+    }
+
+    int64_t window_us = (int64_t)config->window_ms * 1000;
+    uint32_t refill = (now - pacing.tokens_updated_at) * config->window_bytes / window_us;
+    if (refill > 0) {
+        pacing.tokens += refill;
+        if (pacing.tokens > config->window_bytes) {
+            pacing.tokens = config->window_bytes;
+        }
+        pacing.tokens_updated_at = now;
+    }
+
+    int64_t wait_us = pacing.next_send_at - now;
+    if (pacing.tokens < (uint32_t)length) {
+        int64_t token_wait_us = (length - pacing.tokens) * window_us / config->window_bytes;
+        if (token_wait_us > wait_us) {
+            wait_us = token_wait_us;
+        }
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    return wait_us > 0 ? pacing_ticks(wait_us) : 0;
+}
+
+static void pacing_account(const midi_tx_message_t *message, midi_tx_lane_t lane, int64_t sent_at)
+{
+    portENTER_CRITICAL(&stats_lock);
+    if (lane == MIDI_TX_LANE_BULK) {
+        pacing.tokens = pacing.tokens > message->length ? pacing.tokens - message->length : 0;
+    }
+    pacing.line_free_at = sent_at + message->length * MIDI_BYTE_TIME_US;
+    pacing.next_send_at = pacing.line_free_at + pacing.gap_us;
+
+    if (message->expects_reply) {
+        if (pacing.outstanding_count == MIDI_TX_MAX_OUTSTANDING) {
+            // Forget the oldest rather than blocking, it will most likely time out
+            int oldest = 0;
+            for (int i = 1; i < pacing.outstanding_count; ++i) {
+                if (pacing.outstanding[i].sent_at < pacing.outstanding[oldest].sent_at) {
+                    oldest = i;
+                }
+            }
+            remove_outstanding(oldest);
+        }
+        pacing.outstanding[pacing.outstanding_count++] = (outstanding_request_t) {
+            .tag = message->tag,
+            .sent_at = sent_at,
+        };
+    }
+
+    pacing.stats.bytes_sent += message->length;
+    pacing.rate_window_bytes += message->length;
+    if (sent_at - pacing.rate_window_start >= MIDI_TX_RATE_WINDOW_US) {
+        pacing.stats.bytes_per_sec = (uint64_t)pacing.rate_window_bytes * 1000000 / (sent_at - pacing.rate_window_start);
+        pacing.rate_window_start = sent_at;
+        pacing.rate_window_bytes = 0;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static bool next_message(midi_tx_message_t *message, midi_tx_lane_t *lane)
+{
+    // Lanes are ordered by priority, so a pending realtime message always
+    // goes out before any queued bulk traffic.
+    for (int i = 0; i < MIDI_TX_LANE_MAX; ++i) {
+        if (xQueueReceive(lanes[i].queue, message, 0)) {
+            *lane = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool peek_message(midi_tx_message_t *message, midi_tx_lane_t *lane)
+{
+    for (int i = 0; i < MIDI_TX_LANE_MAX; ++i) {
+        if (xQueuePeek(lanes[i].queue, message, 0)) {
+            *lane = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drops requests at the lane heads that the filter no longer wants, before
+// pacing holds them back
+static void drop_cancelled_requests(void)
+{
+    midi_tx_message_t message;
+    if (!request_filter) {
+        return;
+    }
+    for (int i = 0; i < MIDI_TX_LANE_MAX; ++i) {
+        while (xQueuePeek(lanes[i].queue, &message, 0) && message.expects_reply &&
+               !request_filter(message.data, message.length)) {
+            xQueueReceive(lanes[i].queue, &message, 0);
+            portENTER_CRITICAL(&stats_lock);
+            ++lanes[i].cancelled;
+            portEXIT_CRITICAL(&stats_lock);
+        }
+    }
+}
+
+static void midi_tx_task(void *pvParameter)
+{
+    midi_tx_message_t message;
+    midi_tx_lane_t lane;
+    // Notifications taken while pacing held a message back
+    uint32_t credits = 0;
+    for (;;) {
+        // One notification is given per queued message. Wake up periodically
+        // while replies are outstanding so timeouts are noticed.
+        uint32_t notified = credits;
+        if (credits > 0) {
+            --credits;
+        } else {
+            TickType_t idle_wait = pacing.outstanding_count > 0 ?
+                pdMS_TO_TICKS(pacing.config.reply_timeout_ms) : portMAX_DELAY;
+            notified = ulTaskNotifyTake(pdFALSE, idle_wait);
+        }
+
+        portENTER_CRITICAL(&stats_lock);
+        expire_requests(esp_timer_get_time());
+        portEXIT_CRITICAL(&stats_lock);
+
+        if (!notified) {
+            continue;
+        }
+
+        drop_cancelled_requests();
+
+        // Hold the next message until pacing allows it. A message queued
+        // during the wait ends it, so a realtime message does not sit behind
+        // a throttled bulk one.
+        while (peek_message(&message, &lane)) {
+            TickType_t wait = pacing_wait(lane, message.length, esp_timer_get_time());
+            if (wait == 0) {
+                break;
+            }
+            ++pacing.stats.throttled;
+            if (ulTaskNotifyTake(pdFALSE, wait)) {
+                ++credits;
+            }
+        }
+
+        if (!next_message(&message, &lane)) {
+            continue;
+        }
+
+        int64_t sent_at = esp_timer_get_time();
+        if (midi_transport_send(message.data, message.length) < 0) {
+            ESP_LOGW(TAG, "Failed to write message");
+        }
+        pacing_account(&message, lane, sent_at);
+
+        uint32_t latency = sent_at - message.enqueued_at;
+
+        lane_state_t *state = &lanes[lane];
+        portENTER_CRITICAL(&stats_lock);
+        ++state->sent;
+        state->latency_last_us = latency;
+        state->latency_total_us += latency;
+        if (latency > state->latency_max_us) {
+            state->latency_max_us = latency;
+        }
+        portEXIT_CRITICAL(&stats_lock);
+    }
+}
+
+static int enqueue(const uint8_t *message, int length, midi_tx_lane_t lane, bool expects_reply, uint32_t tag)
+{
+    if (tx_task == NULL) {
+        ESP_LOGE(TAG, "Not initialized yet");
+        return -1;
+    }
+
+    if (lane >= MIDI_TX_LANE_MAX || length <= 0 || length > MIDI_TX_MAX_MESSAGE_SIZE) {
+        ESP_LOGE(TAG, "Invalid message: lane %d, length %d", lane, length);
+        return -1;
+    }
+
+    midi_tx_message_t entry = {
+        .length = length,
+        .expects_reply = expects_reply,
+        .tag = tag,
+        .enqueued_at = esp_timer_get_time(),
+    };
+    memcpy(entry.data, message, length);
+
+    lane_state_t *state = &lanes[lane];
+    if (!xQueueSend(state->queue, &entry, 0)) {
+        portENTER_CRITICAL(&stats_lock);
+        ++state->dropped;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGW(TAG, "Lane %d queue full. Message dropped.", lane);
+        return -1;
+    }
+
+    uint32_t depth = uxQueueMessagesWaiting(state->queue);
+    portENTER_CRITICAL(&stats_lock);
+    if (depth > state->queue_high_water) {
+        state->queue_high_water = depth;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    xTaskNotifyGive(tx_task);
+    return length;
+}
+
+int midi_tx_send(const uint8_t *message, int length, midi_tx_lane_t lane)
+{
+    return enqueue(message, length, lane, false, 0);
+}
+
+int midi_tx_send_request(const uint8_t *message, int length, midi_tx_lane_t lane, uint32_t tag)
+{
+    return enqueue(message, length, lane, true, tag);
+}
+
+int midi_tx_get_free_slots(midi_tx_lane_t lane)
+{
+    if (lane >= MIDI_TX_LANE_MAX || lanes[lane].queue == NULL) {
+        return 0;
+    }
+    return uxQueueSpacesAvailable(lanes[lane].queue);
+}
+
+void midi_tx_report_reply(uint32_t tag, int reply_length)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&stats_lock);
+    expire_requests(now);
+    int index = -1;
+    for (int i = 0; i < pacing.outstanding_count; ++i) {
+        if (pacing.outstanding[i].tag == tag) {
+            index = i;
+            break;
+        }
+    }
+    if (index >= 0) {
+        // Neither the reply's own wire time nor the replies ahead of it on
+        // the line are the device's doing
+        int64_t started_at = pacing.outstanding[index].sent_at;
+        if (pacing.last_reply_at > started_at) {
+            started_at = pacing.last_reply_at;
+        }
+        int64_t elapsed = now - started_at - (int64_t)reply_length * MIDI_BYTE_TIME_US;
+        uint32_t latency = elapsed > 0 ? elapsed : 0;
+        remove_outstanding(index);
+        pacing.last_reply_at = now;
+
+        ++pacing.stats.replies;
+        pacing.stats.reply_latency_last_us = latency;
+        pacing.reply_latency_total_us += latency;
+
+        // A slow answer means the device is still busy with earlier traffic
+        if (latency > pacing.config.latency_ceiling_us) {
+            increase_gap();
+        } else {
+            decrease_gap();
+        }
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void midi_tx_report_error(void)
+{
+    portENTER_CRITICAL(&stats_lock);
+    ++pacing.stats.errors;
+    increase_gap();
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void midi_tx_register_request_filter(midi_tx_request_filter_t filter)
+{
+    request_filter = filter;
+}
+
+void midi_tx_set_pacing(const midi_tx_pacing_config_t *config)
+{
+    portENTER_CRITICAL(&stats_lock);
+    pacing.config = *config;
+    if (pacing.config.window_ms == 0) {
+        pacing.config.window_ms = MIDI_TX_DEFAULT_WINDOW_MS;
+    }
+    if (pacing.config.window_bytes == 0) {
+        pacing.config.window_bytes = MIDI_LINE_RATE_BYTES * pacing.config.window_ms / 1000;
+    }
+    if (pacing.config.max_gap_us < pacing.config.min_gap_us) {
+        pacing.config.max_gap_us = pacing.config.min_gap_us;
+    }
+    pacing.gap_us = pacing.config.min_gap_us;
+    pacing.tokens = pacing.config.window_bytes;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void midi_tx_get_pacing_stats(midi_tx_pacing_stats_t *stats)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *stats = pacing.stats;
+    stats->gap_us = pacing.gap_us;
+    stats->line_rate_bytes_per_sec = MIDI_LINE_RATE_BYTES;
+    stats->outstanding = pacing.outstanding_count;
+    stats->reply_latency_avg_us = pacing.stats.replies ?
+        pacing.reply_latency_total_us / pacing.stats.replies : 0;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+bool midi_tx_get_stats(midi_tx_lane_t lane, midi_tx_lane_stats_t *stats)
+{
+    if (lane >= MIDI_TX_LANE_MAX || lanes[lane].queue == NULL) {
+        return false;
+    }
+
+    lane_state_t *state = &lanes[lane];
+    portENTER_CRITICAL(&stats_lock);
+    *stats = (midi_tx_lane_stats_t) {
+        .sent = state->sent,
+        .dropped = state->dropped,
+        .cancelled = state->cancelled,
+        .queue_high_water = state->queue_high_water,
+        .latency_last_us = state->latency_last_us,
+        .latency_avg_us = state->sent ? state->latency_total_us / state->sent : 0,
+        .latency_max_us = state->latency_max_us,
+    };
+    portEXIT_CRITICAL(&stats_lock);
+    stats->queue_depth = uxQueueMessagesWaiting(state->queue);
+    return true;
+}
+
+bool midi_tx_init(void)
+{
+    static const UBaseType_t queue_sizes[MIDI_TX_LANE_MAX] = {
+        [MIDI_TX_LANE_REALTIME] = MIDI_TX_REALTIME_QUEUE_SIZE,
+        [MIDI_TX_LANE_BULK] = MIDI_TX_BULK_QUEUE_SIZE,
+    };
+
+    pacing = (pacing_state_t){0};
+    midi_tx_set_pacing(&(midi_tx_pacing_config_t) {
+        .min_gap_us = MIDI_TX_DEFAULT_MIN_GAP_US,
+        .max_gap_us = MIDI_TX_DEFAULT_MAX_GAP_US,
+        .window_ms = MIDI_TX_DEFAULT_WINDOW_MS,
+        .window_bytes = MIDI_TX_DEFAULT_WINDOW_BYTES,
+        .reply_timeout_ms = MIDI_TX_DEFAULT_REPLY_TIMEOUT_MS,
+        .latency_ceiling_us = MIDI_TX_DEFAULT_LATENCY_CEILING_US,
+    });
+    int64_t now = esp_timer_get_time();
+    pacing.tokens_updated_at = now;
+    pacing.rate_window_start = now;
+
+    for (int i = 0; i < MIDI_TX_LANE_MAX; ++i) {
+        lanes[i] = (lane_state_t) {
+            .queue = xQueueCreate(queue_sizes[i], sizeof(midi_tx_message_t)),
+        };
+        if (!lanes[i].queue) {
+            ESP_LOGE(TAG, "Failed to create lane %d queue.", i);
+            goto cleanup;
+        }
+    }
+
+    xTaskCreate(midi_tx_task,
+                "midi_tx",
+                MIDI_TX_TASK_STACK_SIZE,
+                NULL,
+                MIDI_TX_TASK_PRIORITY,
+                &tx_task);
+
+    return true;
+
+cleanup:
+    for (int i = 0; i < MIDI_TX_LANE_MAX; ++i) {
+        if (lanes[i].queue) {
+            vQueueDelete(lanes[i].queue);
+            lanes[i].queue = NULL;
+        }
+    }
+    return false;
+}
+
+void midi_tx_deinit(void)
+{
+    if (tx_task != NULL) {
+        vTaskDelete(tx_task);
+        tx_task = NULL;
+    }
+
+    for (int i = 0; i < MIDI_TX_LANE_MAX; ++i) {
+        if (lanes[i].queue) {
+            vQueueDelete(lanes[i].queue);
+            lanes[i].queue = NULL;
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef _MIDI_TX_H
+#define _MIDI_TX_H
+
+#include "freertos/FreeRTOS.h"
+
+#define MIDI_TX_MAX_MESSAGE_SIZE            64
+
+typedef enum
+{
+    MIDI_TX_LANE_REALTIME,      // Latency critical writes (e.g. footswitch DT1)
+    MIDI_TX_LANE_BULK,          // Requests and sync traffic
+    MIDI_TX_LANE_MAX,
+} midi_tx_lane_t;
+
+typedef struct {
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t cancelled;             // Requests the filter dropped before they went out
+    uint32_t queue_depth;
+    uint32_t queue_high_water;
+    uint32_t latency_last_us;
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+} midi_tx_lane_stats_t;
+
+typedef struct {
+    uint32_t min_gap_us;            // Lower bound of the adaptive inter-message gap
+    uint32_t max_gap_us;            // Upper bound of the adaptive inter-message gap
+    uint32_t window_ms;             // Byte budget window
+    uint32_t window_bytes;          // Bytes allowed per window (0: line rate)
+    uint32_t reply_timeout_ms;      // A request without reply after this counts as lost
+    uint32_t latency_ceiling_us;    // Replies slower than this widen the gap
+} midi_tx_pacing_config_t;
+
+typedef struct {
+    uint32_t gap_us;                // Current adaptive gap
+    uint32_t bytes_sent;
+    uint32_t bytes_per_sec;         // Achieved over the last second
+    uint32_t line_rate_bytes_per_sec;
+    uint32_t throttled;             // Times a message was held back by pacing
+    uint32_t outstanding;
+    uint32_t replies;
+    uint32_t timeouts;
+    uint32_t errors;
+    uint32_t reply_latency_last_us;
+    uint32_t reply_latency_avg_us;
+} midi_tx_pacing_stats_t;
+
+// Asked for each queued request when it reaches the head of its lane.
+// Returning false drops the request without sending it.
+typedef bool (*midi_tx_request_filter_t)(const uint8_t *message, int length);
+
+bool midi_tx_init(void);
+void midi_tx_deinit(void);
+int midi_tx_send(const uint8_t *message, int length, midi_tx_lane_t lane);
+// tag identifies the request to midi_tx_report_reply()
+int midi_tx_send_request(const uint8_t *message, int length, midi_tx_lane_t lane, uint32_t tag);
+int midi_tx_get_free_slots(midi_tx_lane_t lane);
+// Called when the first reply of a request arrived, reply_length bytes long
+void midi_tx_report_reply(uint32_t tag, int reply_length);
+void midi_tx_report_error(void);
+void midi_tx_register_request_filter(midi_tx_request_filter_t filter);
+void midi_tx_set_pacing(const midi_tx_pacing_config_t *config);
+void midi_tx_get_pacing_stats(midi_tx_pacing_stats_t *stats);
+bool midi_tx_get_stats(midi_tx_lane_t lane, midi_tx_lane_stats_t *stats);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * SPDX-FileCopyrightText: 2025 mhl6829
+ * SPDX-License-Identifier: MIT
+ * File: [patch_codec.c] - Compact patch encoding as a difference to a reference patch
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "patch_codec.h"
+#include "gt1000.h"
+#include "gt1000_param.h"
+
+// Runs of defined bytes over all blocks at most
+#define MAX_SPANS                       512
+
+// Data bytes are 7-bit and stand for themselves. Bytes from 80h skip 1-127
+// bytes that equal the reference, FFh escapes a data byte with the top bit set.
+#define TOKEN_SKIP_BASE                 0x7F
+#define TOKEN_MAX_SKIP                  127
+#define TOKEN_ESCAPE                    0xFF
+
+#define TAG "PATCH_CODEC"
+
+static uint8_t span_offsets[MAX_SPANS];
+static uint8_t span_lengths[MAX_SPANS];
+// First span and packed offset of each block, the last entry ends the table
+static uint16_t block_spans[GT1000_EFFECT_BLOCK_COUNT + 1];
+static uint16_t block_packed[GT1000_EFFECT_BLOCK_COUNT + 1];
+static uint8_t block_extents[GT1000_EFFECT_BLOCK_COUNT];
+
+typedef struct {
+    uint8_t *out;
+    size_t size;
+    size_t length;
+    uint32_t skip;              // Unchanged bytes not written yet
+} encoder_t;
+
+static inline bool has_block(const uint32_t *blocks, int block) {
+    return !blocks || (blocks[block / 32] >> (block % 32)) & 1;
+}
+
+static inline uint32_t load_word(const uint8_t *data) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+static inline bool put(encoder_t *encoder, uint8_t byte) {
+    if (encoder->length >= encoder->size) {
+        return false;
+    }
+    encoder->out[encoder->length++] = byte;
+    return true;
+}
+
+static bool flush_skip(encoder_t *encoder) {
+    while (encoder->skip > 0) {
+        uint32_t run = encoder->skip < TOKEN_MAX_SKIP ? encoder->skip : TOKEN_MAX_SKIP;
+        if (!put(encoder, TOKEN_SKIP_BASE + run)) {
+            return false;
+        }
+        encoder->skip -= run;
+    }
+    return true;
+}
+
+bool patch_codec_init(void) {
+    gt1000_t *device = gt1000_get_device();
+    int spans = 0;
+    size_t packed = 0;
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        uint8_t *base = (uint8_t *)&device->effect + block * EFFECT_BLOCK_SIZE;
+        bool defined[EFFECT_BLOCK_SIZE] = {0};
+        size_t extent = gt1000_get_block_extent(base);
+        for (size_t offset = 0; offset < extent; ++offset) {
+            gt1000_param_t param;
+            if (gt1000_get_parameter_info(&param, base + offset)) {
+                memset(defined + offset, 1, param.size);
+            }
+        }
+
+        block_spans[block] = spans;
+        block_packed[block] = packed;
+        block_extents[block] = extent;
+        for (size_t offset = 0; offset < extent; ) {
+            if (!defined[offset]) {
+                ++offset;
+                continue;
+            }
+            size_t end = offset;
+            while (end < extent && defined[end]) {
+                ++end;
+            }
+            if (spans == MAX_SPANS) {
+                ESP_LOGE(TAG, "More than %d parameter runs.", MAX_SPANS);
+                return false;
+            }
+            span_offsets[spans] = offset;
+            span_lengths[spans++] = end - offset;
+            packed += end - offset;
+            offset = end;
+        }
+    }
+    if (packed > PATCH_CODEC_MAX_PACKED_SIZE) {
+        ESP_LOGE(TAG, "%u parameter bytes, more than a reference holds.", (unsigned)packed);
+        return false;
+    }
+    block_spans[GT1000_EFFECT_BLOCK_COUNT] = spans;
+    block_packed[GT1000_EFFECT_BLOCK_COUNT] = packed;
+    ESP_LOGI(TAG, "%u parameter bytes in %d runs", (unsigned)packed, spans);
+    return true;
+}
+
+size_t patch_codec_packed_size(void) {
+    return block_packed[GT1000_EFFECT_BLOCK_COUNT];
+}
+
+void patch_codec_pack(patch_codec_reference_t *reference, const gt1000_effect_t *patch) {
+    uint8_t *out = reference->bytes;
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        const uint8_t *data = (const uint8_t *)patch + block * EFFECT_BLOCK_SIZE;
+        for (int span = block_spans[block]; span < block_spans[block + 1]; ++span) {
+            memcpy(out, data + span_offsets[span], span_lengths[span]);
+            out += span_lengths[span];
+        }
+    }
+}
+
+int patch_codec_encode(const gt1000_effect_t *patch, const uint32_t *blocks,
+                       const patch_codec_reference_t *reference, uint8_t *out, size_t size) {
+    encoder_t encoder = { .out = out, .size = size };
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        if (!has_block(blocks, block)) {
+            continue;
+        }
+        const uint8_t *base = (const uint8_t *)patch + block * EFFECT_BLOCK_SIZE;
+        const uint8_t *ref = reference->bytes + block_packed[block];
+        for (int span = block_spans[block]; span < block_spans[block + 1]; ++span) {
+            const uint8_t *data = base + span_offsets[span];
+            int length = span_lengths[span];
+            for (int i = 0; i < length; ) {
+                // Most parameters are unchanged, compare them a word at a time
+                while (i + 4 <= length && load_word(data + i) == load_word(ref + i)) {
+                    encoder.skip += 4;
+                    i += 4;
+                }
+                if (i == length) {
+                    break;
+                }
+                if (data[i] == ref[i]) {
+                    ++encoder.skip;
+                    ++i;
+                    continue;
+                }
+                if (!flush_skip(&encoder) ||
+                    (data[i] > TOKEN_SKIP_BASE && !put(&encoder, TOKEN_ESCAPE)) ||
+                    !put(&encoder, data[i])) {
+                    return -1;
+                }
+                ++i;
+            }
+            ref += length;
+        }
+    }
+    // Unchanged bytes at the end are implied
+    return encoder.length;
+}
+
+bool patch_codec_decode(const uint8_t *in, int length, const uint32_t *blocks,
+                        const patch_codec_reference_t *reference, patch_codec_block_cb_t cbk, void *arg) {
+    const uint8_t *end = in + length;
+    uint32_t skip = 0;
+    bool implied = false;
+    uint8_t block_data[EFFECT_BLOCK_SIZE];
+    for (int block = 0; block < GT1000_EFFECT_BLOCK_COUNT; ++block) {
+        if (!has_block(blocks, block)) {
+            continue;
+        }
+        memset(block_data, 0, block_extents[block]);
+        const uint8_t *ref = reference->bytes + block_packed[block];
+        for (int span = block_spans[block]; span < block_spans[block + 1]; ++span) {
+            uint8_t *data = block_data + span_offsets[span];
+            uint32_t span_length = span_lengths[span];
+            for (uint32_t i = 0; i < span_length; ) {
+                if (skip == 0) {
+                    if (in == end) {
+                        // The rest is unchanged
+                        skip = UINT32_MAX;
+                        implied = true;
+                        continue;
+                    }
+                    uint8_t token = *in++;
+                    if (token == TOKEN_ESCAPE) {
+                        if (in == end) {
+                            return false;
+                        }
+                        data[i++] = *in++;
+                    } else if (token > TOKEN_SKIP_BASE) {
+                        skip = token - TOKEN_SKIP_BASE;
+                    } else {
+                        data[i++] = token;
+                    }
+                    continue;
+                }
+                uint32_t run = skip < span_length - i ? skip : span_length - i;
+                memcpy(data + i, ref + i, run);
+                skip -= run;
+                i += run;
+            }
+            ref += span_length;
+        }
+        cbk(block, block_data, block_extents[block], arg);
+    }
+    // A skip is only written before a changed byte
+    return in == end && (skip == 0 || implied);
+}
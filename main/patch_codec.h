@@ -0,0 +1,35 @@
+#ifndef _PATCH_CODEC_H
+#define _PATCH_CODEC_H
+
+#include "freertos/FreeRTOS.h"
+#include "gt1000.h"
+
+// Defined parameter bytes of a patch at most
+#define PATCH_CODEC_MAX_PACKED_SIZE     1536
+// Bitmap words for a set of effect blocks
+#define PATCH_CODEC_BITMAP_WORDS        ((GT1000_EFFECT_BLOCK_COUNT + 31) / 32)
+
+// The defined parameter bytes of every effect block, in block order
+typedef struct {
+    uint8_t bytes[PATCH_CODEC_MAX_PACKED_SIZE];
+} patch_codec_reference_t;
+
+// Gets each decoded block: the block from its start, with extent bytes valid
+typedef void (*patch_codec_block_cb_t)(int block, const uint8_t *data, size_t extent, void *arg);
+
+// Lays out the defined bytes from the parameter metadata
+bool patch_codec_init(void);
+// Bytes of a patch that are parameters
+size_t patch_codec_packed_size(void);
+void patch_codec_pack(patch_codec_reference_t *reference, const gt1000_effect_t *patch);
+// Encodes the blocks of patch set in blocks (NULL for all) as their
+// difference to reference. Returns the encoded length, or -1 if it is longer
+// than size. Twice the packed size of the blocks always fits.
+int patch_codec_encode(const gt1000_effect_t *patch, const uint32_t *blocks,
+                       const patch_codec_reference_t *reference, uint8_t *out, size_t size);
+// Decodes the blocks encoded with the same blocks and reference. Returns
+// false if the data is damaged, blocks handed over until then are complete.
+bool patch_codec_decode(const uint8_t *in, int length, const uint32_t *blocks,
+                        const patch_codec_reference_t *reference, patch_codec_block_cb_t cbk, void *arg);
+
+#endif
@@ -5,44 +5,140 @@
  */
 
 #include <string.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/message_buffer.h"
+#include "freertos/timers.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "sysex.h"
-#include "uart.h"
+#include "midi_transport.h"
+#include "midi_tx.h"
 
-#define SYSEX_MESSAGE_BUFFER_SIZE         8
-#define SYSEX_QUEUE_SIZE                  256
-#define SYSEX_BUFFER_SIZE                 512
+// Size classes, smallest first. A message starts in the smallest free buffer
+// and moves up a class when it outgrows it.
+#define SYSEX_SLAB_SMALL_SIZE             32
+#define SYSEX_SLAB_SMALL_COUNT            8
+#define SYSEX_SLAB_MEDIUM_SIZE            64
+#define SYSEX_SLAB_MEDIUM_COUNT           4
+#define SYSEX_SLAB_LARGE_SIZE             SYSEX_MAX_MESSAGE_SIZE
+#define SYSEX_SLAB_LARGE_COUNT            2
+#define SYSEX_MESSAGE_BUFFER_SIZE         (SYSEX_SLAB_SMALL_COUNT + SYSEX_SLAB_MEDIUM_COUNT + SYSEX_SLAB_LARGE_COUNT)
+#define SYSEX_PARSER_BUFFER_SIZE          1024
 #define SYSEX_TASK_STACK_SIZE             4096
 #define SYSEX_TASK_PRIORITY               5
 #define SYSEX_IDENTITY_REQUEST_LEN        6
 #define SYSEX_IDENTITY_REPLY_LEN          15
 
+// Released buffer stack word: (count << 8) | head index
+#define RELEASED_EMPTY                    0xFF
+
+// Pending requests are hashed on the address of the next DT1 they expect
+#define SYSEX_REQUEST_BUCKETS             32
+#define SYSEX_REQUEST_TIMER_MS            10
+// Not a valid 7-bit address, keys identity requests
+#define SYSEX_IDENTITY_ADDRESS            0xFFFFFFFF
+
 #define TAG "SYSEX"
 
 typedef struct {
-    uint8_t * buffer;
+    bool in_use;
+    bool cancelled;             // Completed by the next expiry pass
+    uint32_t tag;               // Identifies the request to midi_tx
+    int8_t next_in_bucket;
+    uint32_t address;
+    uint32_t size;
+    uint32_t next_address;      // Hash key
+    uint32_t end;               // Linear end of the requested range
+    TickType_t sent_tick;
+    TickType_t timeout;
+    int64_t sent_at;
+    sysex_request_callback_t cbk;
+    void *arg;
+} pending_request_t;
+
+typedef struct {
+    sysex_request_callback_t cbk;
+    void *arg;
+    sysex_request_result_t result;
+} request_completion_t;
+
+typedef struct {
+    TaskHandle_t waiter;
+    sysex_request_result_t *result;
+    uint8_t *reply;
+    int reply_size;
+} sync_wait_t;
+
+// The parser claims from the class's own free list without atomics. Consumers
+// push released buffers onto a shared stack, which the parser takes over whole
+// with one exchange once its list runs empty.
+typedef struct {
+    uint8_t *storage;
+    int size;
+    int count;
+    int free_head;
+    int free_count;
+    atomic_uint released;       // (count << 8) | head index
+} slab_class_t;
+
+typedef struct {
+    sysex_buffer_t *slot;       // Claimed pool buffer the message is written into
+    uint8_t *buffer;            // slot->data, or the scratch buffer while the pool is exhausted
+    int capacity;
     int length;
-    SemaphoreHandle_t completion;
-} sync_request_t;
+    bool in_sysex;
+    bool header_match;
+    uint8_t dev_id;
+    uint8_t sum;                // Running sum of everything after the DT1 header
+    midi_message_t message;     // Channel or common message being assembled
+    uint8_t expected_length;
+    int64_t received_at;        // Arrival time of the chunk being parsed
+} parser_state_t;
 
 static sysex_buffer_t sysex_buffer_pool[SYSEX_MESSAGE_BUFFER_SIZE];
+static uint8_t slab_small[SYSEX_SLAB_SMALL_COUNT][SYSEX_SLAB_SMALL_SIZE];
+static uint8_t slab_medium[SYSEX_SLAB_MEDIUM_COUNT][SYSEX_SLAB_MEDIUM_SIZE];
+static uint8_t slab_large[SYSEX_SLAB_LARGE_COUNT][SYSEX_SLAB_LARGE_SIZE];
+
+static slab_class_t slabs[SYSEX_SLAB_CLASSES] = {
+    { slab_small[0], SYSEX_SLAB_SMALL_SIZE, SYSEX_SLAB_SMALL_COUNT },      // Notifications, short replies
+    { slab_medium[0], SYSEX_SLAB_MEDIUM_SIZE, SYSEX_SLAB_MEDIUM_COUNT },
+    { slab_large[0], SYSEX_SLAB_LARGE_SIZE, SYSEX_SLAB_LARGE_COUNT },      // Block replies
+};
 
 static QueueHandle_t device_message_queue;
+static QueueHandle_t midi_queues[MIDI_ROUTE_MAX];
+static sysex_message_handler_t message_handler;
+static sysex_midi_handler_t midi_handlers[MIDI_ROUTE_MAX];
 
-static QueueHandle_t parser_queue;
+static MessageBufferHandle_t parser_buffer;
 static TaskHandle_t parser_task;
 
 static parser_callback_t parser_cbk;
+static sysex_loss_callback_t loss_cbk;
 
-static sync_request_t *g_sync_request;
-static SemaphoreHandle_t g_sync_request_mutex;
+static pending_request_t requests[SYSEX_MAX_PENDING_REQUESTS];
+static int8_t request_buckets[SYSEX_REQUEST_BUCKETS];
+// Handed out to requests, guarded by request_lock
+static uint32_t request_tags;
+static portMUX_TYPE request_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t request_timer;
+static uint64_t request_rtt_total_us;
 
 static bool is_callback_ready = false;
 
+static sysex_stats_t stats;
+
+static parser_state_t parser;
+// Keeps a message parseable for loss reports while no buffer is free
+static uint8_t parser_scratch[SYSEX_MAX_MESSAGE_SIZE];
+static uint8_t dt1_header[SYSEX_DT1_MAX_HEADER_SIZE];
+static int dt1_header_length;
+
 static const uint8_t identity_request[] = {
     0xF0,                       // Status
     0x7E,                       // ID (Universal Non-realtime)
@@ -62,8 +158,126 @@ static const uint8_t identity_reply_pattern[] = {
     0xF7,
 };
 
+static void report_loss(const uint8_t *message, int length) {
+    if (message) {
+        ++stats.lost_messages;
+    } else {
+        ++stats.stream_losses;
+    }
+
+    if (loss_cbk) {
+        loss_cbk(message, length);
+    }
+}
+
+static void handle_transport_event(midi_transport_event_t event) {
+    switch (event) {
+        case MIDI_TRANSPORT_EVENT_RX_OVERFLOW:
+        case MIDI_TRANSPORT_EVENT_RX_DROPPED:
+        case MIDI_TRANSPORT_EVENT_FRAME_ERROR:
+            // Bytes are gone, nothing is known about what they belonged to
+            report_loss(NULL, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+static void init_buffer_pool(void) {
+    int index = 0;
+    for (int c = 0; c < SYSEX_SLAB_CLASSES; ++c) {
+        slab_class_t *slab = &slabs[c];
+        slab->free_head = index;
+        slab->free_count = slab->count;
+        atomic_store(&slab->released, RELEASED_EMPTY);
+        for (int i = 0; i < slab->count; ++i, ++index) {
+            sysex_buffer_pool[index] = (sysex_buffer_t) {
+                .data = slab->storage + i * slab->size,
+                .capacity = slab->size,
+                .slab = c,
+                .next_free = i + 1 < slab->count ? index + 1 : -1,
+            };
+        }
+    }
+}
+
+static inline uint32_t slab_in_use(const slab_class_t *slab) {
+    return slab->count - slab->free_count - (atomic_load(&slab->released) >> 8);
+}
+
+static uint32_t buffers_in_use(void) {
+    uint32_t in_use = 0;
+    for (int c = 0; c < SYSEX_SLAB_CLASSES; ++c) {
+        in_use += slab_in_use(&slabs[c]);
+    }
+    return in_use;
+}
+
+// Parser only
+static sysex_buffer_t *claim_from_slab(int c) {
+    slab_class_t *slab = &slabs[c];
+    if (slab->free_head < 0) {
+        uint32_t taken = atomic_exchange(&slab->released, RELEASED_EMPTY);
+        slab->free_head = (taken & 0xFF) == RELEASED_EMPTY ? -1 : (int)(taken & 0xFF);
+        slab->free_count = taken >> 8;
+        if (slab->free_head < 0) {
+            return NULL;
+        }
+    }
+
+    sysex_buffer_t *buffer = &sysex_buffer_pool[slab->free_head];
+    slab->free_head = buffer->next_free;
+    --slab->free_count;
+
+    uint32_t in_use = slab_in_use(slab);
+    if (in_use > stats.pool_class_high_water[c]) {
+        stats.pool_class_high_water[c] = in_use;
+    }
+    return buffer;
+}
+
+// Parser only. Claims the smallest free buffer that holds size bytes.
+static sysex_buffer_t *claim_buffer(int size) {
+    sysex_buffer_t *buffer = NULL;
+    for (int c = 0; c < SYSEX_SLAB_CLASSES && !buffer; ++c) {
+        if (slabs[c].size >= size) {
+            buffer = claim_from_slab(c);
+        }
+    }
+    if (!buffer) {
+        ++stats.pool_alloc_failures;
+        return NULL;
+    }
+
+    ++stats.pool_allocations;
+    uint32_t in_use = buffers_in_use();
+    if (in_use == SYSEX_MESSAGE_BUFFER_SIZE) {
+        ++stats.pool_exhausted;
+    }
+    if (in_use > stats.pool_high_water) {
+        stats.pool_high_water = in_use;
+    }
+    return buffer;
+}
+
+// Parser only, puts a buffer it never handed out back on its class's list
+static void return_buffer(sysex_buffer_t *buffer) {
+    slab_class_t *slab = &slabs[buffer->slab];
+    buffer->next_free = slab->free_head;
+    slab->free_head = buffer - sysex_buffer_pool;
+    ++slab->free_count;
+}
+
+// Any task
 void sysex_free_buffer(sysex_buffer_t *buffer) {
-    buffer->in_use = false;
+    slab_class_t *slab = &slabs[buffer->slab];
+    uint32_t index = buffer - sysex_buffer_pool;
+    uint32_t head = atomic_load(&slab->released);
+    uint32_t next;
+    do {
+        buffer->next_free = (head & 0xFF) == RELEASED_EMPTY ? -1 : (int)(head & 0xFF);
+        next = (((head >> 8) + 1) << 8) | index;
+    } while (!atomic_compare_exchange_weak(&slab->released, &head, next));
 }
 
 static bool is_identity_reply(uint8_t *buf, int length) {
@@ -84,119 +298,488 @@ static bool is_identity_reply(uint8_t *buf, int length) {
     return true;
 }
 
-static void handle_sysex_message(uint8_t *buf, int length) {
-    bool handled_as_sync = false;
-    // Handle synchronous message
-    if (xSemaphoreTake(g_sync_request_mutex, 10))
-    {
-        if (g_sync_request != NULL) {
-            sync_request_t *request = g_sync_request;
+static inline int request_bucket(uint32_t address) {
+    return (address ^ (address >> 8) ^ (address >> 16) ^ (address >> 24)) % SYSEX_REQUEST_BUCKETS;
+}
 
-            if (is_identity_reply(buf, length))
-            {
-                memcpy(request->buffer, buf, length);
-                request->length = length;
-                
-                g_sync_request = NULL;
-                xSemaphoreGive(request->completion);
-                
-                handled_as_sync = true;
+// Must be called with request_lock held
+static void link_request(int index) {
+    int bucket = request_bucket(requests[index].next_address);
+    requests[index].next_in_bucket = request_buckets[bucket];
+    request_buckets[bucket] = index;
+}
+
+// Must be called with request_lock held
+static void unlink_request(int index) {
+    int8_t *link = &request_buckets[request_bucket(requests[index].next_address)];
+    while (*link != index) {
+        link = &requests[*link].next_in_bucket;
+    }
+    *link = requests[index].next_in_bucket;
+}
+
+// Must be called with request_lock held. Frees the request and records its result.
+static void finish_request(int index, sysex_request_status_t status, int64_t now,
+                           request_completion_t *completion) {
+    pending_request_t *request = &requests[index];
+    uint32_t rtt = now - request->sent_at;
+
+    *completion = (request_completion_t) {
+        .cbk = request->cbk,
+        .arg = request->arg,
+        .result = {
+            .status = status,
+            .address = request->address,
+            .size = request->size,
+            .rtt_us = rtt,
+        },
+    };
+
+    if (status == SYSEX_REQUEST_COMPLETED) {
+        ++stats.requests_completed;
+        stats.request_rtt_last_us = rtt;
+        request_rtt_total_us += rtt;
+        if (rtt > stats.request_rtt_max_us) {
+            stats.request_rtt_max_us = rtt;
+        }
+    } else if (status == SYSEX_REQUEST_TIMED_OUT) {
+        ++stats.requests_timed_out;
+    } else {
+        ++stats.requests_cancelled;
+    }
+    --stats.requests_pending;
+    request->in_use = false;
+}
+
+// Advances every request expecting data at this address, one reply may satisfy
+// several identical requests. Returns true if any request matched.
+static bool complete_requests(uint32_t address, int length, const uint8_t *reply, int reply_length) {
+    request_completion_t completions[SYSEX_MAX_PENDING_REQUESTS];
+    int completed = 0;
+    uint32_t first_replies[SYSEX_MAX_PENDING_REQUESTS];
+    int first_reply_count = 0;
+    bool matched = false;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&request_lock);
+    int index = request_buckets[request_bucket(address)];
+    while (index >= 0) {
+        pending_request_t *request = &requests[index];
+        int next = request->next_in_bucket;
+        uint32_t linear = sysex_address_to_linear(address);
+        if (!request->cancelled && request->next_address == address &&
+            sysex_is_reply_part(length, request->end - linear)) {
+            matched = true;
+            if (request->next_address == request->address) {
+                first_replies[first_reply_count++] = request->tag;
+            }
+            unlink_request(index);
+
+            uint32_t linear_next = linear + length;
+            if (linear_next >= request->end) {
+                finish_request(index, SYSEX_REQUEST_COMPLETED, now, &completions[completed++]);
+            } else {
+                // The device split the reply, wait for the rest
+                request->next_address = sysex_linear_to_address(linear_next);
+                link_request(index);
             }
         }
-        xSemaphoreGive(g_sync_request_mutex);
+        index = next;
+    }
+    portEXIT_CRITICAL(&request_lock);
+
+    // Pacing times each request to the start of its own reply
+    for (int i = 0; i < first_reply_count; ++i) {
+        midi_tx_report_reply(first_replies[i], reply_length);
+    }
+
+    for (int i = 0; i < completed; ++i) {
+        completions[i].result.reply = reply;
+        completions[i].result.reply_length = reply_length;
+        if (completions[i].cbk) {
+            completions[i].cbk(&completions[i].result, completions[i].arg);
+        }
+    }
+
+    return matched;
+}
+
+static void expire_requests(TimerHandle_t timer) {
+    request_completion_t completions[SYSEX_MAX_PENDING_REQUESTS];
+    int completed = 0;
+    int64_t now = esp_timer_get_time();
+    TickType_t now_tick = xTaskGetTickCount();
+
+    portENTER_CRITICAL(&request_lock);
+    for (int i = 0; i < SYSEX_MAX_PENDING_REQUESTS; ++i) {
+        pending_request_t *request = &requests[i];
+        if (request->in_use && (request->cancelled || now_tick - request->sent_tick >= request->timeout)) {
+            unlink_request(i);
+            finish_request(i, request->cancelled ? SYSEX_REQUEST_CANCELLED : SYSEX_REQUEST_TIMED_OUT,
+                           now, &completions[completed++]);
+        }
+    }
+    bool pending = stats.requests_pending > 0;
+    portEXIT_CRITICAL(&request_lock);
+
+    for (int i = 0; i < completed; ++i) {
+        ESP_LOGD(TAG, "Request 0x%08lx %s", (unsigned long)completions[i].result.address,
+                 completions[i].result.status == SYSEX_REQUEST_CANCELLED ? "cancelled" : "timed out");
+        if (completions[i].cbk) {
+            completions[i].cbk(&completions[i].result, completions[i].arg);
+        }
+    }
+
+    // One-shot, re-armed while requests are pending
+    if (pending) {
+        xTimerStart(request_timer, 0);
+    }
+}
+
+// Hands the parsed message over. The claimed buffer moves to the device queue,
+// otherwise it stays with the parser for the next message.
+static void handle_sysex_message(const sysex_dt1_t *dt1) {
+    uint8_t *buf = parser.buffer;
+    int length = parser.length;
+
+    // Complete requests waiting for this reply
+    if (dt1->valid && dt1->checksum_ok) {
+        complete_requests(dt1->address, dt1->length, buf, length);
+    } else if (is_identity_reply(buf, length) &&
+               complete_requests(SYSEX_IDENTITY_ADDRESS, 0, buf, length)) {
+        return;
+    }
+
+    if (message_handler) {
+        // Run to completion, the buffer stays with the parser
+        sysex_buffer_t message = {
+            .data = buf,
+            .capacity = parser.capacity,
+            .length = length,
+            .dt1 = *dt1,
+            .received_at = parser.received_at,
+        };
+        message_handler(&message);
+        return;
     }
 
     // Handle asynchronous message
-    if (!handled_as_sync) {
-        // Find free buffer
-        bool buffer_available = false;
-        for (int i = 0; i < SYSEX_MESSAGE_BUFFER_SIZE; ++i)
-        {
-            sysex_buffer_t *pool_entry = &sysex_buffer_pool[i];
-            if (!pool_entry->in_use)
-            {
-                memcpy(pool_entry->data, buf, length);
-                pool_entry->length = length;
-                pool_entry->in_use = true;
-                
-                BaseType_t result = xQueueSend(device_message_queue, &pool_entry, pdMS_TO_TICKS(100));
-                vTaskDelay(1);
-                if (result != pdPASS) {
-                    ESP_LOGW(TAG, "Failed to send to device message queue. Queue full?");
-                }
+    sysex_buffer_t *slot = parser.slot;
+    if (!slot) {
+        ESP_LOGW(TAG, "Buffer pool not available.");
+        report_loss(buf, length);
+        return;
+    }
 
-                buffer_available = true;
-                break;
+    slot->length = length;
+    slot->dt1 = *dt1;
+    slot->received_at = parser.received_at;
+    if (xQueueSend(device_message_queue, &slot, pdMS_TO_TICKS(100)) != pdPASS) {
+        ESP_LOGW(TAG, "Failed to send to device message queue. Queue full?");
+        report_loss(buf, length);
+        return;
+    }
+    parser.slot = NULL;
+}
+
+// Returns the offset of the first status byte, data bytes never have the top bit set
+static size_t find_status_byte(const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word & 0x80808080) {
+            break;
+        }
+    }
+    for (; i < length; ++i) {
+        if (data[i] & 0x80) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void begin_message(void)
+{
+    if (!parser.slot) {
+        parser.slot = claim_buffer(0);
+    }
+    parser.buffer = parser.slot ? parser.slot->data : parser_scratch;
+    parser.capacity = parser.slot ? parser.slot->capacity : sizeof(parser_scratch);
+    parser.buffer[0] = 0xF0;
+    parser.length = 1;
+    parser.in_sysex = true;
+    parser.header_match = dt1_header_length > 0;
+    parser.sum = 0;
+}
+
+// Moves the message into a buffer of a larger class
+static void grow_buffer(int size)
+{
+    sysex_buffer_t *larger = claim_buffer(size);
+    if (larger) {
+        ++stats.pool_promotions;
+        memcpy(larger->data, parser.buffer, parser.length);
+    } else {
+        // Finish it in the scratch buffer so the loss can be reported
+        memcpy(parser_scratch, parser.buffer, parser.length);
+    }
+
+    return_buffer(parser.slot);
+    parser.slot = larger;
+    parser.buffer = larger ? larger->data : parser_scratch;
+    parser.capacity = larger ? larger->capacity : sizeof(parser_scratch);
+}
+
+static void append_span(const uint8_t *data, size_t length)
+{
+    // Keep room for the EOX
+    if (parser.length + length >= SYSEX_MAX_MESSAGE_SIZE) {
+        ESP_LOGE(TAG, "SysEx buffer overflow");
+        size_t room = SYSEX_MAX_MESSAGE_SIZE - 1 - parser.length;
+        if (parser.slot && parser.slot->capacity < SYSEX_MAX_MESSAGE_SIZE) {
+            grow_buffer(SYSEX_MAX_MESSAGE_SIZE);
+        }
+        memcpy(parser.buffer + parser.length, data, room);
+        report_loss(parser.buffer, parser.length + room);
+        parser.in_sysex = false;
+        return;
+    }
+
+    if (parser.length + length >= parser.capacity) {
+        grow_buffer(parser.length + length + 1);
+    }
+
+    uint8_t *dst = parser.buffer + parser.length;
+    size_t i = 0;
+    for (; i < length && parser.length + i < dt1_header_length; ++i) {
+        uint8_t expected = dt1_header[parser.length + i];
+        if (expected == 0xFF) {
+            parser.dev_id = data[i];
+        } else if (data[i] != expected) {
+            parser.header_match = false;
+        }
+        dst[i] = data[i];
+    }
+
+    uint8_t sum = parser.sum;
+    for (; i < length; ++i) {
+        dst[i] = data[i];
+        sum += data[i];
+    }
+    parser.sum = sum;
+    parser.length += length;
+}
+
+static void finish_message(void)
+{
+    sysex_dt1_t dt1 = {0};
+    // Address, at least one data byte and the checksum
+    int body_length = parser.length - dt1_header_length;
+    if (parser.header_match && body_length > SYSEX_DT1_ADDRESS_SIZE + 1) {
+        const uint8_t *address = parser.buffer + dt1_header_length;
+        dt1 = (sysex_dt1_t) {
+            .valid = true,
+            // The checksum makes the sum of address, data and itself a multiple of 128
+            .checksum_ok = (parser.sum & 0x7F) == 0,
+            .dev_id = parser.dev_id,
+            .address = ((uint32_t)address[0] << 24) | ((uint32_t)address[1] << 16) |
+                       ((uint32_t)address[2] << 8) | address[3],
+            .data = parser.buffer + dt1_header_length + SYSEX_DT1_ADDRESS_SIZE,
+            .length = body_length - SYSEX_DT1_ADDRESS_SIZE - 1,
+        };
+    }
+
+    parser.buffer[parser.length++] = 0xF7;
+    parser.in_sysex = false;
+    ++stats.messages;
+
+    handle_sysex_message(&dt1);
+}
+
+static void route_message(midi_route_t route, const midi_message_t *message)
+{
+    switch (route) {
+        case MIDI_ROUTE_CHANNEL:
+            ++stats.channel_messages;
+            break;
+        case MIDI_ROUTE_COMMON:
+            ++stats.common_messages;
+            break;
+        default:
+            ++stats.realtime_messages;
+            break;
+    }
+
+    if (midi_handlers[route]) {
+        midi_handlers[route](message);
+    } else if (midi_queues[route] && xQueueSend(midi_queues[route], message, 0) != pdPASS) {
+        ++stats.route_drops;
+    }
+}
+
+// Data bytes outside of SysEx belong to the pending channel or common message
+static void append_message_data(const uint8_t *data, size_t length)
+{
+    midi_message_t *message = &parser.message;
+    for (size_t i = 0; i < length && message->status; ++i) {
+        message->data[message->length++] = data[i];
+        if (message->length < parser.expected_length) {
+            continue;
+        }
+
+        if (message->status < 0xF0) {
+            route_message(MIDI_ROUTE_CHANNEL, message);
+            // Running status: the next data bytes repeat the message
+            message->length = 0;
+        } else {
+            route_message(MIDI_ROUTE_COMMON, message);
+            message->status = 0;
+        }
+    }
+}
+
+static void begin_channel_message(uint8_t status)
+{
+    parser.message = (midi_message_t) { .status = status };
+    switch (status & 0xF0) {
+        case 0xC0:  // Program change
+        case 0xD0:  // Channel pressure
+            parser.expected_length = 1;
+            break;
+        default:
+            parser.expected_length = 2;
+            break;
+    }
+}
+
+static void begin_common_message(uint8_t status)
+{
+    parser.message = (midi_message_t) { .status = status };
+    switch (status) {
+        case 0xF1:  // MTC quarter frame
+        case 0xF3:  // Song select
+            parser.expected_length = 1;
+            break;
+        case 0xF2:  // Song position
+            parser.expected_length = 2;
+            break;
+        case 0xF6:  // Tune request
+            route_message(MIDI_ROUTE_COMMON, &parser.message);
+            parser.message.status = 0;
+            break;
+        default:
+            // Undefined, its data bytes are ignored
+            parser.message.status = 0;
+            break;
+    }
+}
+
+void sysex_feed(const uint8_t *data, size_t length, int64_t received_at)
+{
+    parser.received_at = received_at;
+    while (length > 0) {
+        size_t run = find_status_byte(data, length);
+        if (parser.in_sysex) {
+            append_span(data, run);
+        } else if (parser.message.status) {
+            append_message_data(data, run);
+        }
+        data += run;
+        length -= run;
+        if (length == 0) {
+            break;
+        }
+
+        uint8_t byte = *data++;
+        --length;
+
+        if (byte >= 0xF8) {
+            // Real-time bytes may appear anywhere, even inside SysEx
+            if (byte != 0xFE) {
+                route_message(MIDI_ROUTE_REALTIME, &(midi_message_t) { .status = byte });
             }
+            continue;
         }
-        if (!buffer_available) {
-            ESP_LOGW(TAG, "Buffer pool not available.");
+
+        if (parser.in_sysex && byte != 0xF7) {
+            // Any other status byte ends the SysEx before its EOX
+            ESP_LOGD(TAG, "SysEx interrupted by 0x%02x. Message discarded.", byte);
+            report_loss(parser.buffer, parser.length);
+            parser.in_sysex = false;
+        }
+
+        if (byte < 0xF0) {
+            begin_channel_message(byte);
+            continue;
+        }
+
+        // System messages cancel running status
+        parser.message.status = 0;
+        switch (byte) {
+            case 0xF0:
+                // system excusive start
+                begin_message();
+                break;
+            case 0xF7:
+                // EOX
+                if (parser.in_sysex) {
+                    finish_message();
+                } else {
+                    ESP_LOGD(TAG, "Unexpected EOX byte.");
+                }
+                break;
+            default:
+                begin_common_message(byte);
+                break;
         }
     }
 }
 
 static void sysex_parse_task(void *pvParameter)
 {
-    uint8_t buffer[SYSEX_BUFFER_SIZE];
-    bool in_sysex = false;
-    int length = 0;
-    uint8_t byte;
+    uint8_t record[MIDI_TRANSPORT_MAX_RECORD_SIZE];
+    midi_transport_chunk_header_t header;
     for (;;) {
-        if(xQueueReceive(parser_queue, &byte, portMAX_DELAY)) {
-            switch (byte) {
-                case 0xFE:
-                    // active sensing
-                    break;
-                case 0xF7:
-                    // EOX
-                    if (in_sysex) {
-                        buffer[length++] = byte;
-                        
-                        handle_sysex_message(buffer, length);
-
-                        length = 0;
-                        in_sysex = false;
-                    } else {
-                        ESP_LOGD(TAG, "Unexpected EOX byte.");
-                    }
-                    break;
-                case 0xF0:
-                    // system excusive start
-                    if (!in_sysex) {
-                        in_sysex = true;
-                        buffer[length++] = byte;
-                    } else {
-                        ESP_LOGD(TAG, "Unexpected SysEx start byte. Message discarded.");
-                        length = 0;
-                        buffer[length++] = byte;
-                    }
-                    break;
-                default:
-                    if (in_sysex) {
-                        buffer[length++] = byte;
-                    }
-                    break;
-            }
-            if (length >= SYSEX_BUFFER_SIZE) {
-                ESP_LOGE(TAG, "SysEx buffer overflow");
-                in_sysex = false;
-                length = 0;
-            }
+        size_t record_length = xMessageBufferReceive(parser_buffer, record, sizeof(record), portMAX_DELAY);
+        ++stats.parser_wakeups;
+        if (record_length < sizeof(header)) {
+            continue;
         }
+        memcpy(&header, record, sizeof(header));
+        sysex_feed(record + sizeof(header), record_length - sizeof(header), header.received_at);
+    }
+}
+
+static bool init_parser(void)
+{
+    init_buffer_pool();
+    memset(request_buckets, -1, sizeof(request_buckets));
+    request_timer = xTimerCreate("sysex_requests",
+                                 pdMS_TO_TICKS(SYSEX_REQUEST_TIMER_MS),
+                                 pdFALSE,
+                                 NULL,
+                                 expire_requests);
+    if (!request_timer) {
+        ESP_LOGE(TAG, "Failed to create request timer.");
+        return false;
     }
+
+    midi_transport_register_event_callback(handle_transport_event);
+    return true;
 }
 
-QueueHandle_t sysex_init()
+MessageBufferHandle_t sysex_init()
 {
-    g_sync_request_mutex = xSemaphoreCreateMutex();
-    if (!g_sync_request_mutex) {
-        ESP_LOGE(TAG, "Failed to create internal synchronous request mutex.");
+    if (!init_parser()) {
         return NULL;
     }
 
-    parser_queue = xQueueCreate(256, sizeof(uint8_t));
-    if (!parser_queue) {
-        ESP_LOGE(TAG, "Failed to create parser queue.");
+    parser_buffer = xMessageBufferCreate(SYSEX_PARSER_BUFFER_SIZE);
+    if (!parser_buffer) {
+        ESP_LOGE(TAG, "Failed to create parser buffer.");
         goto cleanup;
     }
 
@@ -207,17 +790,56 @@ QueueHandle_t sysex_init()
                 SYSEX_TASK_PRIORITY,
                 &parser_task);
 
-    return parser_queue;
+    return parser_buffer;
 
 cleanup:
-    vSemaphoreDelete(g_sync_request_mutex);
+    xTimerDelete(request_timer, 0);
     return NULL;
 }
 
+bool sysex_init_inline(void)
+{
+    if (!init_parser()) {
+        return false;
+    }
+
+    if (!midi_transport_register_receiver(sysex_feed)) {
+        ESP_LOGE(TAG, "Failed to register receiver.");
+        xTimerDelete(request_timer, 0);
+        return false;
+    }
+    return true;
+}
+
 void sysex_register_device_message_queue(QueueHandle_t queue) {
     device_message_queue = queue;
 }
 
+void sysex_register_loss_callback(sysex_loss_callback_t cbk) {
+    loss_cbk = cbk;
+}
+
+void sysex_register_midi_queue(midi_route_t route, QueueHandle_t queue) {
+    midi_queues[route] = queue;
+}
+
+void sysex_register_message_handler(sysex_message_handler_t handler) {
+    message_handler = handler;
+}
+
+void sysex_register_midi_handler(midi_route_t route, sysex_midi_handler_t handler) {
+    midi_handlers[route] = handler;
+}
+
+void sysex_register_dt1_header(const uint8_t *header, int length) {
+    if (length > SYSEX_DT1_MAX_HEADER_SIZE) {
+        ESP_LOGE(TAG, "DT1 header too long: %d", length);
+        return;
+    }
+    memcpy(dt1_header, header, length);
+    dt1_header_length = length;
+}
+
 void sysex_start_parsing()
 {
     is_callback_ready = true;
@@ -228,92 +850,179 @@ void sysex_stop_parsing()
     is_callback_ready = false;
 }
 
-int sysex_send(const uint8_t *message, int length)
+int sysex_send(const uint8_t *message, int length, midi_tx_lane_t lane)
 {
-    return uart_send(message, length);
+    return midi_tx_send(message, length, lane);
 }
 
-static bool _sysex_device_inquiry(sysex_identity_reply *identity, TickType_t timeout) {
-    if (g_sync_request_mutex == NULL) {
-        ESP_LOGE(TAG, "Not initialized yet");
-        return false;
-    }
-
-    sync_request_t *request;
-    uint8_t *buffer;
+int sysex_request(const uint8_t *message, int length, uint32_t address, uint32_t size,
+                  TickType_t timeout, sysex_request_callback_t cbk, void *arg)
+{
+    int index = -1;
+    uint32_t tag = 0;
 
-    if (xSemaphoreTake(g_sync_request_mutex, pdMS_TO_TICKS(100)))
-    {
-        if (g_sync_request != NULL)
-        {
-            ESP_LOGE(TAG, "Another sync request is already in progress");
-            xSemaphoreGive(g_sync_request_mutex);
-            return false;
+    portENTER_CRITICAL(&request_lock);
+    for (int i = 0; i < SYSEX_MAX_PENDING_REQUESTS; ++i) {
+        if (!requests[i].in_use) {
+            index = i;
+            break;
         }
+    }
+    if (index >= 0) {
+        requests[index] = (pending_request_t) {
+            .in_use = true,
+            .address = address,
+            .size = size,
+            .next_address = address,
+            .end = sysex_address_to_linear(address) + sysex_address_to_linear(size),
+            .sent_tick = xTaskGetTickCount(),
+            .timeout = timeout,
+            .sent_at = esp_timer_get_time(),
+            .tag = ++request_tags,
+            .cbk = cbk,
+            .arg = arg,
+        };
+        link_request(index);
+        tag = requests[index].tag;
+        ++stats.requests;
+        ++stats.requests_pending;
+    }
+    portEXIT_CRITICAL(&request_lock);
 
-        request = malloc(sizeof(sync_request_t));
-        buffer = malloc(SYSEX_IDENTITY_REPLY_LEN);
-    
-        if (!buffer || !request) {
-            ESP_LOGE(TAG, "Out of memory for request");
-            xSemaphoreGive(g_sync_request_mutex);
-            return false;
-        }
+    if (index < 0) {
+        ESP_LOGW(TAG, "Request table full");
+        return -1;
+    }
 
-        request->buffer = buffer;
-        request->completion = xSemaphoreCreateBinary();
+    int res = midi_tx_send_request(message, length, MIDI_TX_LANE_BULK, tag);
+    if (res < 0) {
+        // Never sent, drop it without calling back
+        portENTER_CRITICAL(&request_lock);
+        unlink_request(index);
+        requests[index].in_use = false;
+        --stats.requests;
+        --stats.requests_pending;
+        portEXIT_CRITICAL(&request_lock);
+        return res;
+    }
 
-        g_sync_request = request;
-        xSemaphoreGive(g_sync_request_mutex);
+    // Restarting a running timer would postpone every expiry while requests
+    // keep coming, so it is only armed when idle
+    if (xTimerIsTimerActive(request_timer) == pdFALSE) {
+        xTimerStart(request_timer, 0);
     }
-    else
-    {
-        ESP_LOGE(TAG, "Failed to aquire sync request mutex");
+    return res;
+}
+
+static void complete_sync_request(const sysex_request_result_t *result, void *arg)
+{
+    sync_wait_t *wait = arg;
+    *wait->result = *result;
+    wait->result->reply = NULL;
+    if (wait->reply && result->reply) {
+        int length = result->reply_length < wait->reply_size ? result->reply_length : wait->reply_size;
+        memcpy(wait->reply, result->reply, length);
+        wait->result->reply_length = length;
+    }
+    xTaskNotifyGive(wait->waiter);
+}
+
+static bool request_sync(const uint8_t *message, int length, uint32_t address, uint32_t size,
+                         TickType_t timeout, sysex_request_result_t *result,
+                         uint8_t *reply, int reply_size)
+{
+    sync_wait_t wait = {
+        .waiter = xTaskGetCurrentTaskHandle(),
+        .result = result,
+        .reply = reply,
+        .reply_size = reply_size,
+    };
+
+    if (sysex_request(message, length, address, size, timeout, complete_sync_request, &wait) < 0) {
         return false;
     }
 
-    int res = sysex_send(identity_request, SYSEX_IDENTITY_REQUEST_LEN);
-    if (res < 0) {
-        ESP_LOGE(TAG, "Failed to send identity request message");
-        goto cleanup;
+    // The request table calls back exactly once, on reply or timeout
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return result->status == SYSEX_REQUEST_COMPLETED;
+}
+
+bool sysex_request_sync(const uint8_t *message, int length, uint32_t address, uint32_t size,
+                        TickType_t timeout, sysex_request_result_t *result)
+{
+    return request_sync(message, length, address, size, timeout, result, NULL, 0);
+}
+
+bool sysex_cancel_request(uint32_t address)
+{
+    int index = -1;
+
+    portENTER_CRITICAL(&request_lock);
+    for (int i = 0; i < SYSEX_MAX_PENDING_REQUESTS; ++i) {
+        pending_request_t *request = &requests[i];
+        if (!request->in_use || request->cancelled || request->address != address ||
+            request->next_address != address) {
+            continue;
+        }
+        if (index < 0 || request->sent_at < requests[index].sent_at) {
+            index = i;
+        }
     }
+    if (index >= 0) {
+        // The callback runs from the timer task, not from the caller
+        requests[index].cancelled = true;
+    }
+    portEXIT_CRITICAL(&request_lock);
 
-    if (xSemaphoreTake(request->completion, timeout)) {
-        *identity = (sysex_identity_reply) {
-            .dev_id = buffer[2],
-            .manufacturer_id = buffer[5],
-            .dev_family_code_1 = buffer[6],
-            .dev_family_code_2 = buffer[7],
-            .dev_family_num_1 = buffer[8],
-            .dev_family_num_2 = buffer[9],
-            .sw_rev_lv_1 = buffer[10],
-            .sw_rev_lv_2 = buffer[11],
-            .sw_rev_lv_3 = buffer[12],
-            .sw_rev_lv_4 = buffer[13],
-        };
+    return index >= 0;
+}
+
+int sysex_get_free_request_slots(void)
+{
+    portENTER_CRITICAL(&request_lock);
+    int free_slots = SYSEX_MAX_PENDING_REQUESTS - stats.requests_pending;
+    portEXIT_CRITICAL(&request_lock);
+    return free_slots;
+}
 
-        vSemaphoreDelete(request->completion);
-        free(buffer);
-        request->buffer = NULL;
-        free(request);
+void sysex_get_stats(sysex_stats_t *out)
+{
+    portENTER_CRITICAL(&request_lock);
+    *out = stats;
+    out->pool_in_use = buffers_in_use();
+    out->request_rtt_avg_us = stats.requests_completed ?
+        request_rtt_total_us / stats.requests_completed : 0;
+    portEXIT_CRITICAL(&request_lock);
+}
 
-        return true;
-    } else {
-        ESP_LOGD(TAG, "Synchronous request timed out");
+static bool _sysex_device_inquiry(sysex_identity_reply *identity, TickType_t timeout) {
+    if (request_timer == NULL) {
+        ESP_LOGE(TAG, "Not initialized yet");
+        return false;
     }
 
-cleanup:
-    if (xSemaphoreTake(g_sync_request_mutex, portMAX_DELAY)) {
-        g_sync_request = NULL;
-        xSemaphoreGive(g_sync_request_mutex);
+    uint8_t buffer[SYSEX_IDENTITY_REPLY_LEN];
+    sysex_request_result_t result;
+
+    if (!request_sync(identity_request, SYSEX_IDENTITY_REQUEST_LEN, SYSEX_IDENTITY_ADDRESS, 0,
+                      timeout, &result, buffer, sizeof(buffer))) {
+        ESP_LOGD(TAG, "Synchronous request timed out");
+        return false;
     }
-    
-    vSemaphoreDelete(request->completion);
-    free(buffer);
-    request->buffer = NULL;
-    free(request);
 
-    return false;
+    *identity = (sysex_identity_reply) {
+        .dev_id = buffer[2],
+        .manufacturer_id = buffer[5],
+        .dev_family_code_1 = buffer[6],
+        .dev_family_code_2 = buffer[7],
+        .dev_family_num_1 = buffer[8],
+        .dev_family_num_2 = buffer[9],
+        .sw_rev_lv_1 = buffer[10],
+        .sw_rev_lv_2 = buffer[11],
+        .sw_rev_lv_3 = buffer[12],
+        .sw_rev_lv_4 = buffer[13],
+    };
+    return true;
 }
 
 bool sysex_device_inquiry(sysex_identity_reply *identity, TickType_t timeout, int retry) {
@@ -335,7 +1044,10 @@ bool sysex_device_inquiry(sysex_identity_reply *identity, TickType_t timeout, in
 void sysex_deinit()
 {
     parser_cbk = NULL;
-    vTaskDelete(parser_task);
-    vSemaphoreDelete(g_sync_request_mutex);
+    if (parser_task) {
+        vTaskDelete(parser_task);
+        parser_task = NULL;
+    }
+    xTimerDelete(request_timer, 0);
     return;
 }
\ No newline at end of file
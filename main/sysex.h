@@ -3,11 +3,42 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/message_buffer.h"
+#include "midi_tx.h"
 
-#define SYSEX_MAX_MESSAGE_SIZE            256
+// A 256-byte block reply plus its DT1 envelope fits
+#define SYSEX_MAX_MESSAGE_SIZE            320
+#define SYSEX_SLAB_CLASSES                3
+#define SYSEX_DT1_MAX_HEADER_SIZE         16
+#define SYSEX_DT1_ADDRESS_SIZE            4
+#define SYSEX_MAX_PENDING_REQUESTS        16
+// Data bytes of each part but the last of a reply the device splits
+#define SYSEX_REPLY_SPLIT_SIZE            128
 
 typedef void(*parser_callback_t)(uint8_t*, int);
 
+// Roland addresses and sizes carry 7 bits per byte
+static inline uint32_t sysex_address_to_linear(uint32_t address) {
+    return ((address >> 24) & 0x7F) << 21 | ((address >> 16) & 0x7F) << 14 |
+           ((address >> 8) & 0x7F) << 7 | (address & 0x7F);
+}
+
+static inline uint32_t sysex_linear_to_address(uint32_t linear) {
+    return ((linear >> 21) & 0x7F) << 24 | ((linear >> 14) & 0x7F) << 16 |
+           ((linear >> 7) & 0x7F) << 8 | (linear & 0x7F);
+}
+
+// True if length data bytes at the next address a reply is expected at can be
+// part of it, with remaining bytes outstanding: all of them, or a full split
+// part. Anything else there is a notification that happens to share the address.
+static inline bool sysex_is_reply_part(int length, uint32_t remaining) {
+    return length == remaining || (length == SYSEX_REPLY_SPLIT_SIZE && length < remaining);
+}
+
+// Called when a message could not be delivered. message holds whatever part of
+// it is known (possibly truncated), or is NULL when nothing is known about it.
+typedef void(*sysex_loss_callback_t)(const uint8_t *message, int length);
+
 typedef struct {
     uint8_t dev_id;
     uint8_t manufacturer_id;
@@ -22,17 +53,119 @@ typedef struct {
 } sysex_identity_reply;
 
 typedef struct {
-    uint8_t data[SYSEX_MAX_MESSAGE_SIZE];
+    uint32_t parser_wakeups;
+    uint32_t messages;
+    uint32_t lost_messages;
+    uint32_t stream_losses;
+    uint32_t channel_messages;
+    uint32_t common_messages;
+    uint32_t realtime_messages;
+    uint32_t route_drops;           // Non-SysEx messages whose queue was full
+    uint32_t requests;
+    uint32_t requests_completed;
+    uint32_t requests_timed_out;
+    uint32_t requests_cancelled;
+    uint32_t requests_pending;
+    uint32_t request_rtt_last_us;   // From sysex_request() to the last reply
+    uint32_t request_rtt_avg_us;
+    uint32_t request_rtt_max_us;
+    uint32_t pool_allocations;
+    uint32_t pool_alloc_failures;   // Messages started while no buffer was free
+    uint32_t pool_exhausted;        // Times the last free buffer was claimed
+    uint32_t pool_in_use;
+    uint32_t pool_high_water;
+    uint32_t pool_promotions;       // Messages moved to a larger size class
+    uint32_t pool_class_high_water[SYSEX_SLAB_CLASSES];
+} sysex_stats_t;
+
+typedef enum {
+    SYSEX_REQUEST_COMPLETED,
+    SYSEX_REQUEST_TIMED_OUT,
+    SYSEX_REQUEST_CANCELLED,        // By sysex_cancel_request(), before any reply
+} sysex_request_status_t;
+
+typedef struct {
+    sysex_request_status_t status;
+    uint32_t address;
+    uint32_t size;
+    uint32_t rtt_us;
+    const uint8_t *reply;           // Last reply, valid during the callback only
+    int reply_length;
+} sysex_request_result_t;
+
+// Called exactly once per request, from the parser task on completion or the
+// timer task on timeout. Must not block.
+typedef void (*sysex_request_callback_t)(const sysex_request_result_t *result, void *arg);
+
+typedef enum {
+    MIDI_ROUTE_CHANNEL,             // 0x80-0xEF, running status resolved
+    MIDI_ROUTE_COMMON,              // 0xF1-0xF6
+    MIDI_ROUTE_REALTIME,            // 0xF8-0xFF except active sensing
+    MIDI_ROUTE_MAX,
+} midi_route_t;
+
+typedef struct {
+    uint8_t status;
+    uint8_t data[2];
+    uint8_t length;                 // Number of data bytes
+} midi_message_t;
+
+// DT1 (data set) fields, filled in by the parser while the message is copied
+typedef struct {
+    bool valid;                 // Header matched the registered DT1 header
+    bool checksum_ok;
+    uint8_t dev_id;
+    uint32_t address;
+    uint8_t *data;              // Points into the owning buffer
     int length;
-    bool in_use;
+} sysex_dt1_t;
+
+typedef struct {
+    uint8_t *data;
+    int capacity;
+    int length;
+    sysex_dt1_t dt1;
+    int64_t received_at;            // Arrival time of the chunk holding the EOX
+    uint8_t slab;                   // Size class and free list link, owned by sysex.c
+    int next_free;
 } sysex_buffer_t;
 
-QueueHandle_t sysex_init();
+// Run-to-completion handlers, called from the parsing task. They must not
+// block or wait for a reply, and the message is valid during the call only.
+typedef void (*sysex_message_handler_t)(const sysex_buffer_t *message);
+typedef void (*sysex_midi_handler_t)(const midi_message_t *message);
+
+MessageBufferHandle_t sysex_init();
+// Parses in the transport's receive task instead of a parser task
+bool sysex_init_inline(void);
 void sysex_register_device_message_queue(QueueHandle_t queue);
+void sysex_register_loss_callback(sysex_loss_callback_t cbk);
+// Queue of midi_message_t, sent to without blocking
+void sysex_register_midi_queue(midi_route_t route, QueueHandle_t queue);
+// A registered handler takes the place of the device queue or route queue
+void sysex_register_message_handler(sysex_message_handler_t handler);
+void sysex_register_midi_handler(midi_route_t route, sysex_midi_handler_t handler);
+// 0xFF in the header marks the device id, which matches any value
+void sysex_register_dt1_header(const uint8_t *header, int length);
+// received_at is the esp_timer_get_time() arrival time of the data
+void sysex_feed(const uint8_t *data, size_t length, int64_t received_at);
 void sysex_start_parsing();
 void sysex_free_buffer(sysex_buffer_t *buffer);
 bool sysex_device_inquiry(sysex_identity_reply *identity, TickType_t timeout, int retry);
-int sysex_send(const uint8_t *message, int length);
+int sysex_send(const uint8_t *message, int length, midi_tx_lane_t lane);
+// Sends an RQ1 and tracks it until DT1 replies cover address..address+size.
+// Address and size are 7 bits per byte, as on the wire. cbk may be NULL.
+int sysex_request(const uint8_t *message, int length, uint32_t address, uint32_t size,
+                  TickType_t timeout, sysex_request_callback_t cbk, void *arg);
+// Blocks the calling task (using its notification) until the request completes or times out
+bool sysex_request_sync(const uint8_t *message, int length, uint32_t address, uint32_t size,
+                        TickType_t timeout, sysex_request_result_t *result);
+// Marks the oldest request for address that has no reply yet as cancelled.
+// It completes as SYSEX_REQUEST_CANCELLED from the timer task on its next
+// pass, so the caller never runs the callback. Returns false if there is none.
+bool sysex_cancel_request(uint32_t address);
+int sysex_get_free_request_slots(void);
+void sysex_get_stats(sysex_stats_t *stats);
 void sysex_deinit();
 
 #endif
\ No newline at end of file
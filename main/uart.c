@@ -1,12 +1,11 @@
 /*
  * SPDX-FileCopyrightText: 2025 mhl6829
  * SPDX-License-Identifier: MIT
- * File: [uart.c] - UART driver and byte message producer
+ * File: [uart.c] - UART MIDI transport
  */
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
-#include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "esp_log.h"
 
@@ -17,51 +16,98 @@
 #define UART_TX_PIN                 21
 #define UART_RX_PIN                 20
 
+// 1: wake once per SysEx frame using EOX pattern detection
+// 0: wake on every RX FIFO event and forward raw chunks
+#define UART_RX_PATTERN_FRAMING     0
+
+#if UART_RX_PATTERN_FRAMING
+// Large enough to hold a whole block reply until its EOX arrives
+#define UART_RX_BUF_SIZE            1024
+#else
 #define UART_RX_BUF_SIZE            256
+#endif
 #define UART_TX_BUF_SIZE            0
-#define UART_MSG_BUF_SIZE           32
+#define UART_MSG_BUF_SIZE           MIDI_TRANSPORT_MAX_CHUNK_SIZE
 
 #define UART_QUEUE_SIZE             20
 
+#define UART_PATTERN_CHR            0xF7
+#define UART_PATTERN_QUEUE_SIZE     16
+#define UART_RX_SPILL_THRESHOLD     (UART_RX_BUF_SIZE / 2)
+
 #define UART_TASK_STACK_SIZE        2048
 #define UART_TASK_PRIORITY          10
 
-#define UART_MAX_CONSUMERS          10
-
 #define TAG "UART"
 
 
-static QueueHandle_t consumers[UART_MAX_CONSUMERS];
-static size_t consumer_count = 0;
-static SemaphoreHandle_t consumer_mutex;
-
 static QueueHandle_t uart_queue;
 static TaskHandle_t uart_task;
+static uint32_t uart_task_stack_size = UART_TASK_STACK_SIZE;
+
+static midi_transport_receive_cb_t on_receive;
+static midi_transport_event_cb_t on_event;
 
+static uart_stats_t stats;
 
-int uart_send(const uint8_t *data, int len)
+
+static int uart_send(const uint8_t *data, int len)
 {
     return uart_write_bytes(UART_NUM, data, len);
 }
 
-static void dispatch_byte(uint8_t *bytes, int len)
+static size_t read_and_dispatch(size_t size, uint8_t *msg)
 {
-    if (xSemaphoreTake(consumer_mutex, portMAX_DELAY)) {
-        for (int i = 0; i < UART_MAX_CONSUMERS; ++i) {
-            if (consumers[i] == NULL) {
-                continue;
-            }
-            for (int j = 0; j < len; ++j) {
-                BaseType_t result = xQueueSend(consumers[i], &bytes[j], pdMS_TO_TICKS(100));
-                if (result != pdPASS) {
-                    ESP_LOGW(TAG, "Failed to send to consumer %d queue. Queue full?", i);
-                }
-            }
+    size_t remaining = size;
+    while (remaining > 0) {
+        size_t chunk = remaining < UART_MSG_BUF_SIZE ? remaining : UART_MSG_BUF_SIZE;
+        int len = uart_read_bytes(UART_NUM, (void *)msg, chunk, pdMS_TO_TICKS(20));
+        if (len <= 0) {
+            break;
+        }
+        on_receive(msg, len);
+        ++stats.rx_chunks;
+        remaining -= len;
+    }
+    return size - remaining;
+}
+
+#if UART_RX_PATTERN_FRAMING
+static void handle_pattern_detected(uint8_t *msg)
+{
+    int pos = uart_pattern_pop_pos(UART_NUM);
+    if (pos < 0) {
+        // Pattern position queue overflowed, positions are lost.
+        // Hand over everything buffered and let the parser resync on F0/F7.
+        size_t buffered = 0;
+        uart_get_buffered_data_len(UART_NUM, &buffered);
+        read_and_dispatch(buffered, msg);
+        ++stats.rx_fallbacks;
+        return;
+    }
+
+    // Everything up to and including EOX is one frame. Frames larger than a
+    // chunk are split, the parser does not depend on chunk boundaries.
+    read_and_dispatch(pos + 1, msg);
+    ++stats.rx_frames;
+}
+
+static void handle_framed_data(const uart_event_t *event, uint8_t *msg)
+{
+    size_t buffered = 0;
+    uart_get_buffered_data_len(UART_NUM, &buffered);
+
+    // Hand over unframed bytes when the line went idle without an EOX
+    // (non-SysEx traffic, truncated message) or when a long message is
+    // about to span the RX buffer boundary.
+    if ((event->timeout_flag && uart_pattern_get_pos(UART_NUM) < 0) ||
+        buffered >= UART_RX_SPILL_THRESHOLD) {
+        if (read_and_dispatch(buffered, msg) > 0) {
+            ++stats.rx_fallbacks;
         }
-        vTaskDelay(1);
-        xSemaphoreGive(consumer_mutex);
     }
 }
+#endif
 
 static void uart_receive_task()
 {
@@ -71,27 +117,40 @@ static void uart_receive_task()
     for (;;)
     {
         if (xQueueReceive(uart_queue, (void *)&event, portMAX_DELAY)) {
+            ++stats.rx_wakeups;
             switch (event.type) {
                 case UART_DATA:
-                    int len = uart_read_bytes(UART_NUM, (void *)&msg, event.size, pdMS_TO_TICKS(20));
-                    if (len > 0)
-                    {
-                        dispatch_byte(msg, len);
-                    }
+#if UART_RX_PATTERN_FRAMING
+                    handle_framed_data(&event, msg);
+#else
+                    read_and_dispatch(event.size, msg);
+#endif
+                    break;
+#if UART_RX_PATTERN_FRAMING
+                case UART_PATTERN_DET:
+                    handle_pattern_detected(msg);
                     break;
+#endif
                 case UART_BUFFER_FULL:
                 case UART_FIFO_OVF:
                     ESP_LOGW(TAG, "Rx buffer overflow");
+                    ++stats.rx_overflows;
                     uart_flush_input(UART_NUM);
+                    on_event(MIDI_TRANSPORT_EVENT_RX_OVERFLOW);
                     xQueueReset(uart_queue); 
+#if UART_RX_PATTERN_FRAMING
+                    uart_pattern_queue_reset(UART_NUM, UART_PATTERN_QUEUE_SIZE);
+#endif
                     break;
 
                 case UART_FRAME_ERR:
                     ESP_LOGW(TAG, "UART Frame error");
+                    on_event(MIDI_TRANSPORT_EVENT_FRAME_ERROR);
                     break;
 
                 case UART_PARITY_ERR:
                     ESP_LOGW(TAG, "Parity error");
+                    on_event(MIDI_TRANSPORT_EVENT_PARITY_ERROR);
                     break;
 
                 default:
@@ -101,8 +160,11 @@ static void uart_receive_task()
     }
 }
 
-void uart_driver_init()
+static bool uart_open(midi_transport_receive_cb_t receive_cbk, midi_transport_event_cb_t event_cbk)
 {
+    on_receive = receive_cbk;
+    on_event = event_cbk;
+
     uart_config_t uart_config = {
         .baud_rate = UART_BAUDRATE,
         .data_bits = UART_DATA_8_BITS,
@@ -127,62 +189,33 @@ void uart_driver_init()
                                         &uart_queue,
                                         0));
 
-    consumer_mutex = xSemaphoreCreateMutex();
-    
+#if UART_RX_PATTERN_FRAMING
+    ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(UART_NUM, UART_PATTERN_CHR, 1, 9, 0, 0));
+    ESP_ERROR_CHECK(uart_pattern_queue_reset(UART_NUM, UART_PATTERN_QUEUE_SIZE));
+#endif
+
     ESP_LOGD(TAG, "UART Initialized");
 
     xTaskCreate(uart_receive_task,
                 "uart_recv",
-                UART_TASK_STACK_SIZE,
+                uart_task_stack_size,
                 NULL,
                 UART_TASK_PRIORITY,
                 &uart_task);
-    return;
-}
-
-int uart_register_consumer(QueueHandle_t q)
-{
-    if (consumer_count >= UART_MAX_CONSUMERS) {
-        return -1;
-    }
-
-    xSemaphoreTake(consumer_mutex, portMAX_DELAY);    
-    for (size_t i = 0; i < UART_MAX_CONSUMERS; ++i) {
-        if (!consumers[i]) {
-            consumers[i] = q;
-            ++consumer_count;
-            xSemaphoreGive(consumer_mutex);
-            return i;
-        }
-    }
-    xSemaphoreGive(consumer_mutex);
-    return -1;
+    return true;
 }
 
-void uart_deregister_consumer(int consumer_id)
+void uart_get_stats(uart_stats_t *out)
 {
-    if (consumer_id < 0 || consumer_id >= UART_MAX_CONSUMERS) {
-        return;
-    }
-
-    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
-    consumers[consumer_id] = NULL;
-    --consumer_count;
-    xSemaphoreGive(consumer_mutex);
-    return;
+    *out = stats;
 }
 
-static void cleanup_consumers(void)
+void uart_set_task_stack_size(uint32_t size)
 {
-    xSemaphoreTake(consumer_mutex, portMAX_DELAY);
-    for (size_t i = 0; i < UART_MAX_CONSUMERS; i++) {
-        consumers[i] = NULL;
-    }
-    consumer_count = 0;
-    xSemaphoreGive(consumer_mutex);
+    uart_task_stack_size = size;
 }
 
-void uart_driver_deinit(void)
+static void uart_close(void)
 {
     if (uart_task != NULL) {
         vTaskDelete(uart_task);
@@ -190,12 +223,18 @@ void uart_driver_deinit(void)
     }
     
     uart_driver_delete(UART_NUM);
-    cleanup_consumers();
-
-    if (consumer_mutex != NULL) {
-        vSemaphoreDelete(consumer_mutex);
-        consumer_mutex = NULL;
-    }
     
     ESP_LOGD(TAG, "UART Deinitialized");
+}
+
+static const midi_transport_t uart_transport = {
+    .name = "uart",
+    .open = uart_open,
+    .close = uart_close,
+    .send = uart_send,
+};
+
+const midi_transport_t *uart_get_transport(void)
+{
+    return &uart_transport;
 }
\ No newline at end of file
@@ -2,12 +2,19 @@
 #define _UART_H
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "midi_transport.h"
 
-void uart_driver_init(void);
-void uart_driver_deinit(void);
-int uart_register_consumer(QueueHandle_t q);
-void uart_deregister_consumer(int consumer_id);
-int uart_send(const uint8_t *data, int len);
+typedef struct {
+    uint32_t rx_wakeups;        // Events handled by the receive task
+    uint32_t rx_chunks;         // Chunks handed to consumers
+    uint32_t rx_frames;         // EOX-terminated frames (pattern framing only)
+    uint32_t rx_fallbacks;      // Unframed spills (pattern framing only)
+    uint32_t rx_overflows;
+} uart_stats_t;
+
+const midi_transport_t *uart_get_transport(void);
+void uart_get_stats(uart_stats_t *stats);
+// Takes effect on the next open, for receivers that run on the receive task
+void uart_set_task_stack_size(uint32_t size);
 
 #endif